@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "decode.h"
+#include "elf_parser.h"
+
+#include <getopt.h>
+
+// Translate the ROM of an ELF file into C (see aot.h). The blocks start at
+// the entry point and at every target of a jump or branch, return address
+// and branch fall-through found from there, and end at the next jump,
+// branch or undefined instruction, or where another block starts.
+
+void print_usage(FILE *fh)
+{
+    fprintf(fh, "Usage: aot [-R SIZE] [-M SIZE] FILENAME OUTPUT\n");
+    fprintf(fh, "Options:\n");
+    fprintf(fh, "  -R SIZE  : ROM size in bytes, a power of 2 up to 64K (default: %d)\n", INST_ROM_SIZE);
+    fprintf(fh, "  -M SIZE  : RAM size in bytes, a power of 2 up to 64K (default: %d)\n", DATA_RAM_SIZE);
+}
+
+_Noreturn void print_usage_to_exit(void)
+{
+    print_usage(stderr);
+    exit(1);
+}
+
+int parse_mem_size_or_exit(const char *s)
+{
+    int size = parse_mem_size(s);
+    if (size < 0) {
+        fprintf(stderr, "Invalid memory size :%s\n", s);
+        exit(1);
+    }
+    return size;
+}
+
+static int is_jump(int id)
+{
+    return (id >= INST_J && id <= INST_JBE) || id == INST_UNDEF;
+}
+
+// Mark every block start reachable from the entry point in leader[pc/2].
+void find_blocks(struct cpu *c, uint8_t *leader)
+{
+    uint16_t *todo = malloc(sizeof(uint16_t) * c->rom_size);
+    int ntodo = 0;
+    todo[ntodo++] = c->pc & c->rom_mask;
+    leader[todo[0] >> 1] = 1;
+
+#define FOUND(target) do { \
+        uint16_t t_ = (target) & c->rom_mask; \
+        if (!(t_ & 1) && !leader[t_ >> 1]) { \
+            leader[t_ >> 1] = 1; \
+            todo[ntodo++] = t_; \
+        } \
+    } while (0)
+
+    while (ntodo > 0) {
+        uint16_t addr = todo[--ntodo];
+        struct inst_op op;
+        do {
+            inst_decode(c, inst_list, addr, &op);
+            switch (op.id) {
+                case INST_J:    FOUND(addr + 2 + op.imm); break;
+                case INST_JAL:  FOUND(addr + 2 + op.imm); FOUND(addr + 4); break;
+                case INST_JALR: FOUND(addr + 2); break;
+                case INST_JL: case INST_JLE: case INST_JE:
+                case INST_JNE: case INST_JB: case INST_JBE:
+                    FOUND(addr + op.imm); FOUND(addr + 2); break;
+            }
+            addr = (addr + op.len) & c->rom_mask;
+        } while (!is_jump(op.id) && !leader[addr >> 1]);
+    }
+#undef FOUND
+    free(todo);
+}
+
+// The locals that hold the flags of the last update before the branch
+// that ends a block, or the fields of struct cpu that flags_set() fills
+// if none reads them in the block.
+static void emit_flags(FILE *fh, int where, const char *kind)
+{
+    if (where == 1)
+        fprintf(fh, " fs = s; fd = d; fr = r;");
+    else if (where == 2)
+        fprintf(fh, " c->flags_kind = %s; c->flags_s = s; c->flags_d = d; c->flags_res = r;", kind);
+}
+
+// { s = S; d = D; r = R; flags; then }, as the handlers compute them.
+static void emit_op(FILE *fh, int where, const char *kind, const char *s, const char *d,
+                    const char *r, const char *then)
+{
+    fprintf(fh, "    { uint16_t s = %s, d = %s, r = %s;", s, d, r);
+    emit_flags(fh, where, kind);
+    fprintf(fh, "%s%s }\n", *then ? " " : "", then);
+}
+
+// Emit the block of n instructions at ops, the first at start.
+void emit_block(FILE *fh, uint16_t start, const struct inst_op *ops, const uint16_t *offs, int n)
+{
+    // Which flag updates are live, as in block.c, and where they go.
+    int where[n], live = 1, setter = -1;
+    for (int i = n - 1; i >= 0; i--) {
+        int id = ops[i].id;
+        where[i] = 0;
+        if (id >= INST_J && id <= INST_JR)
+            live = 0;
+        else if (id >= INST_JL && id <= INST_JBE)
+            live = 1;
+        else if (inst_flagless[id] != NULL) {
+            if (live) {
+                int branch = ops[n-1].id >= INST_JL && ops[n-1].id <= INST_JBE;
+                where[i] = branch && id != INST_NOP ? 1 : 2;
+                setter = i;
+            }
+            live = 0;
+        }
+    }
+
+    // The registers each instruction reads or writes, to keep in locals.
+    uint32_t used = 0, written = 0;
+    int mem = 0;
+    for (int i = 0; i < n; i++) {
+        const struct inst_op *op = &ops[i];
+        switch (op->id) {
+            case INST_LWSP: case INST_SWSP:
+                used |= 1 << 1;
+                break;
+            case INST_JAL: case INST_JALR:
+                written |= 1 << 0;
+                break;
+        }
+        if (op->id <= INST_SB)
+            mem = 1;
+        if ((op->id >= INST_LW && op->id <= INST_CMPI) || op->id == INST_JALR || op->id == INST_JR)
+            used |= 1 << op->rd | 1 << op->rs;
+        if ((op->id >= INST_LW && op->id <= INST_LB) || (op->id >= INST_MOV && op->id <= INST_ASR)
+            || op->id == INST_LI || op->id == INST_ADDI || op->id == INST_LWSP)
+            written |= 1 << op->rd;
+    }
+    used |= written;
+
+    uint16_t end = offs[n-1] + ops[n-1].len;
+    fprintf(fh, "// 0x%04x-0x%04x\n", start, (start + end - 1) & 0xFFFF);
+    fprintf(fh, "static void block_%04x(struct cpu *c)\n{\n", start);
+    fprintf(fh, "    uint16_t pc = c->pc;\n");
+    if (mem)
+        fprintf(fh, "    uint8_t *ram = c->data_ram;\n");
+    for (int r = 0; r < 16; r++)
+        if (used & 1 << r)
+            fprintf(fh, "    uint16_t x%d = c->reg[%d];\n", r, r);
+    if (setter >= 0 && where[setter] == 1)
+        fprintf(fh, "    uint16_t fs, fd, fr;\n");
+
+    for (int i = 0; i < n; i++) {
+        const struct inst_op *op = &ops[i];
+        char rd[8], rs[8], imm[16], neg[24], then[64];
+        uint16_t off = offs[i];
+        sprintf(rd, "x%d", op->rd);
+        sprintf(rs, "x%d", op->rs);
+        sprintf(imm, "0x%04x", op->imm);
+        sprintf(neg, "0x%04x", (uint16_t)(~op->imm + 1));
+        const char *name = op->id == INST_UNDEF ? "UNDEF" : inst_list[op->id].name;
+        fprintf(fh, "    // 0x%04x %s\n", (start + off) & 0xFFFF, name);
+        switch (op->id) {
+            case INST_LW:
+            case INST_LBU:
+            case INST_LB:
+                sprintf(then, op->id == INST_LW ? "%s = aot_read_w(ram, RAM_MASK, r);" :
+                        op->id == INST_LBU ? "%s = ram[r & RAM_MASK];" : "%s = (int8_t)ram[r & RAM_MASK];", rd);
+                emit_op(fh, where[i], "FLAGS_ADDR", imm, rs, "s + d", then);
+                break;
+            case INST_LWSP:
+                sprintf(then, "%s = aot_read_w(ram, RAM_MASK, r);", rd);
+                emit_op(fh, where[i], "FLAGS_ADDR", imm, "x1", "s + d", then);
+                break;
+            case INST_SW:
+            case INST_SB:
+                sprintf(then, op->id == INST_SW ? "aot_write_w(ram, RAM_MASK, r, %s);" :
+                        "ram[r & RAM_MASK] = %s & 0xFF;", rs);
+                emit_op(fh, where[i], "FLAGS_ADDR", imm, rd, "s + d", then);
+                break;
+            case INST_SWSP:
+                sprintf(then, "aot_write_w(ram, RAM_MASK, r, %s);", rs);
+                emit_op(fh, where[i], "FLAGS_ADDR", imm, "x1", "s + d", then);
+                break;
+            case INST_MOV:
+                sprintf(then, "%s = r;", rd);
+                emit_op(fh, where[i], "FLAGS_MOV", "0", "0", rs, then);
+                break;
+            case INST_LI:
+                sprintf(then, "%s = r;", rd);
+                emit_op(fh, where[i], "FLAGS_MOV", "0", "0", imm, then);
+                break;
+            case INST_ADD:
+            case INST_SUB:
+            case INST_AND:
+            case INST_OR:
+            case INST_XOR:
+            case INST_LSL:
+            case INST_LSR:
+            case INST_ASR:
+            case INST_CMP: {
+                static const char * const res[] = {
+                    [INST_ADD] = "s + d", [INST_SUB] = "s + d", [INST_AND] = "s & d",
+                    [INST_OR] = "s | d", [INST_XOR] = "s ^ d", [INST_LSL] = "d << s",
+                    [INST_LSR] = "d >> s", [INST_ASR] = "(int16_t)d >> s", [INST_CMP] = "s + d",
+                };
+                const char *kind = op->id == INST_ADD ? "FLAGS_ADD" :
+                    op->id == INST_SUB || op->id == INST_CMP ? "FLAGS_SUB" : "FLAGS_LOGIC";
+                char s[16];
+                sprintf(s, op->id == INST_SUB || op->id == INST_CMP ? "~%s + 1" : "%s", rs);
+                sprintf(then, op->id == INST_CMP ? "" : "%s = r;", rd);
+                emit_op(fh, where[i], kind, s, rd, res[op->id], then);
+                break;
+            }
+            case INST_ADDI:
+            case INST_CMPI:
+                sprintf(then, op->id == INST_ADDI ? "%s = r;" : "", rd);
+                emit_op(fh, where[i], op->id == INST_ADDI ? "FLAGS_ADD" : "FLAGS_SUB",
+                        op->id == INST_ADDI ? imm : neg, rd, "s + d", then);
+                break;
+            case INST_NOP:
+                if (where[i])
+                    fprintf(fh, "    flags_clear(c);\n");
+                break;
+            case INST_J:
+            case INST_JAL: {
+                uint16_t delta = 2 + op->imm;
+                fprintf(fh, "    flags_clear(c);\n");
+                if (op->id == INST_JAL)
+                    fprintf(fh, "    x0 = pc + 0x%04x;\n", (uint16_t)(off + 4));
+                fprintf(fh, "    c->pc = pc + 0x%04x;\n", (uint16_t)(off + delta));
+                if (delta == 0)
+                    fprintf(fh, "    c->halt = HALT_LOOP;\n");
+                break;
+            }
+            case INST_JALR:
+            case INST_JR:
+                fprintf(fh, "    flags_clear(c);\n");
+                if (op->id == INST_JALR)
+                    fprintf(fh, "    x0 = pc + 0x%04x;\n", (uint16_t)(off + 2));
+                fprintf(fh, "    c->pc = %s;\n", rs);
+                fprintf(fh, "    if (c->pc == (uint16_t)(pc + 0x%04x))\n", off);
+                fprintf(fh, "        c->halt = HALT_LOOP;\n");
+                break;
+            case INST_JL:
+            case INST_JLE:
+            case INST_JE:
+            case INST_JNE:
+            case INST_JB:
+            case INST_JBE: {
+                static const char * const cond[] = {
+                    [INST_JL] = "c->flag_sign != c->flag_overflow",
+                    [INST_JLE] = "c->flag_sign != c->flag_overflow || c->flag_zero == 1",
+                    [INST_JE] = "c->flag_zero == 1",
+                    [INST_JNE] = "c->flag_zero == 0",
+                    [INST_JB] = "c->flag_carry == 1",
+                    [INST_JBE] = "c->flag_carry == 1 || c->flag_zero == 1",
+                };
+                if (setter >= 0 && where[setter] == 1) {
+                    static const char * const kinds[] = {
+                        [INST_LW] = "FLAGS_ADDR", [INST_LWSP] = "FLAGS_ADDR", [INST_LBU] = "FLAGS_ADDR",
+                        [INST_LB] = "FLAGS_ADDR", [INST_SW] = "FLAGS_ADDR", [INST_SWSP] = "FLAGS_ADDR",
+                        [INST_SB] = "FLAGS_ADDR", [INST_MOV] = "FLAGS_MOV", [INST_ADD] = "FLAGS_ADD",
+                        [INST_SUB] = "FLAGS_SUB", [INST_AND] = "FLAGS_LOGIC", [INST_OR] = "FLAGS_LOGIC",
+                        [INST_XOR] = "FLAGS_LOGIC", [INST_LSL] = "FLAGS_LOGIC", [INST_LSR] = "FLAGS_LOGIC",
+                        [INST_ASR] = "FLAGS_LOGIC", [INST_CMP] = "FLAGS_SUB", [INST_LI] = "FLAGS_MOV",
+                        [INST_ADDI] = "FLAGS_ADD", [INST_CMPI] = "FLAGS_SUB",
+                    };
+                    fprintf(fh, "    flags_compute(c, %s, fs, fd, fr);\n", kinds[ops[setter].id]);
+                }
+                else
+                    fprintf(fh, "    flags_eval(c);\n");
+                fprintf(fh, "    if (%s) {\n", cond[op->id]);
+                fprintf(fh, "        c->pc = pc + 0x%04x;\n", (uint16_t)(off + op->imm));
+                if (op->id == INST_JNE && op->imm == 0)
+                    fprintf(fh, "        c->halt = HALT_LOOP;\n");
+                fprintf(fh, "    }\n    else\n");
+                fprintf(fh, "        c->pc = pc + 0x%04x;\n", (uint16_t)(off + 2));
+                fprintf(fh, "    flags_clear(c);\n");
+                break;
+            }
+            case INST_UNDEF:
+                fprintf(fh, "    c->halt = HALT_LOOP;\n");
+                fprintf(fh, "    c->pc = pc + 0x%04x;\n", off);
+                break;
+        }
+    }
+    if (!is_jump(ops[n-1].id))
+        fprintf(fh, "    c->pc = pc + 0x%04x;\n", end);
+    for (int r = 0; r < 16; r++)
+        if (written & 1 << r)
+            fprintf(fh, "    c->reg[%d] = x%d;\n", r, r);
+    fprintf(fh, "}\n\n");
+}
+
+void emit_bytes(FILE *fh, const char *name, const uint8_t *mem, int size)
+{
+    int len = size;
+    while (len > 0 && mem[len - 1] == 0)
+        len--;
+    fprintf(fh, "static const uint8_t %s[%d] = {", name, len > 0 ? len : 1);
+    for (int i = 0; i < len; i++)
+        fprintf(fh, "%s0x%02x,", i % 16 == 0 ? "\n    " : " ", mem[i]);
+    fprintf(fh, "\n};\n");
+    fprintf(fh, "#define %s_LEN %d\n\n", name, len);
+}
+
+int main(int argc, char *argv[])
+{
+    struct cpu cpu;
+    int rom_size = INST_ROM_SIZE, ram_size = DATA_RAM_SIZE, opt;
+    while ((opt = getopt(argc, argv, "R:M:")) != -1) {
+        switch (opt) {
+            case 'R':
+                rom_size = parse_mem_size_or_exit(optarg);
+                break;
+
+            case 'M':
+                ram_size = parse_mem_size_or_exit(optarg);
+                break;
+
+            default:
+                print_usage_to_exit();
+        }
+    }
+    if (argc - optind != 2) print_usage_to_exit();
+
+    init_cpu(&cpu, rom_size, ram_size);
+    elf_parse(&cpu, argv[optind]);
+    decode_init();
+
+    FILE *fh;
+    if ((fh = fopen(argv[optind + 1], "w")) == NULL) {
+        fprintf(stderr, "Failed to open file :%s\n", argv[optind + 1]);
+        exit(1);
+    }
+
+    uint8_t *leader = calloc(rom_size / 2, 1);
+    find_blocks(&cpu, leader);
+
+    fprintf(fh, "// Translated from %s by aot, to be linked with aot_rt.o and librv16k.a.\n", argv[optind]);
+    fprintf(fh, "#include \"aot.h\"\n\n");
+    fprintf(fh, "#define RAM_MASK 0x%04x\n\n", cpu.ram_mask);
+    emit_bytes(fh, "ROM", cpu.inst_rom, rom_size);
+    emit_bytes(fh, "RAM", cpu.data_ram, ram_size);
+
+    struct inst_op *ops = malloc(sizeof(struct inst_op) * rom_size);
+    uint16_t *offs = malloc(sizeof(uint16_t) * rom_size);
+    int *sizes = calloc(rom_size / 2, sizeof(int));
+    for (int start = 0; start < rom_size; start += 2) {
+        if (!leader[start >> 1])
+            continue;
+        uint16_t addr = start, off = 0;
+        int n = 0;
+        do {
+            inst_decode(&cpu, inst_list, addr, &ops[n]);
+            offs[n] = off;
+            off += ops[n].len;
+            addr = (addr + ops[n].len) & cpu.rom_mask;
+        } while (!is_jump(ops[n++].id) && !leader[addr >> 1]);
+        emit_block(fh, start, ops, offs, n);
+        sizes[start >> 1] = n;
+    }
+
+    fprintf(fh, "static const struct aot_block blocks[%d] = {\n", rom_size / 2);
+    for (int i = 0; i < rom_size / 2; i++)
+        if (leader[i])
+            fprintf(fh, "    [0x%04x / 2] = {block_%04x, %d},\n", i * 2, i * 2, sizes[i]);
+    fprintf(fh, "};\n\n");
+    fprintf(fh, "const struct aot_program aot_program = {\n");
+    fprintf(fh, "    %d, %d, 0x%04x, ROM, ROM_LEN, RAM, RAM_LEN, blocks,\n", rom_size, ram_size, cpu.pc);
+    fprintf(fh, "};\n");
+
+    fclose(fh);
+    free(ops);
+    free(offs);
+    free(sizes);
+    free(leader);
+    free_cpu(&cpu);
+    return 0;
+}
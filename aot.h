@@ -0,0 +1,50 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+#include "inst.h"
+
+// A program translated ahead of time by aot: the C file it writes has a
+// function per basic block of the ROM reachable from the entry point, and
+// defines aot_program, which aot_rt.c runs. Every block function runs its
+// instructions as cpu_run() would and leaves the PC of the next one, the
+// block that starts there being found through aot_program.blocks.
+
+struct aot_block {
+    void (*run)(struct cpu *c);
+    uint16_t n;     // number of instructions, or 0 if no block starts here
+};
+
+struct aot_program {
+    int rom_size;
+    int ram_size;
+    uint16_t entry;
+    // The memories as loaded from the ELF file, up to their last nonzero
+    // byte.
+    const uint8_t *rom;
+    int rom_len;
+    const uint8_t *ram;
+    int ram_len;
+    const struct aot_block *blocks;     // indexed by pc/2
+};
+
+extern const struct aot_program aot_program;
+
+// Run up to ncycles like cpu_run(), through the blocks of aot_program,
+// and interpret what they do not cover (e.g. the targets of jr and jalr
+// that are not block starts).
+int aot_run(struct cpu *c, int ncycles);
+
+// What the translated instructions use besides the flag helpers of inst.h.
+static inline uint16_t aot_read_w(const uint8_t *ram, uint16_t mask, uint16_t addr){
+    return ram[addr & mask] + (ram[(addr+1) & mask]<<8);
+}
+
+static inline void aot_write_w(uint8_t *ram, uint16_t mask, uint16_t addr, uint16_t data){
+    ram[addr & mask] = data&0xFF;
+    ram[(addr+1) & mask] = data>>8;
+}
+
+#endif
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "cpu.h"
+#include "inst.h"
+#include "decode.h"
+#include "aot.h"
+
+#include <getopt.h>
+
+// The runtime of the programs translated by aot: a main() that runs
+// aot_program and prints what rv16k-sim -q prints.
+
+int aot_run(struct cpu *c, int ncycles){
+    int i = 0;
+    c->halt = HALT_NONE;
+    while(i < ncycles && c->halt == HALT_NONE){
+        uint16_t addr = c->pc & c->rom_mask;
+        const struct aot_block *b = &aot_program.blocks[addr>>1];
+        if((addr & 1) || b->n == 0 || b->n > ncycles - i){
+            int done = cpu_run(c, 1);
+            if(done == 0)
+                break;
+            i += done;
+            continue;
+        }
+        b->run(c);
+        c->cycle += b->n;
+        i += b->n;
+    }
+    return i;
+}
+
+void print_usage(FILE *fh)
+{
+    fprintf(fh, "Usage: PROGRAM [-d RAM] NCYCLES\n");
+    fprintf(fh, "Options:\n");
+    fprintf(fh, "  -d RAM   : Overwrite the start of the initial RAM data\n");
+}
+
+_Noreturn void print_usage_to_exit(void)
+{
+    print_usage(stderr);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct cpu cpu;
+    char *ram = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:")) != -1) {
+        switch (opt) {
+            case 'd':
+                ram = optarg;
+                break;
+
+            default:
+                print_usage_to_exit();
+        }
+    }
+    if (argc - optind != 1) print_usage_to_exit();
+    int ncycles = atoi(argv[optind]);
+
+    init_cpu(&cpu, aot_program.rom_size, aot_program.ram_size);
+    memcpy(cpu.inst_rom, aot_program.rom, aot_program.rom_len);
+    memcpy(cpu.data_ram, aot_program.ram, aot_program.ram_len);
+    if (ram != NULL)
+        set_bytes_from_str(cpu.data_ram, ram, cpu.ram_size);
+    cpu.pc = aot_program.entry;
+    decode_init();
+
+    int cycles = aot_run(&cpu, ncycles);
+    print_regs(stdout, cpu.reg);
+    print_cycles(stdout, cycles, cpu.halt);
+    free_cpu(&cpu);
+    return 0;
+}
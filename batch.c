@@ -0,0 +1,302 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "decode.h"
+#include "elf_parser.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// One line of the manifest:
+//   NCYCLES; ROM; RAM; EXPECTED
+// ROM and RAM are hex bytes as for -t/-d, and EXPECTED is a list of
+// register values as printed at exit, e.g. "x8=42 x9=0". ROM may also be
+// @FILE to load the ELF file FILE, in which case RAM overwrites the start
+// of its data. Empty lines and lines starting with '#' are skipped.
+struct batch_case {
+    int line;
+    int ncycles;
+    const struct elf_image *image;
+    uint8_t *inst_rom;  // NULL with an image
+    int rom_len;
+    uint8_t *data_ram;
+    int ram_len;
+    uint16_t expect_mask;
+    uint16_t expect[16];
+
+    uint16_t reg[16];
+    int cycles;
+    int load_failed;    // the ELF file does not fit the memories
+};
+
+// Each ELF file is parsed once, however many cases use it.
+struct batch_image {
+    char *file_name;
+    struct elf_image *image;
+};
+
+struct batch {
+    int rom_size;
+    int ram_size;
+    struct batch_case *cases;
+    int ncases;
+    struct batch_image *images;
+    int nimages;
+    atomic_int next;
+};
+
+void print_usage(FILE *fh)
+{
+    fprintf(fh, "Usage: batch [-j NTHREADS] [-R SIZE] [-M SIZE] MANIFEST\n");
+    fprintf(fh, "Options:\n");
+    fprintf(fh, "  -j NTHREADS : Number of worker threads (default: number of CPUs)\n");
+    fprintf(fh, "  -R SIZE     : ROM size in bytes, a power of 2 up to 64K (default: %d)\n", INST_ROM_SIZE);
+    fprintf(fh, "  -M SIZE     : RAM size in bytes, a power of 2 up to 64K (default: %d)\n", DATA_RAM_SIZE);
+}
+
+_Noreturn void print_usage_to_exit(void)
+{
+    print_usage(stderr);
+    exit(1);
+}
+
+int parse_mem_size_or_exit(const char *s)
+{
+    int size = parse_mem_size(s);
+    if (size < 0) {
+        fprintf(stderr, "Invalid memory size :%s\n", s);
+        exit(1);
+    }
+    return size;
+}
+
+_Noreturn static void manifest_error(const char *file_name, int line, const char *msg)
+{
+    fprintf(stderr, "%s:%d: %s\n", file_name, line, msg);
+    exit(1);
+}
+
+static char *next_field(char **p)
+{
+    char *field = *p, *sep;
+    if (field == NULL) return NULL;
+    if ((sep = strchr(field, ';')) != NULL) {
+        *sep = '\0';
+        *p = sep + 1;
+    }
+    else {
+        *p = NULL;
+    }
+    return field;
+}
+
+// Hex bytes of a ROM or RAM field, split as set_bytes_from_str() does,
+// into a new buffer of just those bytes. Returns their number.
+static int parse_mem(uint8_t **mem, char *s, int size, const char *file_name, int line)
+{
+    int n = 0;
+    for (char *p = s + strspn(s, " \t\n"); *p != '\0'; p += strspn(p, " \t\n")) {
+        p += strcspn(p, " \t\n");
+        n++;
+    }
+    if (n > size)
+        manifest_error(file_name, line, "Too large data for the memory size");
+    *mem = malloc(n > 0 ? n : 1);
+    return set_bytes_from_str(*mem, s, n);
+}
+
+static void parse_expect(struct batch_case *t, char *s, const char *file_name)
+{
+    char *tp, *saveptr;
+    t->expect_mask = 0;
+    for (tp = strtok_r(s, " \t\n", &saveptr); tp != NULL; tp = strtok_r(NULL, " \t\n", &saveptr)) {
+        int idx, val;
+        if (sscanf(tp, "x%d=%d", &idx, &val) != 2 || idx < 0 || idx >= 16)
+            manifest_error(file_name, t->line, "Invalid expected register value");
+        t->expect_mask |= 1 << idx;
+        t->expect[idx] = val;
+    }
+}
+
+static const struct elf_image *batch_image(struct batch *b, const char *file_name)
+{
+    for (int i = 0; i < b->nimages; i++)
+        if (strcmp(b->images[i].file_name, file_name) == 0)
+            return b->images[i].image;
+
+    b->images = realloc(b->images, sizeof(struct batch_image) * (b->nimages + 1));
+    struct batch_image *bi = &b->images[b->nimages++];
+    bi->file_name = strdup(file_name);
+    if ((bi->image = elf_image_open(file_name)) == NULL)
+        exit(1);
+    return bi->image;
+}
+
+static void load_manifest(struct batch *b, const char *file_name)
+{
+    FILE *fp;
+    if ((fp = fopen(file_name, "r")) == NULL) {
+        fprintf(stderr, "Failed to open file :%s\n", file_name);
+        exit(1);
+    }
+
+    int cap = 64, line = 0;
+    char *buf = NULL;
+    size_t buf_size = 0;
+    b->cases = malloc(sizeof(struct batch_case) * cap);
+    b->ncases = 0;
+    b->images = NULL;
+    b->nimages = 0;
+    while (getline(&buf, &buf_size, fp) != -1) {
+        line++;
+        char *p = buf + strspn(buf, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0') continue;
+
+        if (b->ncases == cap) {
+            cap *= 2;
+            b->cases = realloc(b->cases, sizeof(struct batch_case) * cap);
+        }
+        struct batch_case *t = &b->cases[b->ncases++];
+        memset(t, 0, sizeof(*t));
+        t->line = line;
+
+        char *ncycles = next_field(&p), *rom = next_field(&p);
+        char *ram = next_field(&p), *expect = next_field(&p);
+        if (expect == NULL)
+            manifest_error(file_name, line, "Expected NCYCLES; ROM; RAM; EXPECTED");
+        t->ncycles = atoi(ncycles);
+        rom += strspn(rom, " \t");
+        if (*rom == '@')
+            t->image = batch_image(b, strtok(rom + 1, " \t"));
+        else
+            t->rom_len = parse_mem(&t->inst_rom, rom, b->rom_size, file_name, line);
+        t->ram_len = parse_mem(&t->data_ram, ram, b->ram_size, file_name, line);
+        parse_expect(t, expect, file_name);
+    }
+
+    free(buf);
+    fclose(fp);
+}
+
+static void *batch_worker(void *arg)
+{
+    struct batch *b = arg;
+    struct cpu cpu, *c = &cpu;
+    int i;
+
+    init_cpu(c, b->rom_size, b->ram_size);
+    while ((i = atomic_fetch_add(&b->next, 1)) < b->ncases) {
+        struct batch_case *t = &b->cases[i];
+        reset_cpu(c);
+        if (t->image != NULL) {
+            // What does not fit is printed, and the case fails.
+            if (elf_image_load(t->image, c) != 0) {
+                t->load_failed = 1;
+                continue;
+            }
+        }
+        else {
+            memcpy(c->inst_rom, t->inst_rom, t->rom_len);
+        }
+        memcpy(c->data_ram, t->data_ram, t->ram_len);
+
+        t->cycles = cpu_run(c, t->ncycles);
+        memcpy(t->reg, c->reg, sizeof(t->reg));
+    }
+
+    free_cpu(c);
+    return NULL;
+}
+
+static int check_case(const struct batch_case *t, const char *file_name)
+{
+    if (t->load_failed) {
+        printf("FAIL %s:%d: the ELF file does not fit the memories\n", file_name, t->line);
+        return 0;
+    }
+    for (int i = 0; i < 16; i++) {
+        if ((t->expect_mask >> i & 1) && t->reg[i] != t->expect[i]) {
+            printf("FAIL %s:%d:", file_name, t->line);
+            for (int j = 0; j < 16; j++)
+                printf(" x%d=%d", j, t->reg[j]);
+            printf("\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN), opt;
+    struct batch b;
+    b.rom_size = INST_ROM_SIZE;
+    b.ram_size = DATA_RAM_SIZE;
+    while ((opt = getopt(argc, argv, "j:R:M:")) != -1) {
+        switch (opt) {
+            case 'j':
+                nthreads = atoi(optarg);
+                break;
+
+            case 'R':
+                b.rom_size = parse_mem_size_or_exit(optarg);
+                break;
+
+            case 'M':
+                b.ram_size = parse_mem_size_or_exit(optarg);
+                break;
+
+            default:
+                print_usage_to_exit();
+        }
+    }
+    if (optind + 1 != argc || nthreads < 1) print_usage_to_exit();
+
+    const char *file_name = argv[optind];
+    load_manifest(&b, file_name);
+    atomic_init(&b.next, 0);
+
+    decode_init();
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, batch_worker, &b);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    int npass = 0;
+    long cycles = 0;
+    for (int i = 0; i < b.ncases; i++) {
+        npass += check_case(&b.cases[i], file_name);
+        cycles += b.cases[i].cycles;
+    }
+
+    printf("%d passed, %d failed, %ld cycles in %.3f s (%.0f cycles/sec, %d threads)\n",
+           npass, b.ncases - npass, cycles, sec, sec > 0 ? cycles / sec : 0, nthreads);
+
+    for (int i = 0; i < b.nimages; i++) {
+        free(b.images[i].file_name);
+        elf_image_close(b.images[i].image);
+    }
+    free(b.images);
+    for (int i = 0; i < b.ncases; i++) {
+        free(b.cases[i].inst_rom);
+        free(b.cases[i].data_ram);
+    }
+    free(b.cases);
+    return npass == b.ncases ? 0 : 1;
+}
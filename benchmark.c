@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rv16k.h"
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Simulated throughput on fixed workloads, each run on the interpreter,
+// then with the JIT, then forking it as it runs, in a child process of its
+// own, so that the peak RSS is that of the run. Prints one line per run,
+// to be compared across commits:
+//   NAME ENGINE cycles=N ms=N ips=N ns_per_inst=N.NN maxrss_kb=N
+struct workload {
+    const char *name;
+    const char *rom;
+    const char *ram;
+};
+
+static const struct workload workloads[] = {
+    // Tight arithmetic loop.
+    //        0:	08 78 00 00 	li	a0, 0
+    //        4:	09 78 01 00 	li	a1, 1
+    //        8:	0b 78 03 00 	li	a3, 3
+    // loop:
+    //        c:	98 e2       	add	a0, a1
+    //        e:	19 f2       	addi	a1, 1
+    //       10:	8a e0       	mov	a2, a0
+    //       12:	ba e9       	lsl	a2, a3
+    //       14:	a8 e6       	xor	a0, a2
+    //       16:	98 e3       	sub	a0, a1
+    //       18:	00 52 f2 ff 	j	loop
+    {"arith",
+     "08 78 00 00 09 78 01 00 0b 78 03 00 98 e2 19 f2 8a e0 ba e9 a8 e6 98 e3 00 52 f2 ff",
+     ""},
+
+    // Copy the first 128 bytes of RAM to 256, over and over.
+    // outer:
+    //        0:	08 78 00 00 	li	a0, 0
+    //        4:	09 78 00 01 	li	a1, 256
+    //        8:	0b 78 80 00 	li	a3, 128
+    // inner:
+    //        c:	8a b2 00 00 	lw	a2, 0(a0)
+    //       10:	a9 92 00 00 	sw	a2, 0(a1)
+    //       14:	28 f2       	addi	a0, 2
+    //       16:	29 f2       	addi	a1, 2
+    //       18:	b8 c3       	cmp	a0, a3
+    //       1a:	f9 45       	jne	inner
+    //       1c:	00 52 e2 ff 	j	outer
+    {"memcpy",
+     "08 78 00 00 09 78 00 01 0b 78 80 00 8a b2 00 00 a9 92 00 00 28 f2 29 f2 b8 c3 f9 45 00 52 e2 ff",
+     "01 00 02 00 03 00 04 00 05 00 06 00 07 00 08 00"},
+
+    // Recursive fib(12), over and over.
+    // start:
+    //        0:	01 78 fe 01 	li	sp, 510
+    //        4:	08 78 0c 00 	li	a0, 12
+    //        8:	00 73 06 00 	jal	fib
+    //        c:	00 52 f2 ff 	j	start
+    // fib:
+    //       10:	28 d3       	cmpi	a0, 2
+    //       12:	10 44       	jl	done
+    //       14:	a1 f2       	addi	sp, -6
+    //       16:	00 80       	swsp	ra, 0(sp)
+    //       18:	81 80       	swsp	a0, 2(sp)
+    //       1a:	f8 f2       	addi	a0, -1
+    //       1c:	00 73 f2 ff 	jal	fib
+    //       20:	82 80       	swsp	a0, 4(sp)
+    //       22:	18 a0       	lwsp	a0, 2(sp)
+    //       24:	e8 f2       	addi	a0, -2
+    //       26:	00 73 e8 ff 	jal	fib
+    //       2a:	29 a0       	lwsp	a1, 4(sp)
+    //       2c:	98 e2       	add	a0, a1
+    //       2e:	00 a0       	lwsp	ra, 0(sp)
+    //       30:	61 f2       	addi	sp, 6
+    // done:
+    //       32:	00 40       	jr	ra
+    {"recursion",
+     "01 78 fe 01 08 78 0c 00 00 73 06 00 00 52 f2 ff 28 d3 10 44 a1 f2 00 80 81 80 f8 f2 "
+     "00 73 f2 ff 82 80 18 a0 e8 f2 00 73 e8 ff 29 a0 98 e2 00 a0 61 f2 00 40",
+     ""},
+
+    // Xorshift with branches on the bits of each value.
+    //        0:	08 78 01 00 	li	a0, 1
+    //        4:	0c 78 00 00 	li	a4, 0
+    //        8:	0d 78 00 00 	li	a5, 0
+    // loop:
+    //        c:	8a e0       	mov	a2, a0
+    //        e:	0b 78 07 00 	li	a3, 7
+    //       12:	ba e9       	lsl	a2, a3
+    //       14:	a8 e6       	xor	a0, a2
+    //       16:	8a e0       	mov	a2, a0
+    //       18:	0b 78 09 00 	li	a3, 9
+    //       1c:	ba ea       	lsr	a2, a3
+    //       1e:	a8 e6       	xor	a0, a2
+    //       20:	8a e0       	mov	a2, a0
+    //       22:	0b 78 08 00 	li	a3, 8
+    //       26:	ba e9       	lsl	a2, a3
+    //       28:	a8 e6       	xor	a0, a2
+    //       2a:	8a e0       	mov	a2, a0
+    //       2c:	0b 78 01 00 	li	a3, 1
+    //       30:	ba e4       	and	a2, a3
+    //       32:	04 45       	je	even
+    //       34:	1c f2       	addi	a4, 1
+    //       36:	00 52 04 00 	j	next
+    // even:
+    //       3a:	1d f2       	addi	a5, 1
+    // next:
+    //       3c:	0b 78 00 40 	li	a3, 16384
+    //       40:	b8 c3       	cmp	a0, a3
+    //       42:	02 46       	jb	low
+    //       44:	fd f2       	addi	a5, -1
+    // low:
+    //       46:	00 52 c4 ff 	j	loop
+    {"branchy",
+     "08 78 01 00 0c 78 00 00 0d 78 00 00 8a e0 0b 78 07 00 ba e9 a8 e6 8a e0 0b 78 09 00 "
+     "ba ea a8 e6 8a e0 0b 78 08 00 ba e9 a8 e6 8a e0 0b 78 01 00 ba e4 04 45 1c f2 00 52 "
+     "04 00 1d f2 0b 78 00 40 b8 c3 02 46 fd f2 00 52 c4 ff",
+     ""},
+};
+
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+#define BENCH_JIT_HOT 16
+#define BENCH_MEM_SIZE 512
+static const char *engine_names[] = {"interp", "jit", "fork"};
+#define BENCH_FORKS 1000
+#define BENCH_FORK_MEM_SIZE 0x10000
+
+void print_usage(FILE *fh)
+{
+    fprintf(fh, "Usage: benchmark [-n NCYCLES] [NAME...]\n");
+    fprintf(fh, "Options:\n");
+    fprintf(fh, "  -n NCYCLES : Cycles per run, at least %d (default: 20000000)\n", 2 * BENCH_FORKS);
+    fprintf(fh, "  NAME       : Only run these workloads (default: all)\n");
+}
+
+_Noreturn void print_usage_to_exit(void)
+{
+    print_usage(stderr);
+    exit(1);
+}
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Hex bytes such as "08 78 00 00" to buf; returns their number.
+static size_t parse_hex(uint8_t *buf, const char *s)
+{
+    size_t n = 0;
+    char *end;
+    for (long val = strtol(s, &end, 16); end != s; val = strtol(s, &end, 16)) {
+        buf[n++] = val;
+        s = end;
+    }
+    return n;
+}
+
+// Run in the child: print the line of one run and exit.
+_Noreturn static void bench_run(const struct workload *w, int use_jit, int ncycles)
+{
+    struct rv16k *s = rv16k_new(BENCH_MEM_SIZE, BENCH_MEM_SIZE);
+    struct rv16k_state st;
+    struct timespec start, end;
+    struct rusage ru;
+    uint8_t buf[BENCH_MEM_SIZE];
+
+    rv16k_write_rom(s, 0, buf, parse_hex(buf, w->rom));
+    rv16k_write_ram(s, 0, buf, parse_hex(buf, w->ram));
+    if (use_jit && rv16k_set_jit(s, BENCH_JIT_HOT) != 0) {
+        fprintf(stderr, "Failed to map JIT buffer\n");
+        exit(1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int cycles = rv16k_run(s, ncycles);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &ru);
+    rv16k_read_state(s, &st);
+
+    double ms = elapsed_ms(&start, &end);
+    printf("%-10s %-6s cycles=%d ms=%.0f ips=%.0f ns_per_inst=%.2f maxrss_kb=%ld\n",
+           w->name, use_jit ? "jit" : "interp", cycles, ms, cycles / ms * 1e3,
+           ms * 1e6 / cycles, ru.ru_maxrss);
+    rv16k_free(s);
+    exit(cycles == ncycles && st.stop == RV16K_STOP_NONE ? 0 : 1);
+}
+
+// The state and a hash of the RAM.
+struct fork_point {
+    uint16_t reg[16];
+    uint16_t pc;
+    uint64_t ram_hash;
+};
+
+static void fork_point(struct rv16k *s, struct fork_point *p)
+{
+    static uint8_t ram[BENCH_FORK_MEM_SIZE];
+    struct rv16k_state st;
+    rv16k_read_state(s, &st);
+    memcpy(p->reg, st.reg, sizeof(p->reg));
+    p->pc = st.pc;
+    rv16k_read_ram(s, 0, ram, sizeof(ram));
+    p->ram_hash = 14695981039346656037ull;
+    for (int i = 0; i < BENCH_FORK_MEM_SIZE; i++)
+        p->ram_hash = (p->ram_hash ^ ram[i]) * 1099511628211ull;
+}
+
+// Fork the program BENCH_FORKS times with 64K memories, as a fuzzer
+// branching off one run would, every ncycles/2/BENCH_FORKS cycles of a run
+// with the JIT. Then run each fork as long on the interpreter, which must
+// leave it where the original was at the next fork.
+_Noreturn static void bench_fork(const struct workload *w, int ncycles)
+{
+    struct rv16k *s = rv16k_new(BENCH_FORK_MEM_SIZE, BENCH_FORK_MEM_SIZE);
+    static struct rv16k *forks[BENCH_FORKS];
+    static struct fork_point expect[BENCH_FORKS];
+    struct timespec start, end;
+    struct rusage ru;
+    uint8_t buf[BENCH_MEM_SIZE];
+    int share = ncycles / 2 / BENCH_FORKS, cycles = 0, ok = 1;
+
+    rv16k_write_rom(s, 0, buf, parse_hex(buf, w->rom));
+    rv16k_write_ram(s, 0, buf, parse_hex(buf, w->ram));
+    if (rv16k_set_jit(s, BENCH_JIT_HOT) != 0) {
+        fprintf(stderr, "Failed to map JIT buffer\n");
+        exit(1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCH_FORKS; i++) {
+        forks[i] = rv16k_fork(s);
+        if (forks[i] == NULL)
+            exit(1);
+        cycles += rv16k_run(s, share);
+    }
+    for (int i = 0; i < BENCH_FORKS; i++)
+        cycles += rv16k_run(forks[i], share);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &ru);
+
+    // Replay the original to check the forks.
+    rv16k_free(s);
+    s = rv16k_new(BENCH_FORK_MEM_SIZE, BENCH_FORK_MEM_SIZE);
+    rv16k_write_rom(s, 0, buf, parse_hex(buf, w->rom));
+    rv16k_write_ram(s, 0, buf, parse_hex(buf, w->ram));
+    for (int i = 0; i < BENCH_FORKS; i++) {
+        struct fork_point p;
+        rv16k_run(s, share);
+        fork_point(s, &expect[i]);
+        fork_point(forks[i], &p);
+        ok &= memcmp(&p, &expect[i], sizeof(p)) == 0;
+        rv16k_free(forks[i]);
+    }
+
+    double ms = elapsed_ms(&start, &end);
+    printf("%-10s %-6s cycles=%d ms=%.0f ips=%.0f ns_per_inst=%.2f maxrss_kb=%ld\n",
+           w->name, "fork", cycles, ms, cycles / ms * 1e3, ms * 1e6 / cycles, ru.ru_maxrss);
+    rv16k_free(s);
+    exit(ok && cycles == 2 * BENCH_FORKS * share ? 0 : 1);
+}
+
+static int selected(const struct workload *w, int argc, char *argv[])
+{
+    if (optind >= argc)
+        return 1;
+    for (int i = optind; i < argc; i++)
+        if (strcmp(argv[i], w->name) == 0)
+            return 1;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int ncycles = 20000000, opt, failed = 0;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n':
+                ncycles = atoi(optarg);
+                break;
+
+            default:
+                print_usage_to_exit();
+        }
+    }
+    // Each fork runs ncycles / 2 / BENCH_FORKS cycles twice.
+    if (ncycles < 2 * BENCH_FORKS) print_usage_to_exit();
+
+    for (size_t i = 0; i < NWORKLOADS; i++) {
+        if (!selected(&workloads[i], argc, argv)) continue;
+        for (int engine = 0; engine <= 2; engine++) {
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0 && engine == 2)
+                bench_fork(&workloads[i], ncycles);
+            if (pid == 0)
+                bench_run(&workloads[i], engine, ncycles);
+
+            int status;
+            if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "%s %s: did not run all %d cycles\n",
+                        workloads[i].name, engine_names[engine], ncycles);
+                failed = 1;
+            }
+        }
+    }
+    return failed;
+}
@@ -44,3 +44,39 @@ bool bitpat_match_s(uint16_t t, const char* s){
     }
     return true;
 }
+
+// Convert a pattern such as "0b1011_0010_xxxx_xxxx" into a mask/value pair
+// so that `(t & mask) == value` is equivalent to bitpat_match_s(t, s).
+bool bitpat_compile(const char* s, uint16_t *mask, uint16_t *value){
+    int idx = 0;
+    int bit_cnt = 0;
+
+    *mask = 0;
+    *value = 0;
+
+    if(s[idx++] != '0' || s[idx++] != 'b'){
+        fprintf(stderr, "Invalid pattern: %s\n", s);
+        return false;
+    }
+
+    while(bit_cnt < 16){
+        uint16_t bit = 1 << (15-bit_cnt);
+        switch(s[idx++]){
+            case '_':
+                continue;
+            case 'x':
+                break;
+            case '1':
+                *value |= bit;
+                /* fallthrough */
+            case '0':
+                *mask |= bit;
+                break;
+            default:
+                fprintf(stderr, "Invalid pattern: %s\n", s);
+                return false;
+        }
+        bit_cnt++;
+    }
+    return true;
+}
@@ -3,4 +3,5 @@
 #include <stdbool.h>
 #include <stdint.h>
 bool bitpat_match_s(uint16_t t, const char* s);
+bool bitpat_compile(const char* s, uint16_t *mask, uint16_t *value);
 #endif
@@ -0,0 +1,486 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "bitslice.h"
+
+#define WORDS (SLICES / 64)
+#define ZERO ((slice_t){})
+#define ONES (~(slice_t){})
+
+static inline int lane_get(slice_t v, int l){
+    return v[l >> 6] >> (l & 63) & 1;
+}
+
+static inline void lane_set(slice_t *v, int l, int b){
+    uint64_t bit = 1ull << (l & 63);
+    if(b)
+        (*v)[l >> 6] |= bit;
+    else
+        (*v)[l >> 6] &= ~bit;
+}
+
+static inline int none(slice_t v){
+    uint64_t r = 0;
+    for(int i=0;i<WORDS;i++) r |= v[i];
+    return r == 0;
+}
+
+// The lanes of m take a, the others keep b. This is how the instances not
+// at the current PC are left alone, so it is not a gate of theirs.
+static inline slice_t sel(slice_t m, slice_t a, slice_t b){
+    return (a & m) | (b & ~m);
+}
+
+// The gates, counted.
+static inline slice_t g_and(struct cpu_slices *S, slice_t a, slice_t b){
+    S->step_gates++;
+    return a & b;
+}
+
+static inline slice_t g_or(struct cpu_slices *S, slice_t a, slice_t b){
+    S->step_gates++;
+    return a | b;
+}
+
+static inline slice_t g_xor(struct cpu_slices *S, slice_t a, slice_t b){
+    S->step_gates++;
+    return a ^ b;
+}
+
+// s ? a : b
+static inline slice_t g_mux(struct cpu_slices *S, slice_t s, slice_t a, slice_t b){
+    S->step_muxes++;
+    return b ^ ((a ^ b) & s);
+}
+
+// 16-bit words as 16 planes, least significant first.
+static void w_const(slice_t *w, uint16_t v){
+    for(int b=0;b<16;b++)
+        w[b] = v >> b & 1 ? ONES : ZERO;
+}
+
+// out = a + b + cin with a ripple-carry adder; returns the carry out.
+static slice_t w_add(struct cpu_slices *S, const slice_t *a, const slice_t *b, slice_t cin, slice_t *out){
+    slice_t c = cin;
+    for(int i=0;i<16;i++){
+        slice_t t = g_xor(S, a[i], b[i]);
+        out[i] = g_xor(S, t, c);
+        c = g_or(S, g_and(S, a[i], b[i]), g_and(S, t, c));
+    }
+    return c;
+}
+
+// out = a + 1 over n bits, with half adders.
+static void w_inc(struct cpu_slices *S, const slice_t *a, slice_t *out, int n){
+    slice_t c = ONES;
+    for(int i=0;i<n;i++){
+        out[i] = g_xor(S, a[i], c);
+        c = g_and(S, a[i], c);
+    }
+}
+
+// out = -a, as ~a + 1 in inst.c.
+static void w_neg(struct cpu_slices *S, const slice_t *a, slice_t *out){
+    slice_t t[16];
+    for(int i=0;i<16;i++)
+        t[i] = ~a[i];
+    w_inc(S, t, out, 16);
+}
+
+static slice_t w_nonzero(struct cpu_slices *S, const slice_t *a){
+    slice_t r = a[0];
+    for(int i=1;i<16;i++)
+        r = g_or(S, r, a[i]);
+    return r;
+}
+
+// A barrel shifter over the 5 low bits of s, as the x86 shift instructions
+// that inst.c compiles to: d << s, d >> s, or (int16_t)d >> s.
+static void w_shift(struct cpu_slices *S, int id, const slice_t *s, const slice_t *d, slice_t *out){
+    slice_t cur[16], fill = id == INST_ASR ? d[15] : ZERO;
+    memcpy(cur, d, sizeof(cur));
+    for(int k=0;k<5;k++){
+        int n = 1 << k;
+        slice_t nxt[16];
+        for(int i=0;i<16;i++){
+            int from = id == INST_LSL ? i - n : i + n;
+            slice_t shifted = from >= 0 && from < 16 ? cur[from] : fill;
+            nxt[i] = g_mux(S, s[k], shifted, cur[i]);
+        }
+        memcpy(cur, nxt, sizeof(cur));
+    }
+    memcpy(out, cur, sizeof(cur));
+}
+
+static void reg_write(struct cpu_slices *S, slice_t m, int r, const slice_t *v){
+    for(int b=0;b<16;b++)
+        S->reg[r][b] = sel(m, v[b], S->reg[r][b]);
+}
+
+static void set_flags(struct cpu_slices *S, slice_t m, slice_t sign, slice_t zero, slice_t carry, slice_t overflow){
+    S->flag_sign = sel(m, sign, S->flag_sign);
+    S->flag_zero = sel(m, zero, S->flag_zero);
+    S->flag_carry = sel(m, carry, S->flag_carry);
+    S->flag_overflow = sel(m, overflow, S->flag_overflow);
+}
+
+// flag_overflow() of inst.h.
+static slice_t overflow(struct cpu_slices *S, const slice_t *s, const slice_t *d, const slice_t *res){
+    return g_and(S, ~g_xor(S, s[15], d[15]), g_xor(S, d[15], res[15]));
+}
+
+// The flags of the additions and of the address computations, whose carry
+// is set unless the sum wraps (always, for the latter).
+static void set_add_flags(struct cpu_slices *S, slice_t m, const slice_t *s, const slice_t *d,
+                          const slice_t *res, slice_t carry){
+    set_flags(S, m, res[15], ~w_nonzero(S, res), carry, overflow(S, s, d, res));
+}
+
+static int ram_bits(const struct cpu_slices *S){
+    return __builtin_ctz(S->base.ram_size);
+}
+
+// Whether the low n planes of w are the same in all the lanes of m, with
+// that value in *v.
+static int uniform(const slice_t *w, int n, slice_t m, uint16_t *v){
+    *v = 0;
+    for(int b=0;b<n;b++){
+        slice_t t = w[b] & m;
+        if(none(t ^ m))
+            *v |= 1 << b;
+        else if(!none(t))
+            return 0;
+    }
+    return 1;
+}
+
+// Read the byte at addr through a tree of multiplexers, one level per
+// address bit. When all the lanes of m read the same address, the byte is
+// read directly, but the tree is still counted.
+static void ram_read_b(struct cpu_slices *S, slice_t m, const slice_t *addr, slice_t *out){
+    int nb = ram_bits(S), size = S->base.ram_size;
+    uint16_t a;
+    if(uniform(addr, nb, m, &a)){
+        memcpy(out, &S->ram[a * 8], sizeof(slice_t) * 8);
+        S->step_muxes += (uint64_t)(size - 1) * 8;
+        return;
+    }
+    const slice_t *cur = S->ram;
+    for(int k=0;k<nb;k++){
+        size >>= 1;
+        for(int j=0;j<size;j++)
+            for(int b=0;b<8;b++)
+                S->scratch[j*8 + b] = g_mux(S, addr[k], cur[(2*j+1)*8 + b], cur[2*j*8 + b]);
+        cur = S->scratch;
+    }
+    memcpy(out, cur, sizeof(slice_t) * 8);
+}
+
+// Write a byte to addr in the lanes of m: an address decoder selects the
+// byte that each multiplexer in front of the RAM replaces.
+static void ram_write_b(struct cpu_slices *S, slice_t m, const slice_t *addr, const slice_t *data){
+    int nb = ram_bits(S), size = S->base.ram_size;
+    uint16_t a;
+    if(uniform(addr, nb, m, &a)){
+        for(int b=0;b<8;b++)
+            S->ram[a*8 + b] = sel(m, data[b], S->ram[a*8 + b]);
+        S->step_gates += 2 * (uint64_t)(size - 1);
+        S->step_muxes += (uint64_t)size * 8;
+        return;
+    }
+    slice_t *dec = S->scratch;
+    dec[0] = m;
+    for(int k=nb-1,n=1;k>=0;k--,n*=2){
+        for(int j=n-1;j>=0;j--){
+            slice_t e = dec[j];
+            dec[2*j+1] = g_and(S, e, addr[k]);
+            dec[2*j] = g_and(S, e, ~addr[k]);
+        }
+    }
+    for(int i=0;i<size;i++)
+        for(int b=0;b<8;b++)
+            S->ram[i*8 + b] = g_mux(S, dec[i], data[b], S->ram[i*8 + b]);
+}
+
+static void ram_read_w(struct cpu_slices *S, slice_t m, const slice_t *addr, slice_t *out){
+    slice_t next[16];
+    w_inc(S, addr, next, ram_bits(S));
+    ram_read_b(S, m, addr, out);
+    ram_read_b(S, m, next, out + 8);
+}
+
+static void ram_write_w(struct cpu_slices *S, slice_t m, const slice_t *addr, const slice_t *data){
+    slice_t next[16];
+    w_inc(S, addr, next, ram_bits(S));
+    ram_write_b(S, m, addr, data);
+    ram_write_b(S, m, next, data + 8);
+}
+
+// Write the per-lane values of the planes of v for the lanes of m to
+// S->pc, and return whether they are all the same, in *pc.
+static int pc_scatter(struct cpu_slices *S, slice_t m, const slice_t *v, uint16_t *pc){
+    if(uniform(v, 16, m, pc))
+        return 1;
+    for(int l=0;l<S->nlanes;l++){
+        if(!lane_get(m, l)) continue;
+        uint16_t x = 0;
+        for(int b=0;b<16;b++)
+            x |= lane_get(v[b], l) << b;
+        S->pc[l] = x;
+    }
+    return 0;
+}
+
+// Execute op on the lanes in m, which are all at *pc. Returns 1 if they
+// all go on to the same PC, then in *pc, or 0 if they diverged, with
+// their PCs in S->pc; the lanes that halted on op are added to stuck.
+static int slices_step(struct cpu_slices *S, slice_t m, const struct inst_op *op, uint16_t *pc, slice_t *stuck){
+    slice_t imm[16], s[16], d[16], res[16];
+    uint16_t at = *pc;
+    w_const(imm, op->imm);
+
+    switch(op->id){
+    case INST_LW: case INST_LBU: case INST_LB: case INST_LWSP:
+        memcpy(s, S->reg[op->id == INST_LWSP ? 1 : op->rs], sizeof(s));
+        w_add(S, imm, s, ZERO, res);
+        set_add_flags(S, m, imm, s, res, ONES);
+        if(op->id == INST_LW || op->id == INST_LWSP)
+            ram_read_w(S, m, res, d);
+        else{
+            ram_read_b(S, m, res, d);
+            for(int b=8;b<16;b++)
+                d[b] = op->id == INST_LB ? d[7] : ZERO;
+        }
+        reg_write(S, m, op->rd, d);
+        *pc += op->len;
+        break;
+
+    case INST_SW: case INST_SB: case INST_SWSP:
+        memcpy(d, S->reg[op->id == INST_SWSP ? 1 : op->rd], sizeof(d));
+        w_add(S, imm, d, ZERO, res);
+        set_add_flags(S, m, imm, d, res, ONES);
+        if(op->id == INST_SB)
+            ram_write_b(S, m, res, S->reg[op->rs]);
+        else
+            ram_write_w(S, m, res, S->reg[op->rs]);
+        *pc += op->len;
+        break;
+
+    case INST_MOV: case INST_LI:
+        memcpy(s, op->id == INST_LI ? imm : S->reg[op->rs], sizeof(s));
+        reg_write(S, m, op->rd, s);
+        set_flags(S, m, s[15], ~w_nonzero(S, s), ZERO, ZERO);
+        *pc += op->len;
+        break;
+
+    case INST_ADD: case INST_ADDI: {
+        memcpy(s, op->id == INST_ADDI ? imm : S->reg[op->rs], sizeof(s));
+        memcpy(d, S->reg[op->rd], sizeof(d));
+        slice_t carry = w_add(S, s, d, ZERO, res);
+        set_add_flags(S, m, s, d, res, ~carry);
+        reg_write(S, m, op->rd, res);
+        *pc += 2;
+        break;
+    }
+
+    case INST_SUB: case INST_CMP: case INST_CMPI: {
+        w_neg(S, op->id == INST_CMPI ? imm : S->reg[op->rs], s);
+        memcpy(d, S->reg[op->rd], sizeof(d));
+        slice_t carry = w_add(S, s, d, ZERO, res);
+        set_add_flags(S, m, s, d, res, g_and(S, ~carry, w_nonzero(S, s)));
+        if(op->id == INST_SUB)
+            reg_write(S, m, op->rd, res);
+        *pc += 2;
+        break;
+    }
+
+    case INST_AND: case INST_OR: case INST_XOR:
+    case INST_LSL: case INST_LSR: case INST_ASR:
+        memcpy(s, S->reg[op->rs], sizeof(s));
+        memcpy(d, S->reg[op->rd], sizeof(d));
+        if(op->id >= INST_LSL)
+            w_shift(S, op->id, s, d, res);
+        else
+            for(int b=0;b<16;b++)
+                res[b] = op->id == INST_AND ? g_and(S, s[b], d[b]) :
+                         op->id == INST_OR ? g_or(S, s[b], d[b]) : g_xor(S, s[b], d[b]);
+        reg_write(S, m, op->rd, res);
+        set_flags(S, m, res[15], ~w_nonzero(S, res), ZERO, overflow(S, s, d, res));
+        *pc += 2;
+        break;
+
+    case INST_J: case INST_JAL:
+        if(op->id == INST_JAL){
+            w_const(d, at + 4);
+            reg_write(S, m, 0, d);
+        }
+        set_flags(S, m, ZERO, ZERO, ZERO, ZERO);
+        *pc += 2 + op->imm;
+        if(*pc == at)
+            *stuck |= m;
+        break;
+
+    case INST_JALR: case INST_JR: {
+        // JALR reads rs after writing x0, as in inst.c.
+        if(op->id == INST_JALR){
+            w_const(d, at + 2);
+            reg_write(S, m, 0, d);
+        }
+        set_flags(S, m, ZERO, ZERO, ZERO, ZERO);
+        if(pc_scatter(S, m, S->reg[op->rs], pc)){
+            if(*pc == at)
+                *stuck |= m;
+            break;
+        }
+        for(int l=0;l<S->nlanes;l++)
+            if(lane_get(m, l) && S->pc[l] == at)
+                lane_set(stuck, l, 1);
+        return 0;
+    }
+
+    case INST_JL: case INST_JLE: case INST_JE: case INST_JNE: case INST_JB: case INST_JBE: {
+        slice_t taken;
+        switch(op->id){
+        case INST_JL:  taken = g_xor(S, S->flag_sign, S->flag_overflow); break;
+        case INST_JLE: taken = g_or(S, g_xor(S, S->flag_sign, S->flag_overflow), S->flag_zero); break;
+        case INST_JE:  taken = S->flag_zero; break;
+        case INST_JNE: taken = ~S->flag_zero; break;
+        case INST_JB:  taken = S->flag_carry; break;
+        default:       taken = g_or(S, S->flag_carry, S->flag_zero); break;
+        }
+        taken &= m;
+        set_flags(S, m, ZERO, ZERO, ZERO, ZERO);
+        if(op->id == INST_JNE && op->imm == 0)
+            *stuck |= taken;
+        if(none(taken)){
+            *pc += 2;
+            break;
+        }
+        if(none(taken ^ m)){
+            *pc += op->imm;
+            break;
+        }
+        for(int l=0;l<S->nlanes;l++)
+            if(lane_get(m, l))
+                S->pc[l] = at + (lane_get(taken, l) ? op->imm : 2);
+        return 0;
+    }
+
+    case INST_NOP:
+        set_flags(S, m, ZERO, ZERO, ZERO, ZERO);
+        *pc += 2;
+        break;
+
+    default: // undefined: nothing happens
+        *stuck |= m;
+        break;
+    }
+    return 1;
+}
+
+void slices_init(struct cpu_slices *S, const struct cpu *base, int nlanes){
+    assert(nlanes <= SLICES);
+    S->base = *base;
+    S->base.blocks = NULL;  // the instances only share base's icache
+    S->base.jit = NULL;
+    S->base.dbg = NULL;
+    flags_eval(&S->base);
+    S->nlanes = nlanes;
+    for(int r=0;r<16;r++)
+        w_const(S->reg[r], base->reg[r]);
+    S->flag_sign = S->base.flag_sign ? ONES : ZERO;
+    S->flag_overflow = S->base.flag_overflow ? ONES : ZERO;
+    S->flag_zero = S->base.flag_zero ? ONES : ZERO;
+    S->flag_carry = S->base.flag_carry ? ONES : ZERO;
+    S->ram = aligned_alloc(sizeof(slice_t), sizeof(slice_t) * 8 * base->ram_size);
+    S->scratch = aligned_alloc(sizeof(slice_t), sizeof(slice_t) * 8 * base->ram_size);
+    for(int i=0;i<base->ram_size;i++)
+        for(int b=0;b<8;b++)
+            S->ram[i*8 + b] = base->data_ram[i] >> b & 1 ? ONES : ZERO;
+    for(int l=0;l<SLICES;l++){
+        S->pc[l] = base->pc;
+        S->cycles[l] = 0;
+        S->halt[l] = HALT_NONE;
+        S->gates[l] = S->muxes[l] = 0;
+    }
+}
+
+void slices_free(struct cpu_slices *S){
+    free(S->ram);
+    free(S->scratch);
+}
+
+void slices_write_ram(struct cpu_slices *S, int l, const uint8_t *ram){
+    for(int i=0;i<S->base.ram_size;i++)
+        for(int b=0;b<8;b++)
+            lane_set(&S->ram[i*8 + b], l, ram[i] >> b & 1);
+}
+
+void slices_read_regs(const struct cpu_slices *S, int l, uint16_t reg[16]){
+    for(int r=0;r<16;r++){
+        reg[r] = 0;
+        for(int b=0;b<16;b++)
+            reg[r] |= lane_get(S->reg[r][b], l) << b;
+    }
+}
+
+void slices_run(struct cpu_slices *S, long ncycles){
+    long left[SLICES];
+    for(int l=0;l<S->nlanes;l++)
+        left[l] = ncycles;
+
+    for(;;){
+        // Run the lanes at the lowest PC, for as long as they stay together.
+        int first = -1;
+        for(int l=0;l<S->nlanes;l++)
+            if(left[l] > 0 && (first < 0 || S->pc[l] < S->pc[first]))
+                first = l;
+        if(first < 0)
+            break;
+        uint16_t pc = S->pc[first];
+        slice_t m = ZERO, stuck = ZERO;
+        long n = left[first];
+        for(int l=first;l<S->nlanes;l++){
+            if(left[l] > 0 && S->pc[l] == pc){
+                lane_set(&m, l, 1);
+                if(left[l] < n)
+                    n = left[l];
+            }
+        }
+
+        long k = 0;
+        int together = 1, halt_pc = 0;
+        S->step_gates = S->step_muxes = 0;
+        while(k < n){
+            S->base.pc = pc;
+            const struct inst_op *op = inst_fetch(&S->base, inst_list);
+            if(op->id == INST_HALT){
+                halt_pc = 1;
+                break;
+            }
+            together = slices_step(S, m, op, &pc, &stuck);
+            k++;
+            if(!together || !none(stuck))
+                break;
+        }
+
+        for(int l=first;l<S->nlanes;l++){
+            if(!lane_get(m, l)) continue;
+            left[l] -= k;
+            S->cycles[l] += k;
+            S->gates[l] += S->step_gates;
+            S->muxes[l] += S->step_muxes;
+            if(together)
+                S->pc[l] = pc;
+            if(halt_pc || lane_get(stuck, l)){
+                S->halt[l] = halt_pc ? HALT_PC : HALT_LOOP;
+                left[l] = 0;
+            }
+        }
+    }
+}
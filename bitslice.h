@@ -0,0 +1,63 @@
+#ifndef BITSLICE_H
+#define BITSLICE_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+// Bit-sliced execution of one program on SLICES different RAM images, as
+// the encrypted CPU runs it: every bit of the registers, flags and RAM is
+// a plane holding that bit of all the instances, one per bit lane, and
+// each instruction is a circuit of word-wide logic gates over the planes
+// (ripple-carry adders, barrel shifters, and loads and stores through
+// multiplexer trees over the whole RAM). As in lanes.h, each step runs the
+// instances whose PC is the lowest, so control flow is not sliced.
+//
+// The gates of each instance's circuits are counted: two-input gates
+// (AND, OR, XOR) and 2:1 multiplexers, NOT being free. Fetch, decode and
+// the PC updates are left out.
+//
+// Building everything with -DSLICES=256 -mavx2 runs 256 instances per
+// plane, with AVX2 instructions.
+#ifndef SLICES
+#define SLICES 64
+#endif
+
+typedef uint64_t slice_t __attribute__((vector_size(SLICES / 8), aligned(SLICES / 8)));
+
+struct cpu_slices {
+    slice_t reg[16][16];    // reg[r][bit]
+    slice_t flag_sign;
+    slice_t flag_overflow;
+    slice_t flag_zero;
+    slice_t flag_carry;
+    slice_t *ram;           // ram[addr*8 + bit]
+    slice_t *scratch;       // for the multiplexer trees
+    uint16_t pc[SLICES];
+    int nlanes;
+
+    // Per instance, as in struct cpu_lanes, and its gate counts.
+    long cycles[SLICES];
+    uint8_t halt[SLICES];
+    uint64_t gates[SLICES];
+    uint64_t muxes[SLICES];
+
+    // Gates evaluated by the current step, for all of its instances.
+    uint64_t step_gates;
+    uint64_t step_muxes;
+
+    // Holds the shared ROM and its predecoded ops.
+    struct cpu base;
+};
+
+// Start nlanes (<= SLICES) instances from the state of base, RAM
+// included, which slices_write_ram() then replaces lane by lane. The
+// planes are allocated here and released by slices_free().
+void slices_init(struct cpu_slices *S, const struct cpu *base, int nlanes);
+void slices_free(struct cpu_slices *S);
+void slices_write_ram(struct cpu_slices *S, int l, const uint8_t *ram);
+void slices_read_regs(const struct cpu_slices *S, int l, uint16_t reg[16]);
+// Execute up to ncycles instructions on every instance.
+void slices_run(struct cpu_slices *S, long ncycles);
+
+#endif
@@ -0,0 +1,79 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "block.h"
+#include "jit.h"
+
+static struct block *block_translate(struct cpu *c, uint16_t pc){
+    struct inst_op ops[BLOCK_MAX + 1];
+    uint16_t addr = pc;
+    int n = 0;
+
+    while(n < BLOCK_MAX){
+        struct inst_op *op = &ops[n];
+        inst_predecode(c, inst_list, addr, op);
+        if(op->id == INST_HALT)
+            break;
+        n++;
+        addr = (addr + op->len) & c->rom_mask;
+        if((op->id >= INST_J && op->id <= INST_JBE) || op->id == INST_UNDEF)
+            break;
+    }
+    if(n == 0)
+        return NULL;
+
+    // Every other instruction writes all four flags and only the branches
+    // read them, so walk back from the end of the block, where the flags
+    // are live, and drop the updates that are dead.
+    int live = 1;
+    for(int i=n-1;i>=0;i--){
+        uint8_t id = ops[i].id;
+        if(id >= INST_J && id <= INST_JR)
+            live = 0;   // clears the flags without reading them
+        else if(id >= INST_JL && id <= INST_JBE)
+            live = 1;
+        else if(inst_flagless[id] != NULL){
+            if(!live)
+                ops[i].func = inst_flagless[id];
+            live = 0;
+        }
+    }
+
+    block_thread(ops, n);
+    struct block *b = malloc(sizeof(struct block) + sizeof(struct inst_op) * (n + 1));
+    b->pc = pc;
+    b->n = n;
+    b->next[0] = b->next[1] = NULL;
+    b->next_slot = 0;
+    b->runs = 0;
+    b->native = NULL;
+    memcpy(b->ops, ops, sizeof(struct inst_op) * (n + 1));
+    return b;
+}
+
+struct block *block_get(struct cpu *c){
+    uint16_t addr = c->pc & c->rom_mask;
+    if(addr & 1)
+        return NULL;
+
+    if(c->blocks == NULL)
+        c->blocks = calloc(c->rom_size/2, sizeof(struct block *));
+    struct block **slot = &c->blocks[addr>>1];
+    if(*slot == NULL)
+        *slot = block_translate(c, addr);
+    return *slot;
+}
+
+void block_flush(struct cpu *c){
+    if(c->blocks == NULL)
+        return;
+    for(int i=0;i<c->rom_size/2;i++){
+        free(c->blocks[i]);
+        c->blocks[i] = NULL;
+    }
+    if(c->jit != NULL)
+        jit_reset(c->jit);
+}
@@ -0,0 +1,55 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+// A basic block: the instructions from pc up to the first jump, branch or
+// undefined instruction, translated once for cpu_run(). The ops are
+// predecoded as in the icache, except that flag updates overwritten by a
+// later instruction of the block before any branch reads them are dropped.
+#define BLOCK_MAX 32
+
+typedef void (*block_native)(struct cpu *c);
+
+struct block {
+    uint16_t pc;
+    uint16_t n;
+    // The last two successors seen, usually both sides of the branch, so
+    // that cpu_run() goes from block to block without a lookup.
+    struct block *next[2];
+    uint8_t next_slot;
+    // Times run by the interpreter, and the code that replaces the ops
+    // once the block is hot (see jit.h), or NULL.
+    uint32_t runs;
+    block_native native;
+    struct inst_op ops[];
+};
+
+// The block at c->pc, translated if needed, or NULL if none can start
+// there (odd PC or halt_pc).
+struct block *block_get(struct cpu *c);
+// Drop every block; called by icache_invalidate().
+void block_flush(struct cpu *c);
+// Set the xop of ops[0..n-1] and ops[n], which ends them, for
+// block_exec() to run them (both in inst.c).
+void block_thread(struct inst_op *ops, int n);
+void block_exec(struct cpu *c, const struct inst_op *ops);
+
+static inline struct block *block_next(struct cpu *c, struct block *b){
+    uint16_t pc = c->pc & c->rom_mask;
+    if(b->next[0] != NULL && b->next[0]->pc == pc)
+        return b->next[0];
+    if(b->next[1] != NULL && b->next[1]->pc == pc)
+        return b->next[1];
+
+    struct block *n = block_get(c);
+    if(n != NULL){
+        b->next[b->next_slot] = n;
+        b->next_slot ^= 1;
+    }
+    return n;
+}
+
+#endif
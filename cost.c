@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "elf_parser.h"
+#include "profile.h"
+#include "cost.h"
+
+static _Noreturn void cost_invalid(const char *file_name, int line){
+    fprintf(stderr, "Invalid cost table :%s:%d\n", file_name, line);
+    exit(1);
+}
+
+struct cost_table *cost_load(const char *file_name){
+    FILE *fp = fopen(file_name, "r");
+    if(fp == NULL){
+        fprintf(stderr, "Failed to open file :%s\n", file_name);
+        exit(1);
+    }
+
+    struct cost_table *t = calloc(1, sizeof(struct cost_table));
+    char line[256];
+    for(int n=1;fgets(line, sizeof(line), fp) != NULL;n++){
+        char *hash = strchr(line, '#');
+        if(hash != NULL)
+            *hash = '\0';
+        char name[32], extra[2];
+        unsigned long long a, b;
+        double seconds;
+        if(sscanf(line, " %31s", name) != 1)
+            continue;
+
+        if(strcmp(name, "gate_time") == 0){
+            if(sscanf(line, " %*s %lf %1s", &seconds, extra) != 1 || seconds < 0)
+                cost_invalid(file_name, n);
+            t->gate_time = seconds;
+        }
+        else if(strcmp(name, "rom") == 0 || strcmp(name, "ram") == 0){
+            if(sscanf(line, " %*s %llu %llu %1s", &a, &b, extra) != 2)
+                cost_invalid(file_name, n);
+            if(name[1] == 'o' && (a == 2 || a == 4))
+                t->rom[a] = b;
+            else if(name[1] == 'a' && (a == 1 || a == 2))
+                t->ram[a] = b;
+            else
+                cost_invalid(file_name, n);
+        }
+        else{
+            if(sscanf(line, " %*s %llu %1s", &a, extra) != 1)
+                cost_invalid(file_name, n);
+            int id;
+            for(id=0;id<INST_UNDEF;id++)
+                if(strcmp(name, inst_list[id].name) == 0)
+                    break;
+            if(strcmp(name, "cycle") == 0)
+                t->cycle = a;
+            else if(id < INST_UNDEF)
+                t->inst[id] = a;
+            else
+                cost_invalid(file_name, n);
+        }
+    }
+    fclose(fp);
+    return t;
+}
+
+// Bytes of RAM each instruction accesses.
+static int ram_bytes(int id){
+    switch(id){
+        case INST_LW: case INST_LWSP: case INST_SW: case INST_SWSP:
+            return 2;
+        case INST_LB: case INST_LBU: case INST_SB:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static const char *inst_name(int id){
+    return id == INST_UNDEF ? "UNDEF" : inst_list[id].name;
+}
+
+// Functions found from the run: the entry point and the JAL targets.
+static struct elf_symbol *called_functions(struct cpu *c, const struct profile *p, uint16_t entry,
+        char (*names)[8], int *n){
+    uint8_t *start = calloc(p->rom_size, 1);
+    start[entry & (p->rom_size - 1)] = 1;
+    for(int pc=0;pc<p->rom_size;pc+=2){
+        if(p->pc_hits[pc] == 0 || p->pc_inst[pc] != INST_JAL)
+            continue;
+        struct inst_op op;
+        inst_decode(c, inst_list, pc, &op);
+        start[(uint16_t)(pc + 2 + op.imm) & (p->rom_size - 1)] = 1;
+    }
+
+    struct elf_symbol *funcs = malloc(sizeof(struct elf_symbol) * p->rom_size);
+    *n = 0;
+    for(int pc=0;pc<p->rom_size;pc++){
+        if(!start[pc])
+            continue;
+        sprintf(names[*n], "0x%04x", pc);
+        funcs[*n].addr = pc;
+        funcs[*n].name = names[*n];
+        (*n)++;
+    }
+    free(start);
+    return funcs;
+}
+
+void cost_print(FILE *fh, const struct cost_table *t, struct cpu *c, const struct profile *p,
+        const struct elf_symbol *funcs, int nfuncs, uint16_t entry){
+    char (*names)[8] = NULL;
+    struct elf_symbol *found = NULL;
+    if(nfuncs == 0){
+        names = malloc(8 * p->rom_size);
+        funcs = found = called_functions(c, p, entry, names, &nfuncs);
+    }
+
+    // Costs by instruction and by function, and of fetch, decode and the
+    // memory accesses.
+    uint64_t inst_gates[INST_NUM] = {0};
+    uint64_t *func_cycles = calloc(nfuncs + 1, sizeof(uint64_t));
+    uint64_t *func_gates = calloc(nfuncs + 1, sizeof(uint64_t));
+    uint64_t cycle_gates = 0, rom_reads = 0, rom_gates = 0, ram_accesses = 0, ram_gates = 0;
+    uint64_t total = 0;
+    int f = 0;  // funcs[f-1] holds pc, or none for f == 0
+    for(int pc=0;pc<p->rom_size;pc++){
+        while(f < nfuncs && funcs[f].addr <= pc)
+            f++;
+        uint64_t hits = p->pc_hits[pc];
+        if(hits == 0)
+            continue;
+        int id = p->pc_inst[pc];
+        struct inst_op op;
+        inst_decode(c, inst_list, pc, &op);
+        int bytes = ram_bytes(id);
+
+        uint64_t rom = t->rom[op.len], ram = bytes ? t->ram[bytes] : 0;
+        uint64_t gates = hits * (t->cycle + rom + ram + (id < INST_UNDEF ? t->inst[id] : 0));
+        inst_gates[id] += gates;
+        func_cycles[f] += hits;
+        func_gates[f] += gates;
+        cycle_gates += hits * t->cycle;
+        rom_reads += hits;
+        rom_gates += hits * rom;
+        if(bytes){
+            ram_accesses += hits;
+            ram_gates += hits * ram;
+        }
+        total += gates;
+    }
+    double share = total ? 100.0 / total : 0;
+
+    fprintf(fh, "%-8s %12s %16s %7s %12s\n", "inst", "count", "gates", "share", "seconds");
+    for(int id=0;id<INST_NUM;id++){
+        if(p->inst[id] == 0)
+            continue;
+        fprintf(fh, "%-8s %12llu %16llu %6.2f%% %12.6g\n", inst_name(id), (unsigned long long)p->inst[id],
+                (unsigned long long)inst_gates[id], share * inst_gates[id], inst_gates[id] * t->gate_time);
+    }
+    fprintf(fh, "%-8s %12llu %16llu %7s %12.6g\n", "total", (unsigned long long)p->cycles,
+            (unsigned long long)total, "", total * t->gate_time);
+    fprintf(fh, "%-8s %12llu %16llu %6.2f%%\n", "decode", (unsigned long long)p->cycles,
+            (unsigned long long)cycle_gates, share * cycle_gates);
+    fprintf(fh, "%-8s %12llu %16llu %6.2f%%\n", "rom", (unsigned long long)rom_reads,
+            (unsigned long long)rom_gates, share * rom_gates);
+    fprintf(fh, "%-8s %12llu %16llu %6.2f%%\n", "ram", (unsigned long long)ram_accesses,
+            (unsigned long long)ram_gates, share * ram_gates);
+
+    fprintf(fh, "\n%-24s %12s %16s %7s %12s\n", "function", "cycles", "gates", "share", "seconds");
+    for(f=0;f<=nfuncs;f++){
+        if(func_cycles[f] == 0)
+            continue;
+        fprintf(fh, "%-24s %12llu %16llu %6.2f%% %12.6g\n", f == 0 ? "?" : funcs[f-1].name,
+                (unsigned long long)func_cycles[f], (unsigned long long)func_gates[f],
+                share * func_gates[f], func_gates[f] * t->gate_time);
+    }
+
+    free(func_cycles);
+    free(func_gates);
+    free(found);
+    free(names);
+}
@@ -0,0 +1,36 @@
+#ifndef COST_H
+#define COST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "elf_parser.h"
+#include "profile.h"
+
+// A cost model of running a program on an encrypted CPU, read from a text
+// file with an entry per line ('#' starts a comment):
+//   NAME GATES        per instruction NAME of inst_list[] (e.g. ADD)
+//   cycle GATES       per cycle, for fetch and decode
+//   rom BYTES GATES   per ROM read of 2 or 4 bytes (the instruction)
+//   ram BYTES GATES   per RAM access of 1 or 2 bytes
+//   gate_time SECONDS per gate, bootstrapping included
+// Entries left out cost nothing.
+struct cost_table {
+    uint64_t inst[INST_NUM];
+    uint64_t cycle;
+    uint64_t rom[5];    // by access size in bytes
+    uint64_t ram[3];
+    double gate_time;
+};
+
+struct cost_table *cost_load(const char *file_name);
+
+// Project the gates and wall time of the run counted by p, by instruction
+// and by function. The functions are those of funcs (sorted by address),
+// or without any, entry and the targets of the JALs that ran.
+void cost_print(FILE *fh, const struct cost_table *t, struct cpu *c, const struct profile *p,
+        const struct elf_symbol *funcs, int nfuncs, uint16_t entry);
+
+#endif
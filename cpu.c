@@ -0,0 +1,211 @@
+#define _GNU_SOURCE    // memfd_create()
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "block.h"
+#include "jit.h"
+
+// The memories shared by a CPU and its forks: a file in memory holding
+// the ROM and then the RAM, each padded to whole pages.
+struct mem_image {
+    int fd;
+    int refs;
+    size_t rom_len;
+    size_t len;
+};
+
+void init_cpu(struct cpu *c, int rom_size, int ram_size){
+    assert(rom_size >= 2 && ram_size >= 2);
+    c->rom_size = rom_size;
+    c->ram_size = ram_size;
+    c->rom_mask = rom_size - 1;
+    c->ram_mask = ram_size - 1;
+    c->inst_rom = malloc(rom_size);
+    c->data_ram = malloc(ram_size);
+    c->icache = malloc(sizeof(struct inst_op) * (rom_size/2));
+    c->blocks = NULL;
+    c->jit = NULL;
+    c->map = NULL;
+    c->image = NULL;
+
+    c->halt_pc = -1;
+    c->log = NULL;
+    c->trace_log = NULL;
+    c->trace_out = NULL;
+    c->trace_ref = NULL;
+    c->prof = NULL;
+    c->mem_delta = NULL;
+    c->dbg = NULL;
+
+    reset_cpu(c);
+}
+
+void reset_cpu(struct cpu *c){
+    for(int i=0;i<16;i++){
+        c->reg[i] = 0;
+    }
+    memset(c->inst_rom, 0, c->rom_size);
+    memset(c->data_ram, 0, c->ram_size);
+    memset(c->ram_dirty, 1, sizeof(c->ram_dirty));
+    c->rom_dirty = 1;
+    c->pc = 0;
+    c->cycle = 0;
+
+    c->flag_sign = 0;
+    c->flag_overflow = 0;
+    c->flag_zero = 0;
+    c->flag_carry = 0;
+    c->flags_kind = FLAGS_NONE;
+
+    icache_invalidate(c);
+    c->icache_list = NULL;
+    c->halt = HALT_NONE;
+}
+
+static void mem_image_release(struct mem_image *m){
+    if(__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0){
+        close(m->fd);
+        free(m);
+    }
+}
+
+void free_cpu(struct cpu *c){
+    if(c->image != NULL){
+        munmap(c->inst_rom, c->image->len);
+        mem_image_release(c->image);
+        c->image = NULL;
+    }else if(c->map != NULL){
+        munmap(c->map, c->map_len);
+    }else{
+        free(c->inst_rom);
+        free(c->data_ram);
+    }
+    free(c->icache);
+    block_flush(c);
+    free(c->blocks);
+    c->blocks = NULL;
+    jit_free(c->jit);
+    c->jit = NULL;
+}
+
+// Move the memories of c to a new image, and map it in their place.
+static int mem_image_new(struct cpu *c){
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct mem_image *m = malloc(sizeof(struct mem_image));
+    m->refs = 1;
+    m->rom_len = (c->rom_size + page - 1) / page * page;
+    m->len = m->rom_len + (c->ram_size + page - 1) / page * page;
+
+    uint8_t *map = MAP_FAILED;
+    if((m->fd = memfd_create("rv16k", MFD_CLOEXEC)) >= 0
+            && ftruncate(m->fd, m->len) == 0
+            && pwrite(m->fd, c->inst_rom, c->rom_size, 0) == c->rom_size
+            && pwrite(m->fd, c->data_ram, c->ram_size, m->rom_len) == c->ram_size)
+        map = mmap(NULL, m->len, PROT_READ | PROT_WRITE, MAP_PRIVATE, m->fd, 0);
+    if(map == MAP_FAILED){
+        if(m->fd >= 0)
+            close(m->fd);
+        free(m);
+        return -1;
+    }
+
+    if(c->map != NULL){
+        munmap(c->map, c->map_len);
+        c->map = NULL;
+    }else{
+        free(c->inst_rom);
+        free(c->data_ram);
+    }
+    c->inst_rom = map;
+    c->data_ram = map + m->rom_len;
+    c->image = m;
+    memset(c->ram_dirty, 0, sizeof(c->ram_dirty));
+    c->rom_dirty = 0;
+    return 0;
+}
+
+int cpu_fork(struct cpu *dst, struct cpu *src){
+    if(src->image == NULL && mem_image_new(src) != 0)
+        return -1;
+    struct mem_image *m = src->image;
+    uint8_t *map = mmap(NULL, m->len, PROT_READ | PROT_WRITE, MAP_PRIVATE, m->fd, 0);
+    if(map == MAP_FAILED)
+        return -1;
+
+    if(src->rom_dirty)
+        memcpy(map, src->inst_rom, src->rom_size);
+    int npages = (src->ram_size + RAM_PAGE_SIZE - 1) >> RAM_PAGE_BITS;
+    int page_len = src->ram_size < RAM_PAGE_SIZE ? src->ram_size : RAM_PAGE_SIZE;
+    for(int i=0;i<npages;i++){
+        if(src->ram_dirty[i])
+            memcpy(map + m->rom_len + i * RAM_PAGE_SIZE, src->data_ram + i * RAM_PAGE_SIZE, page_len);
+    }
+    __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+
+    // Pages differ from the image in dst where they do in src.
+    *dst = *src;
+    dst->inst_rom = map;
+    dst->data_ram = map + m->rom_len;
+    // Empty, which holds for any list: no need to invalidate it (and touch
+    // all of it) on the first run.
+    dst->icache = calloc(dst->rom_size/2, sizeof(struct inst_op));
+    dst->blocks = NULL;
+    dst->jit = NULL;
+    dst->log = NULL;
+    dst->trace_log = NULL;
+    dst->trace_out = NULL;
+    dst->trace_ref = NULL;
+    dst->prof = NULL;
+    dst->mem_delta = NULL;
+    dst->dbg = NULL;
+    return 0;
+}
+
+void ram_touch(struct cpu *c, uint16_t addr, size_t len){
+    for(size_t i=0;i<len;i+=RAM_PAGE_SIZE)
+        c->ram_dirty[((addr + i) & c->ram_mask) >> RAM_PAGE_BITS] = 1;
+    if(len > 0)
+        c->ram_dirty[((addr + len - 1) & c->ram_mask) >> RAM_PAGE_BITS] = 1;
+}
+
+// Parse a memory size such as "512", "0x800" or "64K". Returns -1 unless
+// it is a power of two between 2 and MEM_SIZE_MAX.
+int parse_mem_size(const char *s){
+    char *end;
+    long size = strtol(s, &end, 0);
+    if(*end == 'K' || *end == 'k'){
+        size *= 1024;
+        end++;
+    }
+    if(*end != '\0' || size < 2 || size > MEM_SIZE_MAX || (size & (size - 1)) != 0)
+        return -1;
+    return size;
+}
+
+// Hex bytes separated by spaces, tabs or newlines.
+// Returns the number of bytes written.
+int set_bytes_from_str(uint8_t *dst, const char * const src, int N)
+{
+    char *buf = (char *)malloc(strlen(src) + 1);
+    strcpy(buf, src);
+
+    int idst = 0;
+    char *tp, *saveptr;
+    tp = strtok_r(buf, " \t\n", &saveptr);
+    while (tp != NULL) {
+        assert(idst < N && "Too large data!");
+        uint8_t val = strtol(tp, NULL, 16);
+        dst[idst++] = val;
+        tp = strtok_r(NULL, " \t\n", &saveptr);
+    }
+
+    free(buf);
+    return idst;
+}
@@ -1,17 +1,140 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <stddef.h>
+
+#include "trace.h"
+
+// Default memory sizes. Sizes are powers of two up to MEM_SIZE_MAX, the
+// whole 16-bit address space, and addresses wrap around them as if only
+// the low address bits were decoded.
 #define INST_ROM_SIZE 512
 #define DATA_RAM_SIZE 512
+#define MEM_SIZE_MAX 0x10000
+// Granularity at which cpu_fork() copies the RAM written since sharing it.
+#define RAM_PAGE_BITS 8
+#define RAM_PAGE_SIZE (1 << RAM_PAGE_BITS)
+
+struct cpu;
+struct inst_op;
+struct block;
+struct jit;
+struct profile;
+struct debug;
+struct mem_delta;
+struct mem_image;
+typedef void (*inst_func)(struct cpu *c, const struct inst_op *op);
+
+// An instruction with its fields already extracted (see inst_predecode()).
+struct inst_op {
+    inst_func func;
+    uint16_t imm;   // second word, or the immediate already shifted/sign-extended
+    uint8_t rd;
+    uint8_t rs;
+    uint8_t len;    // 2 or 4 bytes
+    uint8_t id;     // enum inst_id
+    uint8_t xop;    // in blocks only: what block_exec() runs (see inst.c)
+};
+
+// What the flags were last set from, if not computed yet (see inst.c).
+enum flags_kind {
+    FLAGS_NONE,     // flag_sign etc. are up to date
+    FLAGS_ADDR,
+    FLAGS_ADD,
+    FLAGS_SUB,
+    FLAGS_LOGIC,
+    FLAGS_MOV,
+};
+
+// Why the last cpu_run() stopped before running all of its cycles.
+enum cpu_halt {
+    HALT_NONE,
+    HALT_LOOP,  // the last instruction would change nothing if run again
+    HALT_PC,    // reached halt_pc, which is not executed
+    HALT_BREAK, // reached a breakpoint (see debug.h), not executed
+    HALT_WATCH, // wrote to a watched RAM address
+};
+
 struct cpu {
     uint16_t reg[16];
     uint16_t pc;
-    uint8_t inst_rom[INST_ROM_SIZE];
-    uint8_t data_ram[DATA_RAM_SIZE];
+    uint8_t *inst_rom;
+    uint8_t *data_ram;
+    int rom_size;
+    int ram_size;
+    uint16_t rom_mask;  // rom_size - 1
+    uint16_t ram_mask;  // ram_size - 1
+    uint64_t cycle;     // cycles executed since reset
+
+    // The snapshot that inst_rom and data_ram point into (see
+    // snapshot_load()), or NULL if they were allocated by init_cpu().
+    void *map;
+    size_t map_len;
+    // Or the image they map copy-on-write once forked (see cpu_fork()),
+    // with the RAM pages and whether the ROM were written since. Writes
+    // through mem_write_b(), mem_write_w() and native code mark their
+    // page; others call ram_touch(), and set rom_dirty along with
+    // invalidating the icache.
+    struct mem_image *image;
+    uint8_t ram_dirty[MEM_SIZE_MAX >> RAM_PAGE_BITS];
+    uint8_t rom_dirty;
     uint8_t flag_sign;
     uint8_t flag_overflow;
     uint8_t flag_zero;
     uint8_t flag_carry;
+    // Read the four flags above through flags_eval(): cpu_run() records
+    // the operation behind them here instead of computing them.
+    uint8_t flags_kind; // enum flags_kind
+    uint16_t flags_s;
+    uint16_t flags_d;
+    uint16_t flags_res;
+
+    // Predecoded ROM indexed by pc/2. func == NULL means not decoded yet;
+    // call icache_invalidate() whenever inst_rom is written.
+    struct inst_op *icache;
+    struct inst_op op_unaligned;
+    const struct inst_data *icache_list;
+    // Translated blocks indexed by pc/2 (see block.h), allocated on first
+    // use and flushed along with the icache.
+    struct block **blocks;
+    // Compiles hot blocks to native code if not NULL.
+    struct jit *jit;
+
+    // Stop before executing the instruction at halt_pc; -1 for none.
+    // Invalidate the icache after changing it.
+    int halt_pc;
+    uint8_t halt;   // enum cpu_halt
+
+    // Messages from log_printf(), or NULL to stay quiet.
+    FILE *log;
+
+    // Filled by cpu_run_trace() every cycle and passed on to each of the
+    // sinks that is not NULL: the text log, a binary trace file, a
+    // reference trace to compare against, execution counts, and RAM
+    // changes.
+    struct trace_rec rec;
+    FILE *trace_log;
+    struct trace_writer *trace_out;
+    struct trace_checker *trace_ref;
+    struct profile *prof;
+    struct mem_delta *mem_delta;
+    // Breakpoints and watchpoints, which cpu_run() ignores, or NULL.
+    struct debug *dbg;
 };
 
+// init_cpu() allocates the memories, which free_cpu() releases;
+// reset_cpu() zeroes the whole state but keeps the sizes.
+void init_cpu(struct cpu *c, int rom_size, int ram_size);
+void reset_cpu(struct cpu *c);
+void free_cpu(struct cpu *c);
+// Start dst as a copy of src (registers, flags, memories and halt_pc, but
+// no JIT, trace sinks or debug state) in time proportional to the RAM
+// pages src wrote since its memories were last shared: the first fork
+// moves them to an image that both then map privately, which the kernel
+// copies page by page on write. Returns -1 if it cannot map memory.
+int cpu_fork(struct cpu *dst, struct cpu *src);
+void ram_touch(struct cpu *c, uint16_t addr, size_t len);
+int parse_mem_size(const char *s);
+int set_bytes_from_str(uint8_t *dst, const char * const src, int N);
+
 #endif
@@ -0,0 +1,37 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "debug.h"
+
+static struct debug *debug_get(struct cpu *c){
+    if(c->dbg == NULL)
+        c->dbg = calloc(1, sizeof(struct debug));
+    return c->dbg;
+}
+
+// Returns whether the bit changed.
+static int set_bit(uint64_t *map, uint16_t addr, int on){
+    uint64_t bit = (uint64_t)1 << (addr & 63);
+    if(!(map[addr >> 6] & bit) == !on)
+        return 0;
+    map[addr >> 6] ^= bit;
+    return 1;
+}
+
+void debug_set_break(struct cpu *c, uint16_t pc, int on){
+    if(set_bit(debug_get(c)->brk, pc & c->rom_mask, on))
+        icache_invalidate(c);
+}
+
+void debug_set_watch(struct cpu *c, uint16_t addr, int on){
+    struct debug *d = debug_get(c);
+    if(set_bit(d->watch, addr & c->ram_mask, on))
+        d->nwatch += on ? 1 : -1;
+}
+
+void debug_free(struct cpu *c){
+    free(c->dbg);
+    c->dbg = NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+#include "trace.h"
+
+// Breakpoints on ROM addresses and watchpoints on data RAM writes, one bit
+// per address, in c->dbg. Breakpoints are INST_HALT ops in the icache like
+// halt_pc, so they cost nothing until reached. Only cpu_run_trace()
+// checks watchpoints: run it instead of cpu_run() while debug_watching().
+struct debug {
+    uint64_t brk[MEM_SIZE_MAX / 64];
+    uint64_t watch[MEM_SIZE_MAX / 64];
+    int nwatch;         // bits set in watch
+    uint16_t hit_addr;  // RAM address written when a run stopped on HALT_WATCH
+};
+
+// Allocate c->dbg on first use. Changing a breakpoint flushes the icache.
+void debug_set_break(struct cpu *c, uint16_t pc, int on);
+void debug_set_watch(struct cpu *c, uint16_t addr, int on);
+void debug_free(struct cpu *c);
+
+static inline int debug_test(const uint64_t *map, uint16_t addr){
+    return (map[addr >> 6] >> (addr & 63)) & 1;
+}
+
+static inline int debug_watching(const struct cpu *c){
+    return c->dbg != NULL && c->dbg->nwatch > 0;
+}
+
+// Whether the write recorded in r, if any, touches a watched byte. Watched
+// addresses are RAM offsets, so the write address wraps as in mem_write_w().
+static inline int debug_hit_write(struct debug *d, const struct trace_rec *r, uint16_t ram_mask){
+    if(!(r->bits & (TRACE_MEM_B | TRACE_MEM_W)))
+        return 0;
+    uint16_t addr = r->mem_addr & ram_mask;
+    if(!debug_test(d->watch, addr)){
+        addr = (r->mem_addr + 1) & ram_mask;
+        if(!(r->bits & TRACE_MEM_W) || !debug_test(d->watch, addr))
+            return 0;
+    }
+    d->hit_addr = addr;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,88 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+#include "bitpat.h"
+#include "inst.h"
+#include "decode.h"
+#include "block.h"
+#include "debug.h"
+
+uint8_t decode_table[1 << 16];
+
+void decode_init(void){
+    uint16_t mask[INST_UNDEF], value[INST_UNDEF];
+    int ninst;
+
+    for(ninst=0;inst_list[ninst].bit_pattern != NULL;ninst++){
+        assert(ninst < INST_UNDEF && "Too many instructions.");
+        if(!bitpat_compile(inst_list[ninst].bit_pattern, &mask[ninst], &value[ninst]))
+            exit(1);
+    }
+    assert(ninst == INST_UNDEF && "inst_list[] does not match enum inst_id.");
+
+    // Two patterns overlap if they agree on every bit fixed by both of them.
+    // The table keeps the old first-match-wins order, but say so loudly.
+    for(int i=0;i<ninst;i++){
+        for(int j=i+1;j<ninst;j++){
+            if(((value[i]^value[j])&mask[i]&mask[j]) == 0){
+                fprintf(stderr, "Ambiguous bit patterns: %s and %s (using %s)\n",
+                        inst_list[i].bit_pattern, inst_list[j].bit_pattern,
+                        inst_list[i].bit_pattern);
+            }
+        }
+    }
+
+    for(uint32_t t=0;t<(1 << 16);t++){
+        decode_table[t] = ninst;
+        for(int i=0;i<ninst;i++){
+            if((t&mask[i]) == value[i]){
+                decode_table[t] = i;
+                break;
+            }
+        }
+    }
+}
+
+void inst_decode(struct cpu *c, const struct inst_data *list, uint16_t addr, struct inst_op *op){
+    uint16_t inst = rom_read_w(c, addr);
+    uint8_t id = decode_table[inst];
+    const struct inst_data *data = &list[id];
+
+    op->func = data->func;
+    op->id = id;
+    op->imm = 0;
+    op->rd = 0;
+    op->rs = 0;
+    op->len = 2;
+    if(data->dec != NULL)
+        data->dec(c, addr, inst, op);
+}
+
+void inst_predecode(struct cpu *c, const struct inst_data *list, uint16_t addr, struct inst_op *op){
+    uint16_t halt = HALT_NONE;
+    if(addr == c->halt_pc)
+        halt = HALT_PC;
+    else if(c->dbg != NULL && debug_test(c->dbg->brk, addr))
+        halt = HALT_BREAK;
+    if(halt == HALT_NONE){
+        inst_decode(c, list, addr, op);
+        return;
+    }
+
+    op->func = list[INST_HALT].func;
+    op->id = INST_HALT;
+    op->imm = halt;
+    op->rd = 0;
+    op->rs = 0;
+    op->len = 2;
+}
+
+void icache_invalidate(struct cpu *c){
+    for(int i=0;i<c->rom_size/2;i++){
+        c->icache[i].func = NULL;
+    }
+    block_flush(c);
+}
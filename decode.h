@@ -0,0 +1,12 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stdint.h>
+
+// Index into inst_list[] for every 16-bit instruction word. Words that
+// match no pattern map to the terminator entry at the end of the list.
+extern uint8_t decode_table[1 << 16];
+
+void decode_init(void);
+
+#endif
@@ -16,6 +16,9 @@
 #define EF_RISCV_RVC 1
 
 #define PT_LOAD 1
+#define SHT_SYMTAB 2
+#define STT_FUNC 2
+#define ELF32_ST_TYPE(info) ((info) & 0xf)
 
 #define AT_NULL   0
 #define AT_PHDR   3
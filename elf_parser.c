@@ -1,107 +1,168 @@
-#include <assert.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "log.h"
 #include "elf.h"
 #include "cpu.h"
+#include "inst.h"
+#include "elf_parser.h"
+
+static struct elf_image *elf_error(struct elf_image *img, const char *file_name, const char *msg){
+    fprintf(stderr, "%s :%s\n", msg, file_name);
+    if(img != NULL)
+        elf_image_close(img);
+    return NULL;
+}
 
-//#define DEBUG
-
-void elf_parse(struct cpu *c, char* file_name){
+struct elf_image *elf_image_open(const char *file_name){
     struct stat st;
-    FILE *fp;
-    int file_size;
-    uint8_t* file_buffer;
+    int fd;
 
-    if(stat(file_name, &st) != 0){
-        log_printf("Failed to get file size :%s\n", file_name);
-        exit(1);
+    if((fd = open(file_name, O_RDONLY)) < 0)
+        return elf_error(NULL, file_name, "Failed to open file");
+    if(fstat(fd, &st) != 0 || st.st_size < sizeof(Elf32_Ehdr)){
+        close(fd);
+        return elf_error(NULL, file_name, "Unkown file format");
     }
-    file_size = st.st_size;
 
-    if((fp = fopen(file_name, "rb")) == NULL){
-        log_printf("Failed to open file :%s\n", file_name);
-        exit(1);
-    }
+    uint8_t *file_buffer = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(file_buffer == MAP_FAILED)
+        return elf_error(NULL, file_name, "Failed to map file");
 
-    file_buffer = malloc(file_size);
+    struct elf_image *img = malloc(sizeof(struct elf_image));
+    img->map = file_buffer;
+    img->map_len = st.st_size;
+    img->nsegments = 0;
 
-    int load_size = fread(file_buffer, sizeof(uint8_t), file_size, fp);
-    if(load_size != file_size){
-        log_printf("File size is not matched: %s\n", file_name);
-        exit(1);
+    Elf32_Ehdr *Ehdr = (Elf32_Ehdr *)file_buffer;
+    if(!IS_ELF(*Ehdr))
+        return elf_error(img, file_name, "Unkown file format");
+    if(!IS_ELF32(*Ehdr))
+        return elf_error(img, file_name, "Not ELF32 format");
+
+    // Since RV16K specification says the initial value of PC is 0, e_entry should be 0.
+    if(Ehdr->e_entry != 0)
+        return elf_error(img, file_name, "The entry point of the program should be address 0");
+    img->entry = Ehdr->e_entry;
+
+    if((uint64_t)Ehdr->e_phoff + (uint64_t)Ehdr->e_phnum * sizeof(Elf32_Phdr) > st.st_size)
+        return elf_error(img, file_name, "Truncated program headers");
+
+    Elf32_Phdr *Phdr = (Elf32_Phdr *)(file_buffer + Ehdr->e_phoff);
+    for(int i=0;i<Ehdr->e_phnum;i++){
+        if(Phdr[i].p_type != PT_LOAD || Phdr[i].p_memsz == 0)
+            continue;
+        if(img->nsegments == ELF_MAX_SEGMENTS)
+            return elf_error(img, file_name, "Too many PT_LOAD segments");
+        if(Phdr[i].p_filesz > Phdr[i].p_memsz
+                || (uint64_t)Phdr[i].p_offset + Phdr[i].p_filesz > st.st_size)
+            return elf_error(img, file_name, "Invalid PT_LOAD segment");
+
+        // ROM at 0x00000-0x0ffff and RAM at 0x10000-0x1ffff.
+        uint32_t vaddr = Phdr[i].p_vaddr;
+        if(vaddr > 0x1ffff || (vaddr & 0xffff) + Phdr[i].p_memsz > 0x10000)
+            return elf_error(img, file_name, "PT_LOAD segment outside of ROM and RAM");
+
+        struct elf_segment *s = &img->segments[img->nsegments++];
+        s->to_ram = vaddr >= 0x10000;
+        s->addr = vaddr & 0xffff;
+        s->filesz = Phdr[i].p_filesz;
+        s->memsz = Phdr[i].p_memsz;
+        s->data = file_buffer + Phdr[i].p_offset;
     }
-#ifdef DEBUG
-    log_printf("Loaded File: %s (%dbyte)\n", file_name, load_size);
-#endif
 
-    Elf32_Ehdr *Ehdr = (Elf32_Ehdr *)file_buffer;
-    if(!IS_ELF(*Ehdr)){
-        log_printf("Unkown file format\n");
-        exit(1);
+    return img;
+}
+
+int elf_image_load(const struct elf_image *img, struct cpu *c){
+    // Check every segment first, so that nothing is loaded on failure.
+    for(int i=0;i<img->nsegments;i++){
+        const struct elf_segment *s = &img->segments[i];
+        int size = s->to_ram ? c->ram_size : c->rom_size;
+
+        if(s->addr + s->memsz > size){
+            fprintf(stderr, "Too large %s segment at %04X for a %d byte %s\n",
+                    s->to_ram ? "data" : "program", s->addr, size, s->to_ram ? "RAM" : "ROM");
+            return -1;
+        }
     }
-    if(!IS_ELF32(*Ehdr)){
-        log_printf("Not ELF32 format\n");
-        exit(1);
+
+    for(int i=0;i<img->nsegments;i++){
+        const struct elf_segment *s = &img->segments[i];
+        uint8_t *mem = s->to_ram ? c->data_ram : c->inst_rom;
+
+        memcpy(mem + s->addr, s->data, s->filesz);
+        memset(mem + s->addr + s->filesz, 0, s->memsz - s->filesz);
+        if(s->to_ram)
+            ram_touch(c, s->addr, s->memsz);
+        else
+            c->rom_dirty = 1;
+        log_printf(c, "%s: %04X-%04X (%d bytes, %d zeroed)\n", s->to_ram ? "RAM" : "ROM",
+                   s->addr, s->addr + s->memsz - 1, s->memsz, s->memsz - s->filesz);
     }
-#ifdef DEBUG
-    log_printf("Type:ELF32\n");
-    log_printf("Entry point:%d\n\n", Ehdr->e_entry);
-#endif
-
-    Elf32_Shdr *Shdr = (Elf32_Shdr *)(file_buffer + Ehdr->e_shoff);
-    char *shstr = file_buffer + Shdr[Ehdr->e_shstrndx].sh_offset;
-    for(int i=0; i<Ehdr->e_shnum;i++){
-        char *name = &shstr[Shdr[i].sh_name];
-#ifdef DEBUG
-        log_printf("Shdr:%d sh_name:%s\n", i, &shstr[Shdr[i].sh_name]);
-        log_printf("Shdr:%d sh_type:%04X\n", i, Shdr[i].sh_type);
-        log_printf("Shdr:%d sh_flags:%04X\n", i, Shdr[i].sh_flags);
-        log_printf("Shdr:%d sh_addr:%04X\n", i, Shdr[i].sh_addr);
-        log_printf("Shdr:%d sh_offset:%04X\n", i, Shdr[i].sh_offset);
-        log_printf("Shdr:%d sh_size:%04X\n", i, Shdr[i].sh_size);
-        log_printf("\n");
-#endif
-
-        if (strcmp(".text", name) == 0) {   // ROM
-            // For now we assume that .text section begins at address 0.
-            assert(Shdr[i].sh_addr == 0 && "The beginning address of .text section should be 0.");
-
-            uint8_t *obj = (uint8_t *)(file_buffer+Shdr[i].sh_offset);
-            for(int j=0;j<Shdr[i].sh_size;j+=2){
-                assert(j + 1 < INST_ROM_SIZE && "Too large program (.text) data.");
-
-                log_printf("ROM: %04X %02X%02X\n", j, obj[j], obj[j+1]);
-                c->inst_rom[j] = obj[j];
-                c->inst_rom[j+1] = obj[j+1];
-            }
-            log_printf("\n");
-        }
-        else if (0x00010000 <= Shdr[i].sh_addr && Shdr[i].sh_addr <= 0x0001ffff) {  // RAM
-            uint8_t *obj = (uint8_t *)(file_buffer+Shdr[i].sh_offset);
-            uint8_t data_ram_offset = Shdr[i].sh_addr & 0x0000ffff;
 
-            if (strcmp(".bss", name) == 0) {
-                // .bss section shouldn't be loaded to RAM, but be placed after all other sections.
-                // FIXME: Check if this sections is placed after all other sections.
-                continue;
-            }
+    icache_invalidate(c);
+    c->pc = img->entry;
+    return 0;
+}
 
-            for(int j=0;j<Shdr[i].sh_size;j+=2){
-                assert(data_ram_offset + j + 1 < DATA_RAM_SIZE && "Too large data (.data/.rodata).");
+static int symbol_cmp(const void *a, const void *b){
+    return ((const struct elf_symbol *)a)->addr - ((const struct elf_symbol *)b)->addr;
+}
 
-                log_printf("RAM: %04X %02X%02X\n", data_ram_offset + j, obj[j], obj[j+1]);
-                c->data_ram[data_ram_offset+ j] = obj[j];
-                c->data_ram[data_ram_offset+ j+1] = obj[j+1];
-            }
-            log_printf("\n");
+struct elf_symbol *elf_image_functions(const struct elf_image *img, int *n){
+    const uint8_t *file_buffer = img->map;
+    const Elf32_Ehdr *Ehdr = img->map;
+    struct elf_symbol *syms = NULL;
+    *n = 0;
+
+    if(Ehdr->e_shentsize != sizeof(Elf32_Shdr)
+            || (uint64_t)Ehdr->e_shoff + (uint64_t)Ehdr->e_shnum * sizeof(Elf32_Shdr) > img->map_len)
+        return NULL;
+    const Elf32_Shdr *Shdr = (const Elf32_Shdr *)(file_buffer + Ehdr->e_shoff);
+    for(int i=0;i<Ehdr->e_shnum;i++){
+        if(Shdr[i].sh_type != SHT_SYMTAB || Shdr[i].sh_link >= Ehdr->e_shnum)
+            continue;
+        const Elf32_Shdr *strtab = &Shdr[Shdr[i].sh_link];
+        if((uint64_t)Shdr[i].sh_offset + Shdr[i].sh_size > img->map_len
+                || (uint64_t)strtab->sh_offset + strtab->sh_size > img->map_len)
+            continue;
+
+        const Elf32_Sym *Sym = (const Elf32_Sym *)(file_buffer + Shdr[i].sh_offset);
+        int nsyms = Shdr[i].sh_size / sizeof(Elf32_Sym);
+        for(int j=0;j<nsyms;j++){
+            if(ELF32_ST_TYPE(Sym[j].st_info) != STT_FUNC || Sym[j].st_value > 0xffff
+                    || Sym[j].st_name >= strtab->sh_size)
+                continue;
+            const char *name = (const char *)file_buffer + strtab->sh_offset + Sym[j].st_name;
+            // The name must end within the string table.
+            if(memchr(name, '\0', strtab->sh_size - Sym[j].st_name) == NULL)
+                continue;
+            syms = realloc(syms, sizeof(struct elf_symbol) * (*n + 1));
+            syms[*n].addr = Sym[j].st_value;
+            syms[*n].name = name;
+            (*n)++;
         }
     }
+    if(syms != NULL)
+        qsort(syms, *n, sizeof(struct elf_symbol), symbol_cmp);
+    return syms;
+}
 
-    // Since RV16K specification says the initial value of PC is 0, e_entry should be 0.
-    c->pc = Ehdr->e_entry;
-    assert(c->pc == 0 && "The entry point of the program should be address 0.");
+void elf_image_close(struct elf_image *img){
+    munmap(img->map, img->map_len);
+    free(img);
+}
+
+void elf_parse(struct cpu *c, char* file_name){
+    struct elf_image *img = elf_image_open(file_name);
+    if(img == NULL || elf_image_load(img, c) != 0)
+        exit(1);
+    elf_image_close(img);
 }
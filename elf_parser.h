@@ -1,6 +1,49 @@
 #ifndef ELF_PARSER_H
 #define ELF_PARSER_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+struct cpu;
+
+#define ELF_MAX_SEGMENTS 16
+
+// A PT_LOAD segment, placed in ROM for addresses below 0x10000 and in RAM
+// for 0x10000-0x1ffff. Bytes past filesz up to memsz (.bss) are zeroed.
+struct elf_segment {
+    int to_ram;
+    uint16_t addr;
+    uint32_t filesz;
+    uint32_t memsz;
+    const uint8_t *data;    // points into the mapped file
+};
+
+// An ELF file mapped and parsed once, to be loaded into any number of
+// struct cpu instances with elf_image_load(). Both print what is wrong
+// with the file to stderr and fail without exiting: elf_image_open()
+// returns NULL, and elf_image_load() -1 with the cpu left unchanged.
+struct elf_image {
+    void *map;
+    size_t map_len;
+    uint16_t entry;
+    int nsegments;
+    struct elf_segment segments[ELF_MAX_SEGMENTS];
+};
+
+// A function symbol in ROM, whose name points into the mapped file.
+struct elf_symbol {
+    uint16_t addr;
+    const char *name;
+};
+
+struct elf_image *elf_image_open(const char *file_name);
+int elf_image_load(const struct elf_image *img, struct cpu *c);
+void elf_image_close(struct elf_image *img);
+// The function symbols of img sorted by address, in an array to free(),
+// or NULL if there are none (e.g. the file is stripped).
+struct elf_symbol *elf_image_functions(const struct elf_image *img, int *n);
+
+// Open, load into c and close, or exit on failure.
 void elf_parse(struct cpu *c, char* file_name);
 
 #endif
@@ -0,0 +1,403 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "debug.h"
+#include "gdbstub.h"
+
+#define GDB_PACKET_SIZE 4096
+#define GDB_NREGS 18
+// Cycles run between checks for Ctrl-C while continuing.
+#define GDB_CHUNK (1 << 20)
+#define GDB_RAM_BASE 0x10000
+
+#define SIGINT_NUM 2
+#define SIGTRAP_NUM 5
+
+struct gdb {
+    struct cpu *c;
+    int in, out;
+    long left;          // cycles left to run
+    int stopped;        // nonzero once the debugger detached or killed us
+    uint8_t rx[256];    // input read ahead
+    int rx_len, rx_pos;
+    char pkt[GDB_PACKET_SIZE + 1];
+    char reply[GDB_PACKET_SIZE + 1];
+};
+
+static const char hex[] = "0123456789abcdef";
+
+int gdb_accept(int port){
+    struct sockaddr_in addr = {0};
+    int one = 1, fd, conn;
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0
+            || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0
+            || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || listen(fd, 1) != 0){
+        fprintf(stderr, "Failed to listen on port :%d\n", port);
+        exit(1);
+    }
+    fprintf(stderr, "Waiting for gdb on port %d\n", port);
+    if((conn = accept(fd, NULL, NULL)) < 0){
+        fprintf(stderr, "Failed to accept on port :%d\n", port);
+        exit(1);
+    }
+    close(fd);
+    setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return conn;
+}
+
+// The next byte from the debugger, or -1 once it is gone.
+static int gdb_getc(struct gdb *g){
+    if(g->rx_pos == g->rx_len){
+        ssize_t n;
+        do n = read(g->in, g->rx, sizeof(g->rx)); while(n < 0 && errno == EINTR);
+        if(n <= 0)
+            return -1;
+        g->rx_len = n;
+        g->rx_pos = 0;
+    }
+    return g->rx[g->rx_pos++];
+}
+
+static void gdb_write(struct gdb *g, const char *buf, size_t len){
+    while(len > 0){
+        ssize_t n = write(g->out, buf, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0){
+            g->stopped = 1;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// Whether the debugger sent Ctrl-C, without waiting for it to.
+static int gdb_interrupted(struct gdb *g){
+    struct pollfd p = {.fd = g->in, .events = POLLIN};
+    if(g->rx_pos == g->rx_len && poll(&p, 1, 0) <= 0)
+        return 0;
+    int ch = gdb_getc(g);
+    if(ch == 0x03)
+        return 1;
+    if(ch >= 0)
+        g->rx_pos--;    // left for gdb_recv()
+    return 0;
+}
+
+static int hex_val(int ch){
+    if(ch >= '0' && ch <= '9') return ch - '0';
+    if(ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if(ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+// Read the next packet into g->pkt, acknowledging it. Returns 0 once the
+// debugger is gone.
+static int gdb_recv(struct gdb *g){
+    for(;;){
+        int ch, len = 0;
+        while((ch = gdb_getc(g)) != '$')
+            if(ch < 0)
+                return 0;
+
+        uint8_t sum = 0;
+        while((ch = gdb_getc(g)) != '#'){
+            if(ch < 0)
+                return 0;
+            if(len < GDB_PACKET_SIZE)
+                g->pkt[len++] = ch;
+            sum += ch;
+        }
+        g->pkt[len] = '\0';
+        int hi = hex_val(gdb_getc(g)), lo = hex_val(gdb_getc(g));
+        if(hi >= 0 && lo >= 0 && (hi << 4 | lo) == sum){
+            gdb_write(g, "+", 1);
+            return 1;
+        }
+        gdb_write(g, "-", 1);
+    }
+}
+
+// Send g->reply until the debugger acknowledges it.
+static void gdb_send(struct gdb *g){
+    char buf[GDB_PACKET_SIZE + 4];
+    size_t len = strlen(g->reply);
+    uint8_t sum = 0;
+
+    buf[0] = '$';
+    for(size_t i=0;i<len;i++){
+        buf[i+1] = g->reply[i];
+        sum += g->reply[i];
+    }
+    buf[len+1] = '#';
+    buf[len+2] = hex[sum >> 4];
+    buf[len+3] = hex[sum & 15];
+    for(;;){
+        gdb_write(g, buf, len + 4);
+        int ch = gdb_getc(g);
+        if(ch == '-' && !g->stopped)
+            continue;
+        if(ch >= 0 && ch != '+')
+            g->rx_pos--;    // the next packet, if acks are not sent
+        return;
+    }
+}
+
+static void put_hex16(char *p, uint16_t val){
+    p[0] = hex[(val >> 4) & 15];
+    p[1] = hex[val & 15];
+    p[2] = hex[(val >> 12) & 15];
+    p[3] = hex[(val >> 8) & 15];
+}
+
+// Whether the first n characters of p are all hex digits.
+static int is_hex(const char *p, size_t n){
+    for(size_t i=0;i<n;i++)
+        if(hex_val(p[i]) < 0)
+            return 0;
+    return 1;
+}
+
+// A little-endian 16-bit value from 4 hex digits, or -1.
+static int get_hex16(const char *p){
+    int d[4];
+    for(int i=0;i<4;i++)
+        if((d[i] = hex_val(p[i])) < 0)
+            return -1;
+    return d[0] << 4 | d[1] | d[2] << 12 | d[3] << 8;
+}
+
+static uint16_t reg_get(struct cpu *c, int n){
+    if(n < 16)
+        return c->reg[n];
+    if(n == 16)
+        return c->pc;
+    flags_eval(c);
+    return c->flag_sign << 3 | c->flag_zero << 2 | c->flag_carry << 1 | c->flag_overflow;
+}
+
+static void reg_set(struct cpu *c, int n, uint16_t val){
+    if(n < 16){
+        c->reg[n] = val;
+    }else if(n == 16){
+        c->pc = val;
+        c->halt = HALT_NONE;    // not resuming from a breakpoint any more
+    }else{
+        c->flag_sign = (val >> 3) & 1;
+        c->flag_zero = (val >> 2) & 1;
+        c->flag_carry = (val >> 1) & 1;
+        c->flag_overflow = val & 1;
+        c->flags_kind = FLAGS_NONE;
+    }
+}
+
+// The byte at a debugger address, which wraps around ROM or RAM.
+static uint8_t *mem_at(struct cpu *c, uint32_t addr){
+    if(addr >= GDB_RAM_BASE)
+        return &c->data_ram[addr & c->ram_mask];
+    return &c->inst_rom[addr & c->rom_mask];
+}
+
+static void stop_reply(struct gdb *g, int sig){
+    struct cpu *c = g->c;
+    if(c->halt == HALT_WATCH)
+        sprintf(g->reply, "T%02xwatch:%x;", sig, GDB_RAM_BASE + c->dbg->hit_addr);
+    else
+        sprintf(g->reply, "S%02x", sig);
+}
+
+// Run one instruction, or until something stops the CPU, Ctrl-C or the
+// end of the cycles. Stays on the fast path unless a watchpoint or trace
+// sink needs the other.
+static void gdb_resume(struct gdb *g, int step){
+    struct cpu *c = g->c;
+    int (*run)(struct cpu *, int) = cpu_traced(c) ? cpu_run_trace : cpu_run;
+    int sig = SIGTRAP_NUM;
+
+    while(g->left > 0){
+        int n = step ? 1 : g->left < GDB_CHUNK ? g->left : GDB_CHUNK;
+        int done = run(c, n);
+        g->left -= done;
+        if(step || done < n || c->halt != HALT_NONE)
+            break;
+        if(c->trace_ref != NULL && c->trace_ref->diverged)
+            break;
+        if(gdb_interrupted(g)){
+            sig = SIGINT_NUM;
+            break;
+        }
+    }
+    stop_reply(g, sig);
+}
+
+// Z and z packets: Z0/Z1 on ROM addresses, Z2 on RAM addresses.
+static void gdb_point(struct gdb *g, const char *p, int on){
+    struct cpu *c = g->c;
+    unsigned type, addr, len;
+    if(sscanf(p, "%x,%x,%x", &type, &addr, &len) != 3 || len > GDB_RAM_BASE){
+        strcpy(g->reply, "E01");
+        return;
+    }
+    if(type <= 1 && addr < GDB_RAM_BASE){
+        debug_set_break(c, addr, on);
+    }else if(type == 2 && addr >= GDB_RAM_BASE && addr <= 2 * GDB_RAM_BASE - len){
+        for(unsigned i=0;i<len;i++)
+            debug_set_watch(c, addr - GDB_RAM_BASE + i, on);
+    }else{
+        g->reply[0] = '\0';     // not supported
+        return;
+    }
+    strcpy(g->reply, "OK");
+}
+
+static void gdb_handle(struct gdb *g){
+    struct cpu *c = g->c;
+    char *p = g->pkt, *r = g->reply;
+    unsigned addr, len, n;
+
+    r[0] = '\0';
+    switch(p[0]){
+        case '?':
+            stop_reply(g, SIGTRAP_NUM);
+            break;
+
+        case 'g':
+            for(int i=0;i<GDB_NREGS;i++)
+                put_hex16(r + 4*i, reg_get(c, i));
+            r[4*GDB_NREGS] = '\0';
+            break;
+
+        case 'G':
+            if(strlen(p + 1) < 4*GDB_NREGS || !is_hex(p + 1, 4*GDB_NREGS)){
+                strcpy(r, "E01");
+                break;
+            }
+            for(int i=0;i<GDB_NREGS;i++)
+                reg_set(c, i, get_hex16(p + 1 + 4*i));
+            strcpy(r, "OK");
+            break;
+
+        case 'p':
+            if(sscanf(p + 1, "%x", &n) != 1 || n >= GDB_NREGS){
+                strcpy(r, "E01");
+                break;
+            }
+            put_hex16(r, reg_get(c, n));
+            r[4] = '\0';
+            break;
+
+        case 'P': {
+            char *val = strchr(p, '=');
+            if(sscanf(p + 1, "%x", &n) != 1 || n >= GDB_NREGS || val == NULL
+                    || strlen(val + 1) < 4 || get_hex16(val + 1) < 0){
+                strcpy(r, "E01");
+                break;
+            }
+            reg_set(c, n, get_hex16(val + 1));
+            strcpy(r, "OK");
+            break;
+        }
+
+        case 'm':
+            if(sscanf(p + 1, "%x,%x", &addr, &len) != 2 || len > GDB_PACKET_SIZE / 2){
+                strcpy(r, "E01");
+                break;
+            }
+            for(unsigned i=0;i<len;i++){
+                uint8_t b = *mem_at(c, addr + i);
+                r[2*i] = hex[b >> 4];
+                r[2*i+1] = hex[b & 15];
+            }
+            r[2*len] = '\0';
+            break;
+
+        case 'M': {
+            char *data = strchr(p, ':');
+            if(sscanf(p + 1, "%x,%x", &addr, &len) != 2 || len > GDB_PACKET_SIZE / 2 || data == NULL
+                    || strlen(data + 1) < 2*len || !is_hex(data + 1, 2*len)){
+                strcpy(r, "E01");
+                break;
+            }
+            int rom = 0;
+            for(unsigned i=0;i<len;i++){
+                *mem_at(c, addr + i) = hex_val(data[1+2*i]) << 4 | hex_val(data[2+2*i]);
+                if(addr + i < GDB_RAM_BASE)
+                    rom = 1;
+                else
+                    ram_touch(c, addr + i, 1);
+            }
+            if(rom){
+                c->rom_dirty = 1;
+                icache_invalidate(c);
+            }
+            strcpy(r, "OK");
+            break;
+        }
+
+        case 'c':
+        case 's':
+            if(sscanf(p + 1, "%x", &addr) == 1)
+                reg_set(c, 16, addr);
+            gdb_resume(g, p[0] == 's');
+            break;
+
+        case 'Z':
+        case 'z':
+            gdb_point(g, p + 1, p[0] == 'Z');
+            break;
+
+        case 'H':
+            strcpy(r, "OK");
+            break;
+
+        case 'q':
+            if(strncmp(p, "qSupported", 10) == 0)
+                sprintf(r, "PacketSize=%x", GDB_PACKET_SIZE);
+            else if(strcmp(p, "qAttached") == 0)
+                strcpy(r, "1");
+            break;
+
+        case 'D':
+            strcpy(r, "OK");
+            g->stopped = 1;
+            break;
+
+        case 'k':
+            g->stopped = 1;
+            return;     // no reply
+    }
+    gdb_send(g);
+}
+
+long gdb_serve(struct cpu *c, int fd_in, int fd_out, long ncycles){
+    struct gdb *g = calloc(1, sizeof(struct gdb));
+    g->c = c;
+    g->in = fd_in;
+    g->out = fd_out;
+    g->left = ncycles;
+
+    while(!g->stopped && gdb_recv(g))
+        gdb_handle(g);
+
+    long cycles = ncycles - g->left;
+    free(g);
+    return cycles;
+}
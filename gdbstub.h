@@ -0,0 +1,18 @@
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+
+#include "cpu.h"
+
+// A GDB remote serial protocol stub. The registers (g packet) are x0-x15,
+// the PC and the flags as S<<3|Z<<2|C<<1|V, each 16-bit little-endian.
+// Memory is addressed as in ELF files: ROM at 0x00000 and RAM at 0x10000.
+// Supports reading and writing registers and memory, s, c, Ctrl-C,
+// Z0/Z1 breakpoints and Z2 write watchpoints.
+
+// Wait for a debugger to connect to 127.0.0.1:port, and return the socket.
+int gdb_accept(int port);
+// Serve requests until the debugger detaches or kills the program, running
+// at most ncycles in total. Returns the number of cycles run.
+long gdb_serve(struct cpu *c, int fd_in, int fd_out, long ncycles);
+
+#endif
@@ -3,677 +3,731 @@
 #include <stdint.h>
 
 #include "cpu.h"
-#include "bitpat.h"
 #include "inst.h"
-#include "log.h"
-
-void pc_update(struct cpu *c, uint16_t offset){
+#include "decode.h"
+#include "trace.h"
+#include "profile.h"
+#include "debug.h"
+#include "memdelta.h"
+#ifndef INST_TRACE
+#include "block.h"
+#include "jit.h"
+#endif
+
+// This file is compiled twice: once as is, and once with INST_TRACE
+// defined to get the variant of every handler and of the execution loop
+// that fills c->rec for the trace (see the Makefile). Only INST_SYM()
+// names are exported.
+#ifdef INST_TRACE
+#define INST_SYM(name) name##_trace
+#define TRACE(stmt) stmt
+#else
+#define INST_SYM(name) name
+#define TRACE(stmt)
+#endif
+
+// Handlers that update the flags are defined with DEF_INST(inst_xxx) and
+// test flags to do so. The fast build also gets inst_xxx_nf, which leaves
+// the flags alone, for the block cache to use where another instruction
+// of the block overwrites them before they are read (see block.c).
+#ifdef INST_TRACE
+#define DEF_INST_NF(name)
+#else
+#define DEF_INST_NF(name) \
+    static void name##_nf(struct cpu *c, const struct inst_op *op){ name##_body(c, op, 0); }
+#endif
+#define DEF_INST(name) \
+    static inline __attribute__((always_inline)) void name##_body(struct cpu *c, const struct inst_op *op, const int flags); \
+    static void name(struct cpu *c, const struct inst_op *op){ name##_body(c, op, 1); } \
+    DEF_INST_NF(name) \
+    static inline __attribute__((always_inline)) void name##_body(struct cpu *c, const struct inst_op *op, const int flags)
+
+static inline void pc_update(struct cpu *c, uint16_t offset){
     c->pc += offset;
-    log_printf("PC <= 0x%04X ", c->pc);
 }
 
-void pc_write(struct cpu *c, uint16_t addr){
+static inline void pc_write(struct cpu *c, uint16_t addr){
     c->pc = addr;
-    log_printf("PC <= 0x%04X ", c->pc);
 }
 
-uint16_t pc_read(struct cpu *c){
-    return c->pc;
+// Called by the jumps whose target is the only state they can change: once
+// one of them jumps to itself, running it again changes nothing.
+static inline void halt_if_pc(struct cpu *c, uint16_t pc){
+    if(c->pc == pc)
+        c->halt = HALT_LOOP;
 }
 
-void reg_write(struct cpu *c, uint8_t reg_idx, uint16_t data){
+static inline void reg_write(struct cpu *c, uint8_t reg_idx, uint16_t data){
     c->reg[reg_idx] = data;
-    log_printf("Reg x%d <= 0x%04X ", reg_idx, data);
+    TRACE(trace_reg(&c->rec, reg_idx, data));
 }
 
-uint16_t reg_read(struct cpu *c, uint8_t reg_idx){
-    return c->reg[reg_idx];
+// Addresses wrap around the RAM size (see cpu.h).
+static inline void mem_write_b(struct cpu *c, uint16_t addr, uint8_t data){
+    TRACE(trace_mem(&c->rec, TRACE_MEM_B, addr, data));
+
+    c->data_ram[addr & c->ram_mask] = data;
+    c->ram_dirty[(addr & c->ram_mask) >> RAM_PAGE_BITS] = 1;
 }
 
-void mem_write_b(struct cpu *c, uint16_t addr, uint8_t data){
-    log_printf("DataRam[0x%04X] <= 0x%04X ", addr, data);
+static inline void mem_write_w(struct cpu *c, uint16_t addr, uint16_t data){
+    TRACE(trace_mem(&c->rec, TRACE_MEM_W, addr, data));
 
-    assert(addr < DATA_RAM_SIZE && "RAM write to invalid address!");
+    c->data_ram[addr & c->ram_mask] = data&0xFF;
+    c->data_ram[(addr+1) & c->ram_mask] = data>>8;
+    c->ram_dirty[(addr & c->ram_mask) >> RAM_PAGE_BITS] = 1;
+    c->ram_dirty[((addr+1) & c->ram_mask) >> RAM_PAGE_BITS] = 1;
+}
 
-    c->data_ram[addr] = data;
+static inline uint8_t mem_read_b(struct cpu *c, uint16_t addr){
+    return c->data_ram[addr & c->ram_mask];
 }
 
-void mem_write_w(struct cpu *c, uint16_t addr, uint16_t data){
-    log_printf("DataRam[0x%04X] <= 0x%04X ", addr, data&0xFF);
-    log_printf("DataRam[0x%04X] <= 0x%04X ", addr+1, data>>8);
+static inline uint16_t mem_read_w(struct cpu *c, uint16_t addr){
+    return c->data_ram[addr & c->ram_mask] + (c->data_ram[(addr+1) & c->ram_mask]<<8);
+}
 
-    assert(addr < DATA_RAM_SIZE - 1 && "RAM write to invalid address!");
-    c->data_ram[addr] = data&0xFF;
-    c->data_ram[addr+1] = data>>8;
+static inline uint16_t get_bits(uint16_t t, int s, int e){
+    return (t>>s)&((2u<<(e-s))-1);
 }
 
-uint8_t mem_read_b(struct cpu *c, uint16_t addr){
-    assert(addr < DATA_RAM_SIZE && "RAM read from invalid address!");
-    return c->data_ram[addr];
+static inline uint16_t sign_ext(uint16_t t, uint8_t sign_bit){
+    return (t>>sign_bit)&1 ? t|(0xFFFF<<sign_bit) : t;
 }
 
-uint16_t mem_read_w(struct cpu *c, uint16_t addr){
-    assert(addr < DATA_RAM_SIZE - 1 && "RAM read from invalid address!");
-    return c->data_ram[addr] + (c->data_ram[addr+1]<<8);
+// The trace build logs the flags every cycle, so it computes them right
+// away. The fast build only records where they come from, and leaves them
+// to flags_eval() in the few places that read them, mostly the branches.
+static inline void flags_set(struct cpu *c, uint8_t kind, uint16_t s, uint16_t d, uint16_t res){
+#ifdef INST_TRACE
+    flags_compute(c, kind, s, d, res);
+#else
+    c->flags_kind = kind;
+    c->flags_s = s;
+    c->flags_d = d;
+    c->flags_res = res;
+#endif
 }
 
-uint16_t rom_read_w(struct cpu *c){
-    assert(c->pc < INST_ROM_SIZE - 1 && "ROM read from invalid address!");
-    return c->inst_rom[c->pc] + (c->inst_rom[c->pc+1]<<8);
+// flag_zero without computing the others.
+static inline uint8_t flags_zero(struct cpu *c){
+    return c->flags_kind == FLAGS_NONE ? c->flag_zero : flag_zero(c->flags_res);
 }
 
-uint16_t get_bits(uint16_t t, int s, int e){
-    int bit_len = e-s;
-    uint32_t bit_mask = 1;
-    for(int i=0;i<bit_len;i++){
-        bit_mask = (bit_mask<<1)+1;
-    }
-    return (t>>s)&bit_mask;
+// Field decoders, one per encoding format. They run once per ROM address
+// (see inst_predecode()), so the handlers below only read struct inst_op.
+static void dec_none(struct cpu *c, uint16_t addr, uint16_t inst, struct inst_op *op){
 }
 
-uint16_t sign_ext(uint16_t t, uint8_t sign_bit){
-    uint16_t sign_v = 0;
-    uint16_t sign = get_bits(t, sign_bit, sign_bit);
-    for(int i=sign_bit;i<16;i++){
-        sign_v |= (sign<<i);
-    }
-    return t|sign_v;
+static void dec_rr(struct cpu *c, uint16_t addr, uint16_t inst, struct inst_op *op){
+    op->rs = get_bits(inst, 4, 7);
+    op->rd = get_bits(inst, 0, 3);
 }
 
-uint8_t flag_zero(uint16_t res){
-    return res == 0;
+static void dec_rr_imm16(struct cpu *c, uint16_t addr, uint16_t inst, struct inst_op *op){
+    op->rs = get_bits(inst, 4, 7);
+    op->rd = get_bits(inst, 0, 3);
+    op->imm = rom_read_w(c, addr+2);
+    op->len = 4;
 }
 
-uint8_t flag_sign(uint16_t res){
-    return get_bits(res, 15, 15);
+static void dec_lwsp(struct cpu *c, uint16_t addr, uint16_t inst, struct inst_op *op){
+    op->rd = get_bits(inst, 0, 3);
+    op->imm = get_bits(inst, 4, 11)<<1;
 }
 
-uint8_t flag_overflow(uint16_t s1, uint16_t s2, uint16_t res){
-    uint8_t s1_sign = get_bits(s1, 15, 15);
-    uint8_t s2_sign = get_bits(s2, 15, 15);
-    uint8_t res_sign = get_bits(res, 15, 15);
-    return ((s1_sign^s2_sign) == 0)&((s2_sign^res_sign) == 1);
+static void dec_swsp(struct cpu *c, uint16_t addr, uint16_t inst, struct inst_op *op){
+    op->rs = get_bits(inst, 4, 7);
+    op->rd = get_bits(inst, 0, 3);
+    op->imm = (get_bits(inst, 8, 11)<<5)+(op->rd<<1);
 }
 
-void inst_lw(struct cpu *c, uint16_t inst){
-    log_printf("Inst:LW\t");
+static void dec_imm4(struct cpu *c, uint16_t addr, uint16_t inst, struct inst_op *op){
+    op->rd = get_bits(inst, 0, 3);
+    op->imm = sign_ext(get_bits(inst, 4, 7), 3);
+}
 
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
+static void dec_branch(struct cpu *c, uint16_t addr, uint16_t inst, struct inst_op *op){
+    op->imm = sign_ext(get_bits(inst, 0, 6)<<1, 7);
+}
+
+DEF_INST(inst_lw){
     pc_update(c, 2);
 
-    uint16_t imm = rom_read_w(c);
-    uint16_t s_data = reg_read(c, rs);
-    uint16_t res = imm+s_data;
-    if(res > 0xFFFF){
-        c->flag_carry = 0;
-    }else{
-        c->flag_carry = 1;
-    }
-    c->flag_sign = flag_sign(res&0xFFFF);
-    c->flag_overflow = flag_overflow(imm, s_data, res&0xFFFF);
-    c->flag_zero = flag_zero(res&0xFFFF);
-    reg_write(c, rd, mem_read_w(c, res&0xFFFF));
+    uint16_t s_data = reg_read(c, op->rs);
+    uint16_t res = op->imm+s_data;
+    if(flags)
+        flags_set(c, FLAGS_ADDR, op->imm, s_data, res);
+    reg_write(c, op->rd, mem_read_w(c, res&0xFFFF));
     pc_update(c, 2);
 }
 
-void inst_lwsp(struct cpu *c, uint16_t inst){
-    log_printf("Inst:LWSP\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
-
-    uint16_t imm = (get_bits(inst, 4, 11)<<1);
+DEF_INST(inst_lwsp){
     uint16_t d_data = reg_read(c, 1);
-    uint16_t res = imm+d_data;
-    if(res > 0xFFFF){
-        c->flag_carry = 0;
-    }else{
-        c->flag_carry = 1;
-    }
-    c->flag_sign = flag_sign(res&0xFFFF);
-    c->flag_overflow = flag_overflow(imm, d_data, res&0xFFFF);
-    c->flag_zero = flag_zero(res&0xFFFF);
-    reg_write(c, rd, mem_read_w(c, res&0xFFFF));
+    uint16_t res = op->imm+d_data;
+    if(flags)
+        flags_set(c, FLAGS_ADDR, op->imm, d_data, res);
+    reg_write(c, op->rd, mem_read_w(c, res&0xFFFF));
     pc_update(c, 2);
 }
 
-void inst_lbu(struct cpu *c, uint16_t inst){
-    log_printf("Inst:LBU\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
+DEF_INST(inst_lbu){
     pc_update(c, 2);
 
-    uint16_t imm = rom_read_w(c);
-    uint16_t s_data = reg_read(c, rs);
-    uint16_t res = imm+s_data;
-    if(res > 0xFFFF){
-        c->flag_carry = 0;
-    }else{
-        c->flag_carry = 1;
-    }
-    c->flag_sign = flag_sign(res&0xFFFF);
-    c->flag_overflow = flag_overflow(imm, s_data, res&0xFFFF);
-    c->flag_zero = flag_zero(res&0xFFFF);
-    reg_write(c, rd, mem_read_b(c, res&0xFFFF));
+    uint16_t s_data = reg_read(c, op->rs);
+    uint16_t res = op->imm+s_data;
+    if(flags)
+        flags_set(c, FLAGS_ADDR, op->imm, s_data, res);
+    reg_write(c, op->rd, mem_read_b(c, res&0xFFFF));
     pc_update(c, 2);
 }
 
-void inst_lb(struct cpu *c, uint16_t inst){
-    log_printf("Inst:LB\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
+DEF_INST(inst_lb){
     pc_update(c, 2);
 
-    uint16_t imm = rom_read_w(c);
-    uint16_t s_data = reg_read(c, rs);
-    uint16_t res = imm+s_data;
-    if(res > 0xFFFF){
-        c->flag_carry = 0;
-    }else{
-        c->flag_carry = 1;
-    }
-    c->flag_sign = flag_sign(res&0xFFFF);
-    c->flag_overflow = flag_overflow(imm, s_data, res&0xFFFF);
-    c->flag_zero = flag_zero(res&0xFFFF);
-    reg_write(c, rd, sign_ext(mem_read_b(c, res&0xFFFF), 7));
+    uint16_t s_data = reg_read(c, op->rs);
+    uint16_t res = op->imm+s_data;
+    if(flags)
+        flags_set(c, FLAGS_ADDR, op->imm, s_data, res);
+    reg_write(c, op->rd, sign_ext(mem_read_b(c, res&0xFFFF), 7));
     pc_update(c, 2);
 }
 
-void inst_sw(struct cpu *c, uint16_t inst){
-    log_printf("Inst:SW\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
+DEF_INST(inst_sw){
     pc_update(c, 2);
 
-    uint16_t imm = rom_read_w(c);
-    uint16_t d_data = reg_read(c, rd);
-    uint16_t res = imm+d_data;
-    if(res > 0xFFFF){
-        c->flag_carry = 0;
-    }else{
-        c->flag_carry = 1;
-    }
-    c->flag_sign = flag_sign(res&0xFFFF);
-    c->flag_overflow = flag_overflow(imm, d_data, res&0xFFFF);
-    c->flag_zero = flag_zero(res&0xFFFF);
-    mem_write_w(c, res&0xFFFF, reg_read(c, rs));
+    uint16_t d_data = reg_read(c, op->rd);
+    uint16_t res = op->imm+d_data;
+    if(flags)
+        flags_set(c, FLAGS_ADDR, op->imm, d_data, res);
+    mem_write_w(c, res&0xFFFF, reg_read(c, op->rs));
     pc_update(c, 2);
 }
 
-void inst_swsp(struct cpu *c, uint16_t inst){
-    log_printf("Inst:SWSP\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
-
-    uint16_t imm = (get_bits(inst, 8, 11)<<5)+(rd<<1);
+DEF_INST(inst_swsp){
     uint16_t s_data = reg_read(c, 1);
-    uint16_t res = s_data+imm;
-    if(res > 0xFFFF){
-        c->flag_carry = 0;
-    }else{
-        c->flag_carry = 1;
-    }
-    c->flag_sign = flag_sign(res&0xFFFF);
-    c->flag_overflow = flag_overflow(imm, s_data, res&0xFFFF);
-    c->flag_zero = flag_zero(res&0xFFFF);
-    mem_write_w(c, res&0xFFFF, reg_read(c, rs));
+    uint16_t res = s_data+op->imm;
+    if(flags)
+        flags_set(c, FLAGS_ADDR, op->imm, s_data, res);
+    mem_write_w(c, res&0xFFFF, reg_read(c, op->rs));
     pc_update(c, 2);
 }
 
-void inst_sb(struct cpu *c, uint16_t inst){
-    log_printf("Inst:SB\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
+DEF_INST(inst_sb){
     pc_update(c, 2);
 
-    uint16_t imm = rom_read_w(c);
-    uint16_t d_data = reg_read(c, rd);
-    uint16_t res = imm+d_data;
-    if(res > 0xFFFF){
-        c->flag_carry = 0;
-    }else{
-        c->flag_carry = 1;
-    }
-    c->flag_sign = flag_sign(res&0xFFFF);
-    c->flag_overflow = flag_overflow(imm, d_data, res&0xFFFF);
-    c->flag_zero = flag_zero(res&0xFFFF);
-    mem_write_b(c, res&0xFFFF, reg_read(c, rs)&0xFF);
+    uint16_t d_data = reg_read(c, op->rd);
+    uint16_t res = op->imm+d_data;
+    if(flags)
+        flags_set(c, FLAGS_ADDR, op->imm, d_data, res);
+    mem_write_b(c, res&0xFFFF, reg_read(c, op->rs)&0xFF);
     pc_update(c, 2);
 }
 
-void inst_mov(struct cpu *c, uint16_t inst){
-    log_printf("Inst:MOV\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
-
-    uint16_t s_data = reg_read(c, rs);
-    reg_write(c, rd, s_data);
-    c->flag_carry = 0;
-    c->flag_sign = flag_sign(s_data&0xFFFF);
-    c->flag_overflow = 0;
-    c->flag_zero = flag_zero(s_data&0xFFFF);
+DEF_INST(inst_mov){
+    uint16_t s_data = reg_read(c, op->rs);
+    reg_write(c, op->rd, s_data);
+    if(flags)
+        flags_set(c, FLAGS_MOV, 0, 0, s_data);
     pc_update(c, 2);
 }
 
-void inst_add(struct cpu *c, uint16_t inst){
-    log_printf("Inst:ADD\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
-
-    uint16_t s_data = reg_read(c, rs);
-    uint16_t d_data = reg_read(c, rd);
+DEF_INST(inst_add){
+    uint16_t s_data = reg_read(c, op->rs);
+    uint16_t d_data = reg_read(c, op->rd);
     uint32_t res = s_data+d_data;
-    if(res > 0xFFFF){
-        c->flag_carry = 0;
-    }else{
-        c->flag_carry = 1;
-    }
-    c->flag_sign = flag_sign(res&0xFFFF);
-    c->flag_overflow = flag_overflow(s_data, d_data, res&0xFFFF);
-    c->flag_zero = flag_zero(res&0xFFFF);
-    reg_write(c, rd, res&0xFFFF);
+    if(flags)
+        flags_set(c, FLAGS_ADD, s_data, d_data, res&0xFFFF);
+    reg_write(c, op->rd, res&0xFFFF);
     pc_update(c, 2);
 }
 
-void inst_sub(struct cpu *c, uint16_t inst){
-    log_printf("Inst:SUB\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
-
-    uint16_t s_data = (~reg_read(c, rs))+1;
-    uint16_t d_data = reg_read(c, rd);
+DEF_INST(inst_sub){
+    uint16_t s_data = (~reg_read(c, op->rs))+1;
+    uint16_t d_data = reg_read(c, op->rd);
     uint32_t res = s_data+d_data;
-    if(res > 0xFFFF || s_data == 0){
-        c->flag_carry = 0;
-    }else{
-        c->flag_carry = 1;
-    }
-    c->flag_sign = flag_sign(res&0xFFFF);
-    c->flag_overflow = flag_overflow(s_data, d_data, res&0xFFFF);
-    c->flag_zero = flag_zero(res&0xFFFF);
-    reg_write(c, rd, res&0xFFFF);
+    if(flags)
+        flags_set(c, FLAGS_SUB, s_data, d_data, res&0xFFFF);
+    reg_write(c, op->rd, res&0xFFFF);
     pc_update(c, 2);
 }
 
-void inst_and(struct cpu *c, uint16_t inst){
-    log_printf("Inst:AND\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
-
-    uint16_t s_data = reg_read(c, rs);
-    uint16_t d_data = reg_read(c, rd);
+DEF_INST(inst_and){
+    uint16_t s_data = reg_read(c, op->rs);
+    uint16_t d_data = reg_read(c, op->rd);
     uint16_t res_w = s_data&d_data;
-    reg_write(c, rd, res_w);
-    c->flag_carry = 0;
-    c->flag_sign = flag_sign(res_w);
-    c->flag_overflow = flag_overflow(s_data, d_data, res_w);
-    c->flag_zero = flag_zero(res_w);
+    reg_write(c, op->rd, res_w);
+    if(flags)
+        flags_set(c, FLAGS_LOGIC, s_data, d_data, res_w);
     pc_update(c, 2);
 }
 
-void inst_or(struct cpu *c, uint16_t inst){
-    log_printf("Inst:OR\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
-
-    uint16_t s_data = reg_read(c, rs);
-    uint16_t d_data = reg_read(c, rd);
+DEF_INST(inst_or){
+    uint16_t s_data = reg_read(c, op->rs);
+    uint16_t d_data = reg_read(c, op->rd);
     uint16_t res_w = s_data|d_data;
-    reg_write(c, rd, res_w);
-    c->flag_carry = 0;
-    c->flag_sign = flag_sign(res_w);
-    c->flag_overflow = flag_overflow(s_data, d_data, res_w);
-    c->flag_zero = flag_zero(res_w);
+    reg_write(c, op->rd, res_w);
+    if(flags)
+        flags_set(c, FLAGS_LOGIC, s_data, d_data, res_w);
     pc_update(c, 2);
 }
 
-void inst_xor(struct cpu *c, uint16_t inst){
-    log_printf("Inst:XOR\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
-
-    uint16_t s_data = reg_read(c, rs);
-    uint16_t d_data = reg_read(c, rd);
+DEF_INST(inst_xor){
+    uint16_t s_data = reg_read(c, op->rs);
+    uint16_t d_data = reg_read(c, op->rd);
     uint16_t res_w = s_data^d_data;
-    reg_write(c, rd, res_w);
-    c->flag_carry = 0;
-    c->flag_sign = flag_sign(res_w);
-    c->flag_overflow = flag_overflow(s_data, d_data, res_w);
-    c->flag_zero = flag_zero(res_w);
+    reg_write(c, op->rd, res_w);
+    if(flags)
+        flags_set(c, FLAGS_LOGIC, s_data, d_data, res_w);
     pc_update(c, 2);
 }
 
-void inst_lsl(struct cpu *c, uint16_t inst){
-    log_printf("Inst:LSL\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
-
-    uint16_t s_data = reg_read(c, rs);
-    uint16_t d_data = reg_read(c, rd);
+DEF_INST(inst_lsl){
+    uint16_t s_data = reg_read(c, op->rs);
+    uint16_t d_data = reg_read(c, op->rd);
     uint16_t res_w = d_data << s_data;
-    reg_write(c, rd, res_w);
-    c->flag_carry = 0;
-    c->flag_sign = flag_sign(res_w);
-    c->flag_overflow = flag_overflow(s_data, d_data, res_w);
-    c->flag_zero = flag_zero(res_w);
+    reg_write(c, op->rd, res_w);
+    if(flags)
+        flags_set(c, FLAGS_LOGIC, s_data, d_data, res_w);
     pc_update(c, 2);
 }
 
-void inst_lsr(struct cpu *c, uint16_t inst){
-    log_printf("Inst:LSR\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
-
-    uint16_t s_data = reg_read(c, rs);
-    uint16_t d_data = reg_read(c, rd);
+DEF_INST(inst_lsr){
+    uint16_t s_data = reg_read(c, op->rs);
+    uint16_t d_data = reg_read(c, op->rd);
     uint16_t res_w = d_data >> s_data;
-    reg_write(c, rd, res_w);
-    c->flag_carry = 0;
-    c->flag_sign = flag_sign(res_w);
-    c->flag_overflow = flag_overflow(s_data, d_data, res_w);
-    c->flag_zero = flag_zero(res_w);
+    reg_write(c, op->rd, res_w);
+    if(flags)
+        flags_set(c, FLAGS_LOGIC, s_data, d_data, res_w);
     pc_update(c, 2);
 }
 
-void inst_asr(struct cpu *c, uint16_t inst){
-    log_printf("Inst:ASR\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
-
-    uint16_t s_data = reg_read(c, rs);
-    uint16_t d_data = reg_read(c, rd);
+DEF_INST(inst_asr){
+    uint16_t s_data = reg_read(c, op->rs);
+    uint16_t d_data = reg_read(c, op->rd);
     uint16_t res_w = ((int16_t)d_data) >> s_data;
-    reg_write(c, rd, res_w);
-    c->flag_carry = 0;
-    c->flag_sign = flag_sign(res_w);
-    c->flag_overflow = flag_overflow(s_data, d_data, res_w);
-    c->flag_zero = flag_zero(res_w);
+    reg_write(c, op->rd, res_w);
+    if(flags)
+        flags_set(c, FLAGS_LOGIC, s_data, d_data, res_w);
     pc_update(c, 2);
 }
 
-void inst_cmp(struct cpu *c, uint16_t inst){
-    log_printf("Inst:CMP\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
-
-    uint16_t s_data = (~reg_read(c, rs))+1;
-    uint16_t d_data = reg_read(c, rd);
+DEF_INST(inst_cmp){
+    uint16_t s_data = (~reg_read(c, op->rs))+1;
+    uint16_t d_data = reg_read(c, op->rd);
     uint32_t res = s_data+d_data;
-    if(res > 0xFFFF || s_data == 0){
-        c->flag_carry = 0;
-    }else{
-        c->flag_carry = 1;
-    }
-    c->flag_sign = flag_sign(res&0xFFFF);
-    c->flag_overflow = flag_overflow(s_data, d_data, res&0xFFFF);
-    c->flag_zero = flag_zero(res&0xFFFF);
+    if(flags)
+        flags_set(c, FLAGS_SUB, s_data, d_data, res&0xFFFF);
     pc_update(c, 2);
 }
 
-void inst_li(struct cpu *c, uint16_t inst){
-    log_printf("Inst:LI\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
+DEF_INST(inst_li){
     pc_update(c, 2);
 
-    uint16_t imm = rom_read_w(c);
-    c->flag_carry = 0;
-    c->flag_sign = flag_sign(imm&0xFFFF);
-    c->flag_overflow = 0;
-    c->flag_zero = flag_zero(imm&0xFFFF);
-    reg_write(c, rd, imm);
+    if(flags)
+        flags_set(c, FLAGS_MOV, 0, 0, op->imm);
+    reg_write(c, op->rd, op->imm);
     pc_update(c, 2);
 }
 
-void inst_addi(struct cpu *c, uint16_t inst){
-    log_printf("Inst:ADDI\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
-
-    uint16_t s_data = sign_ext(rs, 3);
-    uint16_t d_data = reg_read(c, rd);
+DEF_INST(inst_addi){
+    uint16_t s_data = op->imm;
+    uint16_t d_data = reg_read(c, op->rd);
     uint32_t res = s_data+d_data;
-    if(res > 0xFFFF){
-        c->flag_carry = 0;
-    }else{
-        c->flag_carry = 1;
-    }
-    c->flag_sign = flag_sign(res&0xFFFF);
-    c->flag_overflow = flag_overflow(s_data, d_data, res&0xFFFF);
-    c->flag_zero = flag_zero(res&0xFFFF);
-    reg_write(c, rd, res&0xFFFF);
+    if(flags)
+        flags_set(c, FLAGS_ADD, s_data, d_data, res&0xFFFF);
+    reg_write(c, op->rd, res&0xFFFF);
     pc_update(c, 2);
 }
 
-void inst_cmpi(struct cpu *c, uint16_t inst){
-    log_printf("Inst:CMPI\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-    uint8_t rd = get_bits(inst, 0, 3);
-
-    uint16_t s_data = (~sign_ext(rs, 3))+1;
-    uint16_t d_data = reg_read(c, rd);
+DEF_INST(inst_cmpi){
+    uint16_t s_data = (~op->imm)+1;
+    uint16_t d_data = reg_read(c, op->rd);
     uint32_t res = s_data+d_data;
-    if(res > 0xFFFF || s_data == 0){
-        c->flag_carry = 0;
-    }else{
-        c->flag_carry = 1;
-    }
-    c->flag_sign = flag_sign(res&0xFFFF);
-    c->flag_overflow = flag_overflow(s_data, d_data, res&0xFFFF);
-    c->flag_zero = flag_zero(res&0xFFFF);
+    if(flags)
+        flags_set(c, FLAGS_SUB, s_data, d_data, res&0xFFFF);
     pc_update(c, 2);
 }
 
-void inst_j(struct cpu *c, uint16_t inst){
-    log_printf("Inst:J\t");
-
+static void inst_j(struct cpu *c, const struct inst_op *op){
+    uint16_t pc = pc_read(c);
     pc_update(c, 2);
 
-    uint16_t imm = rom_read_w(c);
-    c->flag_carry = 0;
-    c->flag_sign = 0;
-    c->flag_overflow = 0;
-    c->flag_zero = 0;
-    pc_update(c, imm);
+    flags_clear(c);
+    pc_update(c, op->imm);
+    halt_if_pc(c, pc);
 }
 
-void inst_jal(struct cpu *c, uint16_t inst){
-    log_printf("Inst:JAL\t");
-
+static void inst_jal(struct cpu *c, const struct inst_op *op){
+    uint16_t pc = pc_read(c);
     pc_update(c, 2);
 
-    uint16_t imm = rom_read_w(c);
-    c->flag_carry = 0;
-    c->flag_sign = 0;
-    c->flag_overflow = 0;
-    c->flag_zero = 0;
+    flags_clear(c);
     reg_write(c, 0, pc_read(c)+2);
-    pc_update(c, imm);
+    pc_update(c, op->imm);
+    halt_if_pc(c, pc);
 }
 
-void inst_jalr(struct cpu *c, uint16_t inst){
-    log_printf("Inst:JALR\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-
-    c->flag_carry = 0;
-    c->flag_sign = 0;
-    c->flag_overflow = 0;
-    c->flag_zero = 0;
+static void inst_jalr(struct cpu *c, const struct inst_op *op){
+    flags_clear(c);
+    uint16_t pc = pc_read(c);
     reg_write(c, 0, pc_read(c)+2);
-    pc_write(c, reg_read(c, rs));
+    pc_write(c, reg_read(c, op->rs));
+    halt_if_pc(c, pc);
 }
 
-void inst_jr(struct cpu *c, uint16_t inst){
-    log_printf("Inst:JR\t");
-
-    uint8_t rs = get_bits(inst, 4, 7);
-
-    c->flag_carry = 0;
-    c->flag_sign = 0;
-    c->flag_overflow = 0;
-    c->flag_zero = 0;
-    pc_write(c, reg_read(c, rs));
+static void inst_jr(struct cpu *c, const struct inst_op *op){
+    uint16_t pc = pc_read(c);
+    flags_clear(c);
+    pc_write(c, reg_read(c, op->rs));
+    halt_if_pc(c, pc);
 }
 
-void inst_jl(struct cpu *c, uint16_t inst){
-    log_printf("Inst:JL\t");
-
-    uint16_t imm = sign_ext(get_bits(inst, 0, 6)<<1, 7) ;
-
+static void inst_jl(struct cpu *c, const struct inst_op *op){
+    flags_eval(c);
     if(c->flag_sign != c->flag_overflow){
-        pc_update(c, imm);
+        pc_update(c, op->imm);
     }else{
         pc_update(c, 2);
     }
-    c->flag_carry = 0;
-    c->flag_sign = 0;
-    c->flag_overflow = 0;
-    c->flag_zero = 0;
+    flags_clear(c);
 }
 
-void inst_jle(struct cpu *c, uint16_t inst){
-    log_printf("Inst:JLE\t");
-
-    uint16_t imm = sign_ext(get_bits(inst, 0, 6)<<1, 7);
-
+static void inst_jle(struct cpu *c, const struct inst_op *op){
+    flags_eval(c);
     if(c->flag_sign != c->flag_overflow || c->flag_zero == 1){
-        pc_update(c, imm);
+        pc_update(c, op->imm);
     }else{
         pc_update(c, 2);
     }
-    c->flag_carry = 0;
-    c->flag_sign = 0;
-    c->flag_overflow = 0;
-    c->flag_zero = 0;
+    flags_clear(c);
 }
 
-void inst_je(struct cpu *c, uint16_t inst){
-    log_printf("Inst:JE\t");
-
-    uint16_t imm = sign_ext(get_bits(inst, 0, 6)<<1, 7);
-
-    if(c->flag_zero == 1){
-        pc_update(c, imm);
+static void inst_je(struct cpu *c, const struct inst_op *op){
+    if(flags_zero(c) == 1){
+        pc_update(c, op->imm);
     }else{
         pc_update(c, 2);
     }
-    c->flag_carry = 0;
-    c->flag_sign = 0;
-    c->flag_overflow = 0;
-    c->flag_zero = 0;
+    flags_clear(c);
 }
 
-void inst_jne(struct cpu *c, uint16_t inst){
-    log_printf("Inst:JNE\t");
-
-    uint16_t imm = sign_ext(get_bits(inst, 0, 6)<<1, 7);
-
-    if(c->flag_zero == 0){
-        pc_update(c, imm);
+// JNE is the only branch still taken once it has cleared the flags, so it
+// is the only one that can loop on itself.
+static void inst_jne(struct cpu *c, const struct inst_op *op){
+    if(flags_zero(c) == 0){
+        pc_update(c, op->imm);
+        if(op->imm == 0)
+            c->halt = HALT_LOOP;
     }else{
         pc_update(c, 2);
     }
-    c->flag_carry = 0;
-    c->flag_sign = 0;
-    c->flag_overflow = 0;
-    c->flag_zero = 0;
+    flags_clear(c);
 }
 
-void inst_jb(struct cpu *c, uint16_t inst){
-    log_printf("Inst:JB\t");
-
-    uint16_t imm = (sign_ext(get_bits(inst, 0, 6)<<1, 7));
-
+static void inst_jb(struct cpu *c, const struct inst_op *op){
+    flags_eval(c);
     if(c->flag_carry == 1){
-        pc_update(c, imm);
+        pc_update(c, op->imm);
     }else{
         pc_update(c, 2);
     }
-    c->flag_carry = 0;
-    c->flag_sign = 0;
-    c->flag_overflow = 0;
-    c->flag_zero = 0;
+    flags_clear(c);
 }
 
-void inst_jbe(struct cpu *c, uint16_t inst){
-    log_printf("Inst:JBE\t");
-
-    uint16_t imm = sign_ext(get_bits(inst, 0, 6)<<1, 7);
-
+static void inst_jbe(struct cpu *c, const struct inst_op *op){
+    flags_eval(c);
     if(c->flag_carry == 1 || c->flag_zero == 1){
-        pc_update(c, imm);
+        pc_update(c, op->imm);
     }else{
         pc_update(c, 2);
     }
-    c->flag_carry = 0;
-    c->flag_sign = 0;
-    c->flag_overflow = 0;
-    c->flag_zero = 0;
+    flags_clear(c);
+}
 
+DEF_INST(inst_nop){
+    if(flags)
+        flags_clear(c);
+    pc_update(c, 2);
 }
 
-void inst_nop(struct cpu *c, uint16_t inst){
-    log_printf("Inst:NOP\t");
+static void inst_undef(struct cpu *c, const struct inst_op *op){
+    c->halt = HALT_LOOP;
+}
+
+static void inst_halt(struct cpu *c, const struct inst_op *op){
+    c->halt = op->imm;
+}
+
+const struct inst_data INST_SYM(inst_list)[] = {
+    [INST_LW]   = {"0b1011_0010_xxxx_xxxx", "LW",   inst_lw,   dec_rr_imm16},
+    [INST_LWSP] = {"0b1010_xxxx_xxxx_xxxx", "LWSP", inst_lwsp, dec_lwsp},
+    [INST_LBU]  = {"0b1011_1010_xxxx_xxxx", "LBU",  inst_lbu,  dec_rr_imm16},
+    [INST_LB]   = {"0b1011_1110_xxxx_xxxx", "LB",   inst_lb,   dec_rr_imm16},
+    [INST_SW]   = {"0b1001_0010_xxxx_xxxx", "SW",   inst_sw,   dec_rr_imm16},
+    [INST_SWSP] = {"0b1000_xxxx_xxxx_xxxx", "SWSP", inst_swsp, dec_swsp},
+    [INST_SB]   = {"0b1001_1010_xxxx_xxxx", "SB",   inst_sb,   dec_rr_imm16},
+    [INST_MOV]  = {"0b1110_0000_xxxx_xxxx", "MOV",  inst_mov,  dec_rr},
+    [INST_ADD]  = {"0b1110_0010_xxxx_xxxx", "ADD",  inst_add,  dec_rr},
+    [INST_SUB]  = {"0b1110_0011_xxxx_xxxx", "SUB",  inst_sub,  dec_rr},
+    [INST_AND]  = {"0b1110_0100_xxxx_xxxx", "AND",  inst_and,  dec_rr},
+    [INST_OR]   = {"0b1110_0101_xxxx_xxxx", "OR",   inst_or,   dec_rr},
+    [INST_XOR]  = {"0b1110_0110_xxxx_xxxx", "XOR",  inst_xor,  dec_rr},
+    [INST_LSL]  = {"0b1110_1001_xxxx_xxxx", "LSL",  inst_lsl,  dec_rr},
+    [INST_LSR]  = {"0b1110_1010_xxxx_xxxx", "LSR",  inst_lsr,  dec_rr},
+    [INST_ASR]  = {"0b1110_1101_xxxx_xxxx", "ASR",  inst_asr,  dec_rr},
+    [INST_CMP]  = {"0b1100_0011_xxxx_xxxx", "CMP",  inst_cmp,  dec_rr},
+    [INST_LI]   = {"0b0111_1000_xxxx_xxxx", "LI",   inst_li,   dec_rr_imm16},
+    [INST_ADDI] = {"0b1111_0010_xxxx_xxxx", "ADDI", inst_addi, dec_imm4},
+    [INST_CMPI] = {"0b1101_0011_xxxx_xxxx", "CMPI", inst_cmpi, dec_imm4},
+    [INST_J]    = {"0b0101_0010_0000_0000", "J",    inst_j,    dec_rr_imm16},
+    [INST_JAL]  = {"0b0111_0011_0000_0000", "JAL",  inst_jal,  dec_rr_imm16},
+    [INST_JALR] = {"0b0110_0001_xxxx_0000", "JALR", inst_jalr, dec_rr},
+    [INST_JR]   = {"0b0100_0000_xxxx_0000", "JR",   inst_jr,   dec_rr},
+    [INST_JL]   = {"0b0100_0100_0xxx_xxxx", "JL",   inst_jl,   dec_branch},
+    [INST_JLE]  = {"0b0100_0100_1xxx_xxxx", "JLE",  inst_jle,  dec_branch},
+    [INST_JE]   = {"0b0100_0101_0xxx_xxxx", "JE",   inst_je,   dec_branch},
+    [INST_JNE]  = {"0b0100_0101_1xxx_xxxx", "JNE",  inst_jne,  dec_branch},
+    [INST_JB]   = {"0b0100_0110_0xxx_xxxx", "JB",   inst_jb,   dec_branch},
+    [INST_JBE]  = {"0b0100_0110_1xxx_xxxx", "JBE",  inst_jbe,  dec_branch},
+    [INST_NOP]  = {"0b0000_0000_0000_0000", "NOP",  inst_nop,  dec_none},
+    [INST_UNDEF] = {NULL, NULL, inst_undef, NULL}, //Terminator, also used for undefined instructions
+    [INST_HALT]  = {NULL, NULL, inst_halt, NULL}
+};
+
+#ifndef INST_TRACE
+const inst_func inst_flagless[INST_NUM] = {
+    [INST_LW]   = inst_lw_nf,   [INST_LWSP] = inst_lwsp_nf, [INST_LBU]  = inst_lbu_nf,
+    [INST_LB]   = inst_lb_nf,   [INST_SW]   = inst_sw_nf,   [INST_SWSP] = inst_swsp_nf,
+    [INST_SB]   = inst_sb_nf,   [INST_MOV]  = inst_mov_nf,  [INST_ADD]  = inst_add_nf,
+    [INST_SUB]  = inst_sub_nf,  [INST_AND]  = inst_and_nf,  [INST_OR]   = inst_or_nf,
+    [INST_XOR]  = inst_xor_nf,  [INST_LSL]  = inst_lsl_nf,  [INST_LSR]  = inst_lsr_nf,
+    [INST_ASR]  = inst_asr_nf,  [INST_CMP]  = inst_cmp_nf,  [INST_LI]   = inst_li_nf,
+    [INST_ADDI] = inst_addi_nf, [INST_CMPI] = inst_cmpi_nf, [INST_NOP]  = inst_nop_nf,
+};
+#endif
+
+#ifndef INST_TRACE
+// Direct-threaded execution of the ops of a block: rather than calling
+// op->func, block_exec() jumps to a label of op->xop holding the inlined
+// handler, which ends with the jump to the next one, so that each jump is
+// predicted from the op before it. The pairs that profiles show most often
+// share a label (superinstructions): CMP or CMPI with the branch that
+// ends the block, and LI with an ADDI after it.
+#define THREAD_FLAGGED(X) \
+    X(lw) X(lwsp) X(lbu) X(lb) X(sw) X(swsp) X(sb) X(mov) X(add) X(sub) X(and) \
+    X(or) X(xor) X(lsl) X(lsr) X(asr) X(cmp) X(li) X(addi) X(cmpi) X(nop)
+#define THREAD_PLAIN(X) \
+    X(j) X(jal) X(jalr) X(jr) X(jl) X(jle) X(je) X(jne) X(jb) X(jbe) X(undef)
+#define THREAD_BRANCHES(X) \
+    X(jl) X(jle) X(je) X(jne) X(jb) X(jbe)
+
+enum thread_op {
+#define X(name) XOP_##name, XOP_##name##_nf,
+    THREAD_FLAGGED(X)
+#undef X
+#define X(name) XOP_##name,
+    THREAD_PLAIN(X)
+#undef X
+#define X(br) XOP_cmp_##br, XOP_cmpi_##br,
+    THREAD_BRANCHES(X)
+#undef X
+    XOP_li_addi,
+    XOP_li_addi_nf,
+    XOP_END,
+};
 
-    c->flag_sign = 0;
-    c->flag_overflow = 0;
-    c->flag_zero = 0;
-    c->flag_carry = 0; 
+static const inst_func thread_funcs[XOP_cmp_jl] = {
+#define X(name) [XOP_##name] = inst_##name, [XOP_##name##_nf] = inst_##name##_nf,
+    THREAD_FLAGGED(X)
+#undef X
+#define X(name) [XOP_##name] = inst_##name,
+    THREAD_PLAIN(X)
+#undef X
+};
+
+void block_thread(struct inst_op *ops, int n){
+    for(int i=0;i<n;i++){
+        ops[i].xop = 0;
+        while(thread_funcs[ops[i].xop] != ops[i].func)
+            ops[i].xop++;
+        assert(ops[i].xop < XOP_cmp_jl);
+    }
+    for(int i=0;i+1<n;i++){
+        uint8_t id = ops[i].id, next = ops[i+1].id;
+        if((id == INST_CMP || id == INST_CMPI) && next >= INST_JL && next <= INST_JBE){
+            ops[i].xop = XOP_cmp_jl + 2*(next - INST_JL) + (id == INST_CMPI);
+            i++;
+        }else if(ops[i].func == inst_li_nf && next == INST_ADDI){
+            ops[i].xop = ops[i+1].func == inst_addi ? XOP_li_addi : XOP_li_addi_nf;
+            i++;
+        }
+    }
+    ops[n].xop = XOP_END;
+}
+
+// CMP and CMPI before a branch, which reads their flags right away.
+static inline void cmp_eager(struct cpu *c, uint16_t s_data, uint16_t d_data){
+    s_data = (~s_data)+1;
+    flags_compute(c, FLAGS_SUB, s_data, d_data, (s_data+d_data)&0xFFFF);
+    c->flags_kind = FLAGS_NONE;
     pc_update(c, 2);
 }
 
+void block_exec(struct cpu *c, const struct inst_op *op){
+    static const void *const labels[] = {
+#define X(name) [XOP_##name] = &&do_##name, [XOP_##name##_nf] = &&do_##name##_nf,
+        THREAD_FLAGGED(X)
+#undef X
+#define X(name) [XOP_##name] = &&do_##name,
+        THREAD_PLAIN(X)
+#undef X
+#define X(br) [XOP_cmp_##br] = &&do_cmp_##br, [XOP_cmpi_##br] = &&do_cmpi_##br,
+        THREAD_BRANCHES(X)
+#undef X
+        [XOP_li_addi] = &&do_li_addi,
+        [XOP_li_addi_nf] = &&do_li_addi_nf,
+        [XOP_END] = &&do_end,
+    };
+#define DISPATCH() goto *labels[op->xop]
+
+    DISPATCH();
+#define X(name) \
+    do_##name: inst_##name##_body(c, op, 1); op++; DISPATCH(); \
+    do_##name##_nf: inst_##name##_body(c, op, 0); op++; DISPATCH();
+    THREAD_FLAGGED(X)
+#undef X
+#define X(name) \
+    do_##name: inst_##name(c, op); op++; DISPATCH();
+    THREAD_PLAIN(X)
+#undef X
+#define X(br) \
+    do_cmp_##br: cmp_eager(c, reg_read(c, op->rs), reg_read(c, op->rd)); inst_##br(c, op+1); op += 2; DISPATCH(); \
+    do_cmpi_##br: cmp_eager(c, op->imm, reg_read(c, op->rd)); inst_##br(c, op+1); op += 2; DISPATCH();
+    THREAD_BRANCHES(X)
+#undef X
+do_li_addi:
+    inst_li_body(c, op, 0);
+    inst_addi_body(c, op+1, 1);
+    op += 2;
+    DISPATCH();
+do_li_addi_nf:
+    inst_li_body(c, op, 0);
+    inst_addi_body(c, op+1, 0);
+    op += 2;
+    DISPATCH();
+do_end:
+    return;
+#undef DISPATCH
+}
+
+int cpu_traced(const struct cpu *c){
+    return c->trace_log != NULL || c->trace_out != NULL || c->trace_ref != NULL
+        || c->prof != NULL || c->mem_delta != NULL || debug_watching(c);
+}
+
+void flags_eval_pending(struct cpu *c){
+    flags_compute(c, c->flags_kind, c->flags_s, c->flags_d, c->flags_res);
+    c->flags_kind = FLAGS_NONE;
+}
+#endif
+
+#ifdef INST_TRACE
+// Pass the record of the cycle just executed to every sink. Returns 0 if
+// it diverged from the reference trace.
+static int trace_emit(struct cpu *c, const struct inst_op *op){
+    trace_end(&c->rec, c->pc, c->flag_sign, c->flag_zero, c->flag_carry, c->flag_overflow);
+    if(c->prof != NULL)
+        profile_count(c->prof, op, &c->rec);
+    if(c->mem_delta != NULL)
+        mem_delta_count(c->mem_delta, &c->rec);
+    if(c->trace_log != NULL)
+        trace_print(c->trace_log, &c->rec);
+    if(c->trace_out != NULL)
+        trace_write(c->trace_out, &c->rec);
+    return c->trace_ref == NULL || trace_check(c->trace_ref, &c->rec);
+}
+#endif
+
+#ifndef INST_TRACE
+// Run whole blocks while enough cycles are left for them, going from one
+// to the next through their chains, and single instructions otherwise.
+// Only the last instruction of a block can halt.
+int cpu_run(struct cpu *c, int ncycles){
+    struct block *b = NULL;
+    int i = 0;
+    // Resuming from a breakpoint runs the instruction it stopped before.
+    if(c->halt == HALT_BREAK && ncycles > 0){
+        struct inst_op op;
+        inst_decode(c, inst_list, c->pc & c->rom_mask, &op);
+        c->halt = HALT_NONE;
+        op.func(c, &op);
+        i++;
+    }else{
+        c->halt = HALT_NONE;
+    }
+    while(i < ncycles && c->halt == HALT_NONE){
+        b = b != NULL ? block_next(c, b) : block_get(c);
+        if(b == NULL || b->n > ncycles - i){
+            const struct inst_op *op = inst_fetch(c, inst_list);
+            op->func(c, op);
+            b = NULL;
+            if(c->halt == HALT_PC || c->halt == HALT_BREAK)
+                break;
+            i++;
+            if(c->halt != HALT_NONE)
+                break;
+            continue;
+        }
+        if(b->native != NULL){
+            flags_eval(c);  // the native code only knows flag_sign etc.
+            b->native(c);
+        }else{
+            block_exec(c, b->ops);
+            if(c->jit != NULL && ++b->runs == c->jit->hot)
+                jit_compile(c->jit, c, b);
+        }
+        i += b->n;
+        if(c->halt != HALT_NONE)
+            break;
+    }
+    c->cycle += i;
+    return i;
+}
+#else
+int INST_SYM(cpu_run)(struct cpu *c, int ncycles){
+    int i;
+    // Resuming from a breakpoint runs the instruction it stopped before.
+    int resume = c->halt == HALT_BREAK;
+    struct inst_op step;
+    c->halt = HALT_NONE;
+    flags_eval(c);  // left by cpu_run()
+    for(i=0;i<ncycles;i++){
+        const struct inst_op *op = &step;
+        if(i == 0 && resume)
+            inst_decode(c, INST_SYM(inst_list), c->pc & c->rom_mask, &step);
+        else
+            op = inst_fetch(c, INST_SYM(inst_list));
+        TRACE(trace_begin(&c->rec, c->pc, rom_read_w(c, c->pc), op->len));
+        op->func(c, op);
+        // The instruction at halt_pc or a breakpoint is not executed.
+        if(c->halt != HALT_NONE){
+            if(c->halt == HALT_LOOP){
+                // Diverging is what stops the run then, as on any cycle.
+                TRACE(if(!trace_emit(c, op)){ c->halt = HALT_NONE; })
+                i++;
+            }
+            break;
+        }
+        TRACE(if(!trace_emit(c, op)){ i++; break; })
+        if(c->dbg != NULL && debug_hit_write(c->dbg, &c->rec, c->ram_mask)){
+            c->halt = HALT_WATCH;
+            i++;
+            break;
+        }
+    }
+    c->cycle += i;
+    return i;
+}
+#endif
 
-const struct inst_data inst_list[] = {
-    {"0b1011_0010_xxxx_xxxx", inst_lw},   //LW
-    {"0b1010_xxxx_xxxx_xxxx", inst_lwsp}, //LWSP
-    {"0b1011_1010_xxxx_xxxx", inst_lbu},  //LBU
-    {"0b1011_1110_xxxx_xxxx", inst_lb},   //LB
-    {"0b1001_0010_xxxx_xxxx", inst_sw},   //SW
-    {"0b1000_xxxx_xxxx_xxxx", inst_swsp}, //SWSP
-    {"0b1001_1010_xxxx_xxxx", inst_sb},   //SB
-    {"0b1110_0000_xxxx_xxxx", inst_mov},  //MOV
-    {"0b1110_0010_xxxx_xxxx", inst_add},  //ADD
-    {"0b1110_0011_xxxx_xxxx", inst_sub},  //SUB
-    {"0b1110_0100_xxxx_xxxx", inst_and},  //AND
-    {"0b1110_0101_xxxx_xxxx", inst_or},   //OR
-    {"0b1110_0110_xxxx_xxxx", inst_xor},  //XOR
-    {"0b1110_1001_xxxx_xxxx", inst_lsl},  //LSL
-    {"0b1110_1010_xxxx_xxxx", inst_lsr},  //LSR
-    {"0b1110_1101_xxxx_xxxx", inst_asr},  //ASR
-    {"0b1100_0011_xxxx_xxxx", inst_cmp},  //CMP
-    {"0b0111_1000_xxxx_xxxx", inst_li},   //LI
-    {"0b1111_0010_xxxx_xxxx", inst_addi}, //ADDI
-    {"0b1101_0011_xxxx_xxxx", inst_cmpi}, //CMPI
-    {"0b0101_0010_0000_0000", inst_j},    //J
-    {"0b0111_0011_0000_0000", inst_jal},  //JAL
-    {"0b0110_0001_xxxx_0000", inst_jalr}, //JALR
-    {"0b0100_0000_xxxx_0000", inst_jr},   //JR
-    {"0b0100_0100_0xxx_xxxx", inst_jl},   //JL
-    {"0b0100_0100_1xxx_xxxx", inst_jle},  //JLE
-    {"0b0100_0101_0xxx_xxxx", inst_je},   //JE
-    {"0b0100_0101_1xxx_xxxx", inst_jne},  //JNE
-    {"0b0100_0110_0xxx_xxxx", inst_jb},   //JB
-    {"0b0100_0110_1xxx_xxxx", inst_jbe},  //JBE
-    {"0b0000_0000_0000_0000", inst_nop},  //NOP
-    {NULL, NULL} //Terminator
-};
@@ -1,20 +1,138 @@
 #ifndef INST_H
 #define INST_H
 
+#include <assert.h>
 #include <stdint.h>
-#include "inst.h"
 
-typedef void (*inst_func)(struct cpu *c, uint16_t inst);
+// Index of each instruction in inst_list[] (and inst_op.id).
+enum inst_id {
+    INST_LW, INST_LWSP, INST_LBU, INST_LB, INST_SW, INST_SWSP, INST_SB,
+    INST_MOV, INST_ADD, INST_SUB, INST_AND, INST_OR, INST_XOR,
+    INST_LSL, INST_LSR, INST_ASR, INST_CMP, INST_LI, INST_ADDI, INST_CMPI,
+    INST_J, INST_JAL, INST_JALR, INST_JR,
+    INST_JL, INST_JLE, INST_JE, INST_JNE, INST_JB, INST_JBE,
+    INST_NOP,
+    INST_UNDEF, // the terminator
+    INST_HALT,  // installed at halt_pc and breakpoints by inst_predecode()
+    INST_NUM
+};
+
+typedef void (*inst_dec)(struct cpu *c, uint16_t addr, uint16_t inst, struct inst_op *op);
 
 struct inst_data {
     char *bit_pattern;
+    char *name;
     inst_func func;
+    inst_dec dec;
 };
 
+// The same instruction set with plain and logging handlers; see inst.c.
 extern const struct inst_data inst_list[];
+extern const struct inst_data inst_list_trace[];
+// Plain handlers that skip the flag updates, or NULL for the instructions
+// that read flags or do not write them all.
+extern const inst_func inst_flagless[INST_NUM];
+
+// The flag computations, shared with the translated programs of aot.c.
+static inline uint8_t flag_zero(uint16_t res){
+    return res == 0;
+}
+
+static inline uint8_t flag_sign(uint16_t res){
+    return res>>15;
+}
+
+static inline uint8_t flag_overflow(uint16_t s1, uint16_t s2, uint16_t res){
+    uint8_t s1_sign = s1>>15;
+    uint8_t s2_sign = s2>>15;
+    uint8_t res_sign = res>>15;
+    return ((s1_sign^s2_sign) == 0)&((s2_sign^res_sign) == 1);
+}
+
+// The flags left by an instruction with result res, by kind (see enum
+// flags_kind): the address computation of the loads and stores, whose
+// carry is always set as it is only 16 bits wide, additions, subtractions
+// (s already negated), logic operations and moves.
+static inline void flags_compute(struct cpu *c, uint8_t kind, uint16_t s, uint16_t d, uint16_t res){
+    if(kind == FLAGS_ADD || kind == FLAGS_SUB){
+        if((uint32_t)s+d > 0xFFFF || (kind == FLAGS_SUB && s == 0)){
+            c->flag_carry = 0;
+        }else{
+            c->flag_carry = 1;
+        }
+    }else{
+        c->flag_carry = kind == FLAGS_ADDR;
+    }
+    c->flag_sign = flag_sign(res);
+    c->flag_overflow = kind == FLAGS_MOV ? 0 : flag_overflow(s, d, res);
+    c->flag_zero = flag_zero(res);
+}
+
+static inline void flags_clear(struct cpu *c){
+    c->flags_kind = FLAGS_NONE;
+    c->flag_carry = 0;
+    c->flag_sign = 0;
+    c->flag_overflow = 0;
+    c->flag_zero = 0;
+}
+
+void flags_eval_pending(struct cpu *c);
+
+// Bring flag_sign, flag_overflow, flag_zero and flag_carry up to date.
+static inline void flags_eval(struct cpu *c){
+    if(c->flags_kind != FLAGS_NONE)
+        flags_eval_pending(c);
+}
+
+static inline uint16_t pc_read(struct cpu *c){
+    return c->pc;
+}
+
+static inline uint16_t reg_read(struct cpu *c, uint8_t reg_idx){
+    return c->reg[reg_idx];
+}
+
+static inline uint16_t rom_read_w(struct cpu *c, uint16_t addr){
+    return c->inst_rom[addr & c->rom_mask] + (c->inst_rom[(addr+1) & c->rom_mask]<<8);
+}
+
+// inst_decode() decodes the instruction at addr, and inst_predecode() the
+// same for the icache, except for an INST_HALT op at halt_pc and at
+// breakpoints (see debug.h), whose imm is the enum cpu_halt to stop with.
+void inst_decode(struct cpu *c, const struct inst_data *list, uint16_t addr, struct inst_op *op);
+void inst_predecode(struct cpu *c, const struct inst_data *list, uint16_t addr, struct inst_op *op);
+void icache_invalidate(struct cpu *c);
+
+static inline const struct inst_op *inst_fetch(struct cpu *c, const struct inst_data *list){
+    // The cache holds handlers from one list only.
+    if(c->icache_list != list){
+        icache_invalidate(c);
+        c->icache_list = list;
+    }
+
+    // An odd PC would alias the slot of its even neighbour, so decode it
+    // every time instead of caching it.
+    uint16_t addr = c->pc & c->rom_mask;
+    if(addr & 1){
+        inst_predecode(c, list, addr, &c->op_unaligned);
+        return &c->op_unaligned;
+    }
+
+    struct inst_op *op = &c->icache[addr>>1];
+    if(op->func == NULL)
+        inst_predecode(c, list, addr, op);
+    return op;
+}
 
-uint16_t pc_read(struct cpu *c);
-uint16_t reg_read(struct cpu *c, uint8_t reg_idx);
-uint16_t rom_read_w(struct cpu *c);
+// Execute up to ncycles instructions and return how many were executed.
+// Both stop early when the CPU halts, with the reason in c->halt.
+// cpu_run_trace() records every cycle into c->rec for the trace sinks and
+// stops early if c->trace_ref diverges; cpu_run() is the same loop with
+// all tracing compiled out.
+int cpu_run(struct cpu *c, int ncycles);
+int cpu_run_trace(struct cpu *c, int ncycles);
+// Whether cpu_run_trace() must run instead of cpu_run(): for any trace
+// sink or watchpoint.
+int cpu_traced(const struct cpu *c);
 
 #endif
@@ -0,0 +1,594 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "block.h"
+#include "jit.h"
+
+struct jit *jit_new(int hot){
+    struct jit *j = malloc(sizeof(struct jit));
+    if(j == NULL)
+        return NULL;
+    // Never writable and executable at once: jit_compile() makes the
+    // pages it writes writable only while it copies the code in.
+    j->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(j->code == MAP_FAILED){
+        free(j);
+        return NULL;
+    }
+    j->size = JIT_CODE_SIZE;
+    j->used = 0;
+    j->hot = hot;
+    return j;
+}
+
+void jit_free(struct jit *j){
+    if(j == NULL)
+        return;
+    munmap(j->code, j->size);
+    free(j);
+}
+
+void jit_reset(struct jit *j){
+    j->used = 0;
+}
+
+#if defined(__x86_64__)
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// Condition codes of jcc/setcc.
+enum { CC_O = 0x0, CC_B = 0x2, CC_AE = 0x3, CC_Z = 0x4, CC_NZ = 0x5, CC_S = 0x8 };
+
+#define CPU_OFF(field) ((int)offsetof(struct cpu, field))
+#define REG_OFF(g) (CPU_OFF(reg) + 2*(g))
+
+// Guest registers live in these while a block runs; the first four are
+// free to use, the others are saved on entry.
+static const int host_pool[] = {RSI, R8, R9, R10, RBX, RBP, R12, R13, R14, R15};
+#define HOST_POOL_LEN (sizeof(host_pool) / sizeof(host_pool[0]))
+
+// An upper bound on the code of one instruction, and of the block entry
+// and exit.
+#define JIT_OP_MAX 128
+#define JIT_BLOCK_MAX (BLOCK_MAX * JIT_OP_MAX + 256)
+
+struct emit {
+    uint8_t *p;
+    const int *host;    // host register of each guest register, or -1
+    uint16_t written;   // guest registers to store back on exit
+    uint16_t ram_mask;
+};
+
+static void b1(struct emit *e, uint8_t x){
+    *e->p++ = x;
+}
+
+static void w16(struct emit *e, uint16_t x){
+    b1(e, x);
+    b1(e, x >> 8);
+}
+
+static void d32(struct emit *e, uint32_t x){
+    w16(e, x);
+    w16(e, x >> 16);
+}
+
+// Operand size prefix and REX for an operation of size bits.
+static void prefix(struct emit *e, int size, int reg, int index, int base){
+    if(size == 16)
+        b1(e, 0x66);
+    int rex = (size == 64 ? 8 : 0) | (reg & 8 ? 4 : 0) | (index & 8 ? 2 : 0) | (base & 8 ? 1 : 0);
+    if(rex)
+        b1(e, 0x40 | rex);
+}
+
+static void opcode(struct emit *e, int opc){
+    if(opc > 0xff)
+        b1(e, opc >> 8);
+    b1(e, opc);
+}
+
+// opc reg, rm with rm a register. reg is the /digit of one operand forms.
+static void op_rr(struct emit *e, int size, int opc, int reg, int rm){
+    prefix(e, size, reg, 0, rm);
+    opcode(e, opc);
+    b1(e, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// opc reg, [rdi + disp], rdi being the struct cpu.
+static void op_cpu(struct emit *e, int size, int opc, int reg, int disp){
+    prefix(e, size, reg, 0, RDI);
+    opcode(e, opc);
+    b1(e, 0x80 | (reg & 7) << 3 | RDI);
+    d32(e, disp);
+}
+
+// opc reg, [r11 + index], r11 being data_ram.
+static void op_ram(struct emit *e, int opc, int reg, int index){
+    prefix(e, 32, reg, index, R11);
+    opcode(e, opc);
+    b1(e, 0x04 | (reg & 7) << 3);
+    b1(e, (index & 7) << 3 | (R11 & 7));
+}
+
+// Mark the RAM page of the masked address in reg written (see
+// cpu.ram_dirty), clobbering reg.
+static void mark_page(struct emit *e, int reg){
+    op_rr(e, 32, 0xc1, 5, reg);
+    b1(e, RAM_PAGE_BITS);
+    // mov byte [rdi + reg + disp], 1
+    prefix(e, 32, 0, reg, RDI);
+    opcode(e, 0xc6);
+    b1(e, 0x84);
+    b1(e, (reg & 7) << 3 | RDI);
+    d32(e, CPU_OFF(ram_dirty));
+    b1(e, 1);
+}
+
+static void mov_imm(struct emit *e, int reg, uint32_t imm){
+    prefix(e, 32, 0, 0, reg);
+    b1(e, 0xb8 + (reg & 7));
+    d32(e, imm);
+}
+
+static void set_flag(struct emit *e, int cc, int disp){
+    op_cpu(e, 32, 0x0f90 | cc, 0, disp);
+}
+
+static void set_flag_imm(struct emit *e, int disp, uint8_t val){
+    op_cpu(e, 32, 0xc6, 0, disp);
+    b1(e, val);
+}
+
+static void clear_flags(struct emit *e){
+    set_flag_imm(e, CPU_OFF(flag_sign), 0);
+    set_flag_imm(e, CPU_OFF(flag_overflow), 0);
+    set_flag_imm(e, CPU_OFF(flag_zero), 0);
+    set_flag_imm(e, CPU_OFF(flag_carry), 0);
+}
+
+// Forward jcc/jmp rel8, patched by label().
+static uint8_t *jump(struct emit *e, int opc){
+    b1(e, opc);
+    b1(e, 0);
+    return e->p - 1;
+}
+
+static void label(struct emit *e, uint8_t *rel){
+    *rel = e->p - (rel + 1);
+}
+
+// Zero-extended guest register g into host register dst, and back.
+static void get(struct emit *e, int dst, int g){
+    if(e->host[g] >= 0)
+        op_rr(e, 32, 0x89, e->host[g], dst);
+    else
+        op_cpu(e, 32, 0x0fb7, dst, REG_OFF(g));
+}
+
+static void put(struct emit *e, int g, int src){
+    if(e->host[g] >= 0)
+        op_rr(e, 32, 0x0fb7, e->host[g], src);
+    else
+        op_cpu(e, 16, 0x89, src, REG_OFF(g));
+    e->written |= 1 << g;
+}
+
+// The flags of an addition done by x86 in 16 bits, except for the carry,
+// which RV16K sets when there is none.
+static void add_flags(struct emit *e, int carry_cc){
+    set_flag(e, carry_cc, CPU_OFF(flag_carry));
+    set_flag(e, CC_S, CPU_OFF(flag_sign));
+    set_flag(e, CC_O, CPU_OFF(flag_overflow));
+    set_flag(e, CC_Z, CPU_OFF(flag_zero));
+}
+
+// The flags of the logic and shift instructions, with s in ecx, d in edx
+// and the result in eax: flag_overflow() is computed as inst.c does.
+static void logic_flags(struct emit *e){
+    set_flag_imm(e, CPU_OFF(flag_carry), 0);
+    op_rr(e, 16, 0x85, RAX, RAX);
+    set_flag(e, CC_S, CPU_OFF(flag_sign));
+    set_flag(e, CC_Z, CPU_OFF(flag_zero));
+    op_rr(e, 32, 0x31, RDX, RCX);   // xor ecx, edx
+    op_rr(e, 32, 0xf7, 2, RCX);     // not ecx
+    op_rr(e, 32, 0x31, RAX, RDX);   // xor edx, eax
+    op_rr(e, 32, 0x21, RDX, RCX);   // and ecx, edx
+    op_rr(e, 32, 0xc1, 5, RCX);     // shr ecx, 15
+    b1(e, 15);
+    op_rr(e, 32, 0x83, 4, RCX);     // and ecx, 1
+    b1(e, 1);
+    op_cpu(e, 32, 0x88, RCX, CPU_OFF(flag_overflow));
+}
+
+// eax = (base + imm) & 0xffff, with the flags of the address addition.
+static void address(struct emit *e, int base, uint16_t imm, int flags){
+    get(e, RAX, base);
+    op_rr(e, 16, 0x81, 0, RAX);
+    w16(e, imm);
+    if(flags){
+        set_flag_imm(e, CPU_OFF(flag_carry), 1);
+        set_flag(e, CC_S, CPU_OFF(flag_sign));
+        set_flag(e, CC_O, CPU_OFF(flag_overflow));
+        set_flag(e, CC_Z, CPU_OFF(flag_zero));
+    }
+    op_rr(e, 32, 0x0fb7, RAX, RAX);
+    op_cpu(e, 64, 0x8b, R11, CPU_OFF(data_ram));
+}
+
+static void mask_ram(struct emit *e, int reg){
+    op_rr(e, 32, 0x81, 4, reg);
+    d32(e, e->ram_mask);
+}
+
+// The word at eax into eax, or the word in edx to eax; both bytes wrap
+// around the RAM separately as in mem_read_w() and mem_write_w().
+static void load_w(struct emit *e){
+    op_rr(e, 32, 0x89, RAX, RCX);
+    mask_ram(e, RCX);
+    op_ram(e, 0x0fb6, RDX, RCX);
+    op_rr(e, 32, 0x83, 0, RAX);
+    b1(e, 1);
+    mask_ram(e, RAX);
+    op_ram(e, 0x0fb6, RAX, RAX);
+    op_rr(e, 32, 0xc1, 4, RAX);
+    b1(e, 8);
+    op_rr(e, 32, 0x09, RDX, RAX);
+}
+
+static void store_w(struct emit *e){
+    op_rr(e, 32, 0x89, RAX, RCX);
+    mask_ram(e, RCX);
+    op_ram(e, 0x88, RDX, RCX);
+    op_rr(e, 32, 0xc1, 5, RDX);
+    b1(e, 8);
+    op_rr(e, 32, 0x83, 0, RAX);
+    b1(e, 1);
+    mask_ram(e, RAX);
+    op_ram(e, 0x88, RDX, RAX);
+    mark_page(e, RCX);
+    mark_page(e, RAX);
+}
+
+// eax = rd - x computed as rd + (-x), with the flags of inst_sub(): the
+// carry is set if rd < x unsigned, sign/overflow/zero are those of the
+// 16 bit addition of -x. x is in edx, or imm if edx is not used.
+static void sub_flags(struct emit *e, int rd, int use_edx, uint16_t imm, int flags){
+    get(e, RAX, rd);
+    if(flags){
+        if(use_edx){
+            op_rr(e, 16, 0x39, RDX, RAX);
+        }else{
+            op_rr(e, 16, 0x81, 7, RAX);
+            w16(e, imm);
+        }
+        set_flag(e, CC_B, CPU_OFF(flag_carry));
+    }
+    if(use_edx){
+        op_rr(e, 16, 0xf7, 3, RDX);
+        op_rr(e, 16, 0x01, RDX, RAX);
+    }else{
+        op_rr(e, 16, 0x81, 0, RAX);
+        w16(e, -imm);
+    }
+    if(flags){
+        set_flag(e, CC_S, CPU_OFF(flag_sign));
+        set_flag(e, CC_O, CPU_OFF(flag_overflow));
+        set_flag(e, CC_Z, CPU_OFF(flag_zero));
+    }
+}
+
+// Mark halt as HALT_LOOP if the new PC in eax equals the old one in edx.
+static void halt_if_same(struct emit *e){
+    op_rr(e, 16, 0x39, RDX, RAX);
+    uint8_t *skip = jump(e, 0x70 | CC_NZ);
+    set_flag_imm(e, CPU_OFF(halt), HALT_LOOP);
+    label(e, skip);
+}
+
+static void emit_op(struct emit *e, const struct inst_op *op){
+    int flags = inst_flagless[op->id] == NULL || op->func != inst_flagless[op->id];
+
+    switch(op->id){
+    case INST_LW:
+    case INST_LWSP:
+        address(e, op->id == INST_LW ? op->rs : 1, op->imm, flags);
+        load_w(e);
+        put(e, op->rd, RAX);
+        break;
+    case INST_LBU:
+    case INST_LB:
+        address(e, op->rs, op->imm, flags);
+        mask_ram(e, RAX);
+        op_ram(e, op->id == INST_LB ? 0x0fbe : 0x0fb6, RAX, RAX);
+        put(e, op->rd, RAX);
+        break;
+    case INST_SW:
+    case INST_SWSP:
+        address(e, op->id == INST_SW ? op->rd : 1, op->imm, flags);
+        get(e, RDX, op->rs);
+        store_w(e);
+        break;
+    case INST_SB:
+        address(e, op->rd, op->imm, flags);
+        get(e, RDX, op->rs);
+        mask_ram(e, RAX);
+        op_ram(e, 0x88, RDX, RAX);
+        mark_page(e, RAX);
+        break;
+    case INST_MOV:
+        get(e, RAX, op->rs);
+        put(e, op->rd, RAX);
+        if(flags){
+            set_flag_imm(e, CPU_OFF(flag_carry), 0);
+            set_flag_imm(e, CPU_OFF(flag_overflow), 0);
+            op_rr(e, 16, 0x85, RAX, RAX);
+            set_flag(e, CC_S, CPU_OFF(flag_sign));
+            set_flag(e, CC_Z, CPU_OFF(flag_zero));
+        }
+        break;
+    case INST_ADD:
+    case INST_ADDI:
+        get(e, RAX, op->rd);
+        if(op->id == INST_ADD){
+            get(e, RDX, op->rs);
+            op_rr(e, 16, 0x01, RDX, RAX);
+        }else{
+            op_rr(e, 16, 0x81, 0, RAX);
+            w16(e, op->imm);
+        }
+        if(flags)
+            add_flags(e, CC_AE);
+        put(e, op->rd, RAX);
+        break;
+    case INST_SUB:
+    case INST_CMP:
+        get(e, RDX, op->rs);
+        sub_flags(e, op->rd, 1, 0, flags);
+        if(op->id == INST_SUB)
+            put(e, op->rd, RAX);
+        break;
+    case INST_CMPI:
+        sub_flags(e, op->rd, 0, op->imm, flags);
+        break;
+    case INST_AND:
+    case INST_OR:
+    case INST_XOR:
+    case INST_LSL:
+    case INST_LSR:
+    case INST_ASR:
+        get(e, RCX, op->rs);
+        get(e, RDX, op->rd);
+        switch(op->id){
+        case INST_AND: op_rr(e, 32, 0x89, RDX, RAX); op_rr(e, 32, 0x21, RCX, RAX); break;
+        case INST_OR:  op_rr(e, 32, 0x89, RDX, RAX); op_rr(e, 32, 0x09, RCX, RAX); break;
+        case INST_XOR: op_rr(e, 32, 0x89, RDX, RAX); op_rr(e, 32, 0x31, RCX, RAX); break;
+        // The count is taken modulo 32, as by the shifts compiled from inst.c.
+        case INST_LSL: op_rr(e, 32, 0x89, RDX, RAX); op_rr(e, 32, 0xd3, 4, RAX); break;
+        case INST_LSR: op_rr(e, 32, 0x89, RDX, RAX); op_rr(e, 32, 0xd3, 5, RAX); break;
+        case INST_ASR: op_rr(e, 32, 0x0fbf, RAX, RDX); op_rr(e, 32, 0xd3, 7, RAX); break;
+        }
+        op_rr(e, 32, 0x0fb7, RAX, RAX);
+        put(e, op->rd, RAX);
+        if(flags)
+            logic_flags(e);
+        break;
+    case INST_LI:
+        mov_imm(e, RAX, op->imm);
+        put(e, op->rd, RAX);
+        if(flags){
+            set_flag_imm(e, CPU_OFF(flag_carry), 0);
+            set_flag_imm(e, CPU_OFF(flag_sign), op->imm >> 15);
+            set_flag_imm(e, CPU_OFF(flag_overflow), 0);
+            set_flag_imm(e, CPU_OFF(flag_zero), op->imm == 0);
+        }
+        break;
+    case INST_NOP:
+        if(flags)
+            clear_flags(e);
+        break;
+
+    // The PC has already been brought up to this instruction.
+    case INST_J:
+    case INST_JAL:
+        clear_flags(e);
+        if(op->id == INST_JAL){
+            op_cpu(e, 32, 0x0fb7, RAX, CPU_OFF(pc));
+            op_rr(e, 32, 0x83, 0, RAX);
+            b1(e, 4);
+            put(e, 0, RAX);
+        }
+        op_cpu(e, 16, 0x81, 0, CPU_OFF(pc));
+        w16(e, op->imm + 2);
+        if((uint16_t)(op->imm + 2) == 0)
+            set_flag_imm(e, CPU_OFF(halt), HALT_LOOP);
+        break;
+    case INST_JALR:
+    case INST_JR:
+        clear_flags(e);
+        op_cpu(e, 32, 0x0fb7, RDX, CPU_OFF(pc));
+        if(op->id == INST_JALR){
+            op_rr(e, 32, 0x89, RDX, RAX);
+            op_rr(e, 32, 0x83, 0, RAX);
+            b1(e, 2);
+            put(e, 0, RAX);
+        }
+        get(e, RAX, op->rs);
+        op_cpu(e, 16, 0x89, RAX, CPU_OFF(pc));
+        halt_if_same(e);
+        break;
+    case INST_JL:
+    case INST_JLE:
+    case INST_JE:
+    case INST_JNE:
+    case INST_JB:
+    case INST_JBE: {
+        // eax = whether the branch is taken
+        switch(op->id){
+        case INST_JL:
+        case INST_JLE:
+            op_cpu(e, 32, 0x0fb6, RAX, CPU_OFF(flag_sign));
+            op_cpu(e, 32, 0x3a, RAX, CPU_OFF(flag_overflow));
+            op_rr(e, 32, 0x0f90 | CC_NZ, 0, RAX);
+            if(op->id == INST_JLE)
+                op_cpu(e, 32, 0x0a, RAX, CPU_OFF(flag_zero));
+            break;
+        case INST_JE:
+        case INST_JNE:
+            op_cpu(e, 32, 0x0fb6, RAX, CPU_OFF(flag_zero));
+            if(op->id == INST_JNE){
+                op_rr(e, 32, 0x83, 6, RAX);
+                b1(e, 1);
+            }
+            break;
+        case INST_JB:
+        case INST_JBE:
+            op_cpu(e, 32, 0x0fb6, RAX, CPU_OFF(flag_carry));
+            if(op->id == INST_JBE)
+                op_cpu(e, 32, 0x0a, RAX, CPU_OFF(flag_zero));
+            break;
+        }
+        clear_flags(e);
+        op_rr(e, 32, 0x84, RAX, RAX);   // test al, al
+        uint8_t *not_taken = jump(e, 0x70 | CC_Z);
+        op_cpu(e, 16, 0x81, 0, CPU_OFF(pc));
+        w16(e, op->imm);
+        if(op->id == INST_JNE && op->imm == 0)
+            set_flag_imm(e, CPU_OFF(halt), HALT_LOOP);
+        uint8_t *done = jump(e, 0xeb);
+        label(e, not_taken);
+        op_cpu(e, 16, 0x81, 0, CPU_OFF(pc));
+        w16(e, 2);
+        label(e, done);
+        break;
+    }
+    case INST_UNDEF:
+        set_flag_imm(e, CPU_OFF(halt), HALT_LOOP);
+        break;
+    }
+}
+
+// Guest registers each op reads or writes.
+static uint16_t op_regs(const struct inst_op *op){
+    switch(op->id){
+    case INST_LWSP:
+        return 1 << 1 | 1 << op->rd;
+    case INST_SWSP:
+        return 1 << 1 | 1 << op->rs;
+    case INST_LI:
+    case INST_ADDI:
+    case INST_CMPI:
+        return 1 << op->rd;
+    case INST_JAL:
+        return 1 << 0;
+    case INST_JALR:
+        return 1 << 0 | 1 << op->rs;
+    case INST_JR:
+        return 1 << op->rs;
+    case INST_J:
+    case INST_JL: case INST_JLE: case INST_JE: case INST_JNE: case INST_JB: case INST_JBE:
+    case INST_NOP:
+    case INST_UNDEF:
+        return 0;
+    default:
+        return 1 << op->rs | 1 << op->rd;
+    }
+}
+
+void jit_compile(struct jit *j, const struct cpu *c, struct block *b){
+    uint8_t buf[JIT_BLOCK_MAX];
+    int host[16], uses[16] = {0};
+    int nhost = 0;
+
+    // Give host registers to the most used guest registers.
+    for(int i=0;i<b->n;i++){
+        uint16_t regs = op_regs(&b->ops[i]);
+        for(int g=0;g<16;g++)
+            uses[g] += regs >> g & 1;
+    }
+    for(int g=0;g<16;g++)
+        host[g] = -1;
+    while(nhost < HOST_POOL_LEN){
+        int best = -1;
+        for(int g=0;g<16;g++)
+            if(host[g] < 0 && uses[g] > 0 && (best < 0 || uses[g] > uses[best]))
+                best = g;
+        if(best < 0)
+            break;
+        host[best] = host_pool[nhost++];
+    }
+
+    struct emit e = {buf, host, 0, c->ram_mask};
+    for(int i=4;i<nhost;i++){
+        if(host_pool[i] & 8)
+            b1(&e, 0x41);
+        b1(&e, 0x50 + (host_pool[i] & 7));
+    }
+    for(int g=0;g<16;g++)
+        if(host[g] >= 0)
+            op_cpu(&e, 32, 0x0fb7, host[g], REG_OFF(g));
+
+    // The interpreter moves the PC as it goes, so only bring it up to the
+    // terminator, or to the end of a block without one.
+    uint16_t pc_off = 0;
+    for(int i=0;i<b->n;i++){
+        const struct inst_op *op = &b->ops[i];
+        if((op->id >= INST_J && op->id <= INST_JBE) || op->id == INST_UNDEF){
+            if(pc_off != 0){
+                op_cpu(&e, 16, 0x81, 0, CPU_OFF(pc));
+                w16(&e, pc_off);
+            }
+            pc_off = 0;
+        }else{
+            pc_off += op->len;
+        }
+        emit_op(&e, op);
+    }
+    if(pc_off != 0){
+        op_cpu(&e, 16, 0x81, 0, CPU_OFF(pc));
+        w16(&e, pc_off);
+    }
+
+    for(int g=0;g<16;g++)
+        if(host[g] >= 0 && (e.written >> g & 1))
+            op_cpu(&e, 16, 0x89, host[g], REG_OFF(g));
+    for(int i=nhost-1;i>=4;i--){
+        if(host_pool[i] & 8)
+            b1(&e, 0x41);
+        b1(&e, 0x58 + (host_pool[i] & 7));
+    }
+    b1(&e, 0xc3);
+
+    size_t len = e.p - buf;
+    if(j->used + len > j->size)
+        return;
+    size_t page = sysconf(_SC_PAGESIZE);
+    uint8_t *start = j->code + j->used / page * page;
+    size_t span = j->code + j->used + len - start;
+    if(mprotect(start, span, PROT_READ | PROT_WRITE) != 0)
+        return;
+    memcpy(j->code + j->used, buf, len);
+    // The first page may already hold the code of other blocks, which
+    // could not run from it any more.
+    if(mprotect(start, span, PROT_READ | PROT_EXEC) != 0){
+        fprintf(stderr, "Failed to make JIT code executable\n");
+        exit(1);
+    }
+    b->native = (block_native)(j->code + j->used);
+    j->used = (j->used + len + 15) & ~(size_t)15;
+}
+
+#else
+
+void jit_compile(struct jit *j, const struct cpu *c, struct block *b){
+}
+
+#endif
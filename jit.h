@@ -0,0 +1,30 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+
+#include "cpu.h"
+#include "block.h"
+
+#define JIT_CODE_SIZE (4 << 20)
+
+// Native code for the blocks that ran at least hot times, in one
+// executable (and otherwise read-only) buffer that is emptied whenever
+// the blocks are flushed.
+// Blocks compiled once the buffer is full stay interpreted.
+struct jit {
+    uint8_t *code;
+    size_t size;
+    size_t used;
+    int hot;
+};
+
+// NULL if the buffer cannot be mapped.
+struct jit *jit_new(int hot);
+void jit_free(struct jit *j);
+void jit_reset(struct jit *j);
+// Set b->native to the translation of b to x86-64 code, which runs the
+// block exactly as its ops would. Does nothing on other hosts.
+void jit_compile(struct jit *j, const struct cpu *c, struct block *b);
+
+#endif
@@ -0,0 +1,339 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "lanes.h"
+
+// Build with e.g. -mavx2 to use 256-bit instructions; the default x86-64
+// target splits each vector into two SSE2 halves.
+
+#define BCAST(x) ((lane_t){} + (uint16_t)(x))
+#define ALL (~(lane_mask_t){})
+
+static inline lane_t sel(lane_mask_t m, lane_t a, lane_t b){
+    return (a & (lane_t)m) | (b & ~(lane_t)m);
+}
+
+static inline lane_t bit(lane_mask_t m){
+    return (lane_t)m & 1;
+}
+
+static inline int any(lane_mask_t m){
+    uint64_t w[sizeof(m) / 8];
+    memcpy(w, &m, sizeof(m));
+    uint64_t r = 0;
+    for(int i=0;i<sizeof(m) / 8;i++) r |= w[i];
+    return r != 0;
+}
+
+static inline uint16_t hmin(lane_t v){
+    // log2(LANES) rounds of pairwise minimum.
+    lane_t t;
+    t = __builtin_shuffle(v, (lane_t){8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7});
+    v = sel(t < v, t, v);
+    t = __builtin_shuffle(v, (lane_t){4,5,6,7,0,1,2,3,12,13,14,15,8,9,10,11});
+    v = sel(t < v, t, v);
+    t = __builtin_shuffle(v, (lane_t){2,3,0,1,6,7,4,5,10,11,8,9,14,15,12,13});
+    v = sel(t < v, t, v);
+    t = __builtin_shuffle(v, (lane_t){1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14});
+    v = sel(t < v, t, v);
+    return v[0];
+}
+
+static inline lane_t flag_sign_v(lane_t res){
+    return res >> 15;
+}
+
+static inline lane_t flag_overflow_v(lane_t s1, lane_t s2, lane_t res){
+    return (~(s1^s2) & (s2^res)) >> 15;
+}
+
+static inline void set_flags(struct cpu_lanes *L, lane_mask_t m, lane_t s, lane_t z, lane_t c, lane_t v){
+    L->flag_sign = sel(m, s, L->flag_sign);
+    L->flag_zero = sel(m, z, L->flag_zero);
+    L->flag_carry = sel(m, c, L->flag_carry);
+    L->flag_overflow = sel(m, v, L->flag_overflow);
+}
+
+// Flags of imm+base address computations and of add: carry is set when the
+// 16-bit sum does NOT wrap, as in inst.c.
+static inline void set_add_flags(struct cpu_lanes *L, lane_mask_t m, lane_t s1, lane_t s2, lane_t res, lane_mask_t carry){
+    set_flags(L, m, flag_sign_v(res), bit(res == 0), bit(carry), flag_overflow_v(s1, s2, res));
+}
+
+static inline void reg_write(struct cpu_lanes *L, lane_mask_t m, uint8_t rd, lane_t val){
+    L->reg[rd] = sel(m, val, L->reg[rd]);
+}
+
+static inline void pc_add(struct cpu_lanes *L, lane_mask_t m, lane_t offset){
+    L->pc = sel(m, L->pc + offset, L->pc);
+}
+
+static inline uint8_t mem_read_b(struct cpu_lanes *L, int l, uint16_t addr){
+    return L->data_ram[l][addr & L->base.ram_mask];
+}
+
+static inline uint16_t mem_read_w(struct cpu_lanes *L, int l, uint16_t addr){
+    uint16_t mask = L->base.ram_mask;
+    return L->data_ram[l][addr & mask] + (L->data_ram[l][(addr+1) & mask]<<8);
+}
+
+static inline void mem_write_w(struct cpu_lanes *L, int l, uint16_t addr, uint16_t data){
+    uint16_t mask = L->base.ram_mask;
+    L->data_ram[l][addr & mask] = data&0xFF;
+    L->data_ram[l][(addr+1) & mask] = data>>8;
+}
+
+static inline void mem_write_b(struct cpu_lanes *L, int l, uint16_t addr, uint8_t data){
+    L->data_ram[l][addr & L->base.ram_mask] = data;
+}
+
+// Execute op on the lanes in m, which all have the same PC. Returns the
+// lanes that halted on it, with the same rules as inst.c.
+static inline __attribute__((always_inline)) lane_mask_t lanes_step(struct cpu_lanes *L, lane_mask_t m, const struct inst_op *op){
+    lane_t imm = BCAST(op->imm), zero = BCAST(0), pc = L->pc;
+    lane_t s, d, res;
+    lane_mask_t stuck = (lane_mask_t){};
+
+    switch(op->id){
+    case INST_LW: case INST_LBU: case INST_LB: case INST_LWSP:
+        s = op->id == INST_LWSP ? L->reg[1] : L->reg[op->rs];
+        res = imm + s;
+        set_add_flags(L, m, imm, s, res, ALL);
+        d = L->reg[op->rd];
+        for(int l=0;l<L->nlanes;l++){
+            if(!m[l]) continue;
+            if(op->id == INST_LW || op->id == INST_LWSP)
+                d[l] = mem_read_w(L, l, res[l]);
+            else if(op->id == INST_LBU)
+                d[l] = mem_read_b(L, l, res[l]);
+            else
+                d[l] = (int8_t)mem_read_b(L, l, res[l]);
+        }
+        L->reg[op->rd] = d;
+        pc_add(L, m, BCAST(op->len));
+        break;
+
+    case INST_SW: case INST_SB: case INST_SWSP:
+        d = op->id == INST_SWSP ? L->reg[1] : L->reg[op->rd];
+        res = imm + d;
+        set_add_flags(L, m, imm, d, res, ALL);
+        s = L->reg[op->rs];
+        for(int l=0;l<L->nlanes;l++){
+            if(!m[l]) continue;
+            if(op->id == INST_SB)
+                mem_write_b(L, l, res[l], s[l]&0xFF);
+            else
+                mem_write_w(L, l, res[l], s[l]);
+        }
+        pc_add(L, m, BCAST(op->len));
+        break;
+
+    case INST_MOV: case INST_LI:
+        s = op->id == INST_LI ? imm : L->reg[op->rs];
+        reg_write(L, m, op->rd, s);
+        set_flags(L, m, flag_sign_v(s), bit(s == 0), zero, zero);
+        pc_add(L, m, BCAST(op->len));
+        break;
+
+    case INST_ADD: case INST_ADDI:
+        s = op->id == INST_ADDI ? imm : L->reg[op->rs];
+        d = L->reg[op->rd];
+        res = s + d;
+        set_add_flags(L, m, s, d, res, res >= s);
+        reg_write(L, m, op->rd, res);
+        pc_add(L, m, BCAST(2));
+        break;
+
+    case INST_SUB: case INST_CMP: case INST_CMPI:
+        s = -(op->id == INST_CMPI ? imm : L->reg[op->rs]);
+        d = L->reg[op->rd];
+        res = s + d;
+        set_add_flags(L, m, s, d, res, (res >= s) & (s != 0));
+        if(op->id == INST_SUB)
+            reg_write(L, m, op->rd, res);
+        pc_add(L, m, BCAST(2));
+        break;
+
+    case INST_AND: case INST_OR: case INST_XOR:
+        s = L->reg[op->rs];
+        d = L->reg[op->rd];
+        res = op->id == INST_AND ? s & d : op->id == INST_OR ? s | d : s ^ d;
+        reg_write(L, m, op->rd, res);
+        set_flags(L, m, flag_sign_v(res), bit(res == 0), zero, flag_overflow_v(s, d, res));
+        pc_add(L, m, BCAST(2));
+        break;
+
+    case INST_LSL: case INST_LSR: case INST_ASR:
+        // Shift counts may exceed 15, so shift lane by lane exactly as inst.c.
+        s = L->reg[op->rs];
+        d = L->reg[op->rd];
+        for(int l=0;l<LANES;l++){
+            uint16_t s_data = s[l], d_data = d[l];
+            res[l] = op->id == INST_LSL ? (uint16_t)(d_data << s_data) :
+                     op->id == INST_LSR ? (uint16_t)(d_data >> s_data) :
+                                          (uint16_t)(((int16_t)d_data) >> s_data);
+        }
+        reg_write(L, m, op->rd, res);
+        set_flags(L, m, flag_sign_v(res), bit(res == 0), zero, flag_overflow_v(s, d, res));
+        pc_add(L, m, BCAST(2));
+        break;
+
+    case INST_J: case INST_JAL:
+        if(op->id == INST_JAL)
+            reg_write(L, m, 0, L->pc + 4);
+        set_flags(L, m, zero, zero, zero, zero);
+        pc_add(L, m, BCAST(2 + op->imm));
+        stuck = m & (L->pc == pc);
+        break;
+
+    case INST_JALR: case INST_JR:
+        // JALR reads rs after writing x0, as in inst.c.
+        if(op->id == INST_JALR)
+            reg_write(L, m, 0, L->pc + 2);
+        s = L->reg[op->rs];
+        set_flags(L, m, zero, zero, zero, zero);
+        L->pc = sel(m, s, L->pc);
+        stuck = m & (L->pc == pc);
+        break;
+
+    case INST_JL: case INST_JLE: case INST_JE: case INST_JNE: case INST_JB: case INST_JBE: {
+        lane_mask_t taken;
+        switch(op->id){
+        case INST_JL:  taken = L->flag_sign != L->flag_overflow; break;
+        case INST_JLE: taken = (L->flag_sign != L->flag_overflow) | (L->flag_zero == 1); break;
+        case INST_JE:  taken = L->flag_zero == 1; break;
+        case INST_JNE: taken = L->flag_zero == 0; break;
+        case INST_JB:  taken = L->flag_carry == 1; break;
+        default:       taken = (L->flag_carry == 1) | (L->flag_zero == 1); break;
+        }
+        pc_add(L, m, sel(taken, imm, BCAST(2)));
+        set_flags(L, m, zero, zero, zero, zero);
+        if(op->id == INST_JNE)
+            stuck = m & (L->pc == pc);
+        break;
+    }
+
+    case INST_NOP:
+        set_flags(L, m, zero, zero, zero, zero);
+        pc_add(L, m, BCAST(2));
+        break;
+
+    default: // undefined: nothing happens
+        stuck = m;
+        break;
+    }
+    return stuck;
+}
+
+void lanes_init(struct cpu_lanes *L, const struct cpu *base, int nlanes){
+    assert(nlanes <= LANES);
+    L->base = *base;
+    L->base.blocks = NULL;  // the lanes only share base's icache
+    L->base.jit = NULL;
+    L->base.dbg = NULL;     // breakpoints and watchpoints are not supported
+    flags_eval(&L->base);
+    L->nlanes = nlanes;
+    for(int i=0;i<16;i++)
+        L->reg[i] = BCAST(base->reg[i]);
+    L->pc = BCAST(base->pc);
+    L->flag_sign = BCAST(L->base.flag_sign);
+    L->flag_overflow = BCAST(L->base.flag_overflow);
+    L->flag_zero = BCAST(L->base.flag_zero);
+    L->flag_carry = BCAST(L->base.flag_carry);
+    uint8_t *ram = malloc((size_t)LANES * base->ram_size);
+    for(int l=0;l<LANES;l++){
+        L->data_ram[l] = ram + (size_t)l * base->ram_size;
+        memcpy(L->data_ram[l], base->data_ram, base->ram_size);
+    }
+}
+
+void lanes_free(struct cpu_lanes *L){
+    free(L->data_ram[0]);
+}
+
+// Stop the lanes in h at the current cycle of a chunk whose remaining
+// cycles per lane are in left.
+static void lanes_halt(struct cpu_lanes *L, lane_mask_t h, lane_t *left, uint16_t chunk, enum cpu_halt why){
+    for(int l=0;l<L->nlanes;l++){
+        if(!h[l]) continue;
+        L->cycles[l] += chunk - (*left)[l];
+        L->halt[l] = why;
+        (*left)[l] = 0;
+    }
+}
+
+// Run up to n steps while every lane in care is at the same PC, so that no
+// masking is needed. Returns the number of steps executed and, in stuck,
+// the lanes that halted on the last of them.
+static long lanes_run_converged(struct cpu_lanes *L, long n, lane_mask_t care, lane_mask_t *stuck){
+    for(long i=0;i<n;i++){
+        L->base.pc = L->pc[0];
+        const struct inst_op *op = inst_fetch(&L->base, inst_list);
+        if(op->id == INST_HALT)
+            return i;
+        *stuck = lanes_step(L, ALL, op) & care;
+
+        // Only jumps and undefined instructions can make lanes halt or
+        // diverge, so skip the checks for the rest.
+        if((op->id >= INST_J && op->id <= INST_JBE) || op->id == INST_UNDEF){
+            if(any(*stuck) || any(care & (L->pc != BCAST(L->pc[0]))))
+                return i+1;
+        }
+    }
+    return n;
+}
+
+void lanes_run(struct cpu_lanes *L, long ncycles){
+    lane_mask_t valid;
+    for(int l=0;l<LANES;l++){
+        valid[l] = l < L->nlanes ? -1 : 0;
+        L->cycles[l] = 0;
+        L->halt[l] = HALT_NONE;
+    }
+
+    // Lanes drift apart once they diverge, so count each lane's remaining
+    // cycles, in chunks that fit a 16-bit lane.
+    while(ncycles > 0){
+        uint16_t chunk = ncycles > 0xFFFF ? 0xFFFF : ncycles;
+        lane_t left = BCAST(0);
+        for(int l=0;l<L->nlanes;l++)
+            left[l] = L->halt[l] == HALT_NONE ? chunk : 0;
+        ncycles -= chunk;
+
+        for(;;){
+            lane_mask_t active = left != 0;
+            if(!any(active)) break;
+
+            // Run the lanes at the lowest PC so that diverged lanes tend
+            // to meet again at join points.
+            uint16_t pc = hmin(sel(active, L->pc, BCAST(0xFFFF)));
+            lane_mask_t m = active & (L->pc == BCAST(pc)), stuck = (lane_mask_t){};
+
+            L->base.pc = pc;
+            const struct inst_op *op = inst_fetch(&L->base, inst_list);
+            if(op->id == INST_HALT){
+                lanes_halt(L, m, &left, chunk, HALT_PC);
+            }
+            // Lanes past nlanes may be clobbered, finished lanes may not.
+            else if(!any(~(m | ~valid))){
+                long n = lanes_run_converged(L, hmin(sel(active, left, BCAST(0xFFFF))), valid, &stuck);
+                left -= BCAST(n) & (lane_t)active;
+                lanes_halt(L, stuck, &left, chunk, HALT_LOOP);
+            }
+            else {
+                stuck = lanes_step(L, m, op);
+                left -= bit(m);
+                lanes_halt(L, stuck, &left, chunk, HALT_LOOP);
+            }
+        }
+
+        for(int l=0;l<L->nlanes;l++)
+            if(L->halt[l] == HALT_NONE)
+                L->cycles[l] += chunk;
+    }
+}
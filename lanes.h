@@ -0,0 +1,42 @@
+#ifndef LANES_H
+#define LANES_H
+
+#include <stdint.h>
+
+// Lane-parallel execution of one program on LANES different RAM images.
+// Registers, flags and PCs are laid out lane-wise in vectors; each step
+// executes one instruction for every lane whose PC matches, which is all
+// of them as long as control flow does not diverge.
+#define LANES 16
+
+// The alignment is explicit since the default one depends on -mavx.
+typedef uint16_t lane_t __attribute__((vector_size(LANES * 2), aligned(LANES * 2)));
+typedef int16_t lane_mask_t __attribute__((vector_size(LANES * 2), aligned(LANES * 2)));
+
+struct cpu_lanes {
+    lane_t reg[16];
+    lane_t pc;
+    lane_t flag_sign;
+    lane_t flag_overflow;
+    lane_t flag_zero;
+    lane_t flag_carry;
+    int nlanes;
+
+    // Cycles executed by each lane, which stops on its own when it halts
+    // as a struct cpu would (see enum cpu_halt).
+    long cycles[LANES];
+    uint8_t halt[LANES];
+
+    // Holds the shared ROM and its predecoded ops.
+    struct cpu base;
+    uint8_t *data_ram[LANES];
+};
+
+// Start nlanes (<= LANES) lanes from the state of base, RAM included.
+// The RAM of the lanes is allocated here and released by lanes_free().
+void lanes_init(struct cpu_lanes *L, const struct cpu *base, int nlanes);
+void lanes_free(struct cpu_lanes *L);
+// Execute up to ncycles instructions on every lane.
+void lanes_run(struct cpu_lanes *L, long ncycles);
+
+#endif
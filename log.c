@@ -1,14 +1,31 @@
-#include "error.h"
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
 
-int flag_quiet = 0;
+#include "cpu.h"
+#include "log.h"
 
-void log_printf(char *fmt, ...) {
-    if (flag_quiet) return;
+void log_printf(struct cpu *c, char *fmt, ...) {
+    if (c->log == NULL) return;
 
     va_list args;
     va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
+    vfprintf(c->log, fmt, args);
     va_end(args);
 }
+
+void print_regs(FILE *fh, const uint16_t *reg)
+{
+    for (int i = 0; i < 16; i++)
+        fprintf(fh, "x%d=%d\t", i, reg[i]);
+    fprintf(fh, "\n");
+}
+
+void print_cycles(FILE *fh, long cycles, int halt)
+{
+    static const char * const why[] = {
+        [HALT_NONE] = "", [HALT_LOOP] = " (halted)", [HALT_PC] = " (halt PC)",
+        [HALT_BREAK] = " (breakpoint)", [HALT_WATCH] = " (watchpoint)",
+    };
+    fprintf(fh, "cycles=%ld%s\n", cycles, why[halt]);
+}
@@ -1,7 +1,17 @@
 #pragma once
-#ifndef ERROR_H
-#define ERROR_H
+#ifndef LOG_H
+#define LOG_H
 
-void log_printf(char *fmt, ...);
+#include <stdio.h>
+#include <stdint.h>
+
+struct cpu;
+
+// Print to c->log, unless it is NULL (-q).
+void log_printf(struct cpu *c, char *fmt, ...);
+// The registers and the cycle count as main prints them at exit, the
+// latter with why the CPU halted (enum cpu_halt).
+void print_regs(FILE *fh, const uint16_t *reg);
+void print_cycles(FILE *fh, long cycles, int halt);
 
 #endif
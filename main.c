@@ -7,22 +7,48 @@
 #include "log.h"
 #include "cpu.h"
 #include "elf_parser.h"
-#include "bitpat.h"
 #include "inst.h"
+#include "decode.h"
+#include "lanes.h"
+#include "bitslice.h"
+#include "snapshot.h"
+#include "jit.h"
+#include "profile.h"
+#include "cost.h"
+#include "debug.h"
+#include "gdbstub.h"
+#include "memdelta.h"
 
 #include <getopt.h>
 #include <unistd.h>
 
-extern int flag_quiet;
-
 void print_usage(FILE *fh)
 {
-    fprintf(fh, "Usage: rv16k-sim [-q] [-m] [-t ROM] [-d RAM] [FILENAME] NCYCLES\n");
+    fprintf(fh, "Usage: rv16k-sim [-q] [-m] [-F] [-u DELTA] [-U N] [-b TRACE] [-r TRACE] [-p FORMAT] [-c COSTS] [-j N] [-H PC] [-B PC] [-W ADDR] [-g PORT] [-R SIZE] [-M SIZE] [-l SNAP] [-s SNAP] [-S N] [-t ROM] [-d RAM] [-D RAMS] [-X RAMS] [FILENAME] NCYCLES\n");
     fprintf(fh, "Options:\n");
-    fprintf(fh, "  -q     : No log print\n");
-    fprintf(fh, "  -m     : Dump memory\n");
-    fprintf(fh, "  -t ROM : Initial ROM data\n");
-    fprintf(fh, "  -d RAM : Initial RAM data\n");
+    fprintf(fh, "  -q       : No log print\n");
+    fprintf(fh, "  -m       : Dump memory\n");
+    fprintf(fh, "  -F       : Dump memory once at exit\n");
+    fprintf(fh, "  -u DELTA : Write the RAM bytes changed every cycle to DELTA\n");
+    fprintf(fh, "  -U N     : With -u, every N cycles instead\n");
+    fprintf(fh, "  -b TRACE : Write binary trace to TRACE instead of the log\n");
+    fprintf(fh, "  -r TRACE : Stop at the first divergence from binary trace TRACE\n");
+    fprintf(fh, "  -p FORMAT: Print execution counts at exit, as a table or json\n");
+    fprintf(fh, "  -c COSTS : Project the gates and time of an encrypted run, see cost.h\n");
+    fprintf(fh, "  -j N     : Compile blocks to native code once they ran N times\n");
+    fprintf(fh, "  -H PC    : Stop when reaching PC\n");
+    fprintf(fh, "  -B PC    : Stop at breakpoint PC (repeatable)\n");
+    fprintf(fh, "  -W ADDR  : Stop after a write to RAM address ADDR (repeatable)\n");
+    fprintf(fh, "  -g PORT  : Wait for gdb on local TCP port PORT, or on stdio for -\n");
+    fprintf(fh, "  -R SIZE  : ROM size in bytes, a power of 2 up to 64K (default: %d)\n", INST_ROM_SIZE);
+    fprintf(fh, "  -M SIZE  : RAM size in bytes, a power of 2 up to 64K (default: %d)\n", DATA_RAM_SIZE);
+    fprintf(fh, "  -l SNAP  : Resume from snapshot SNAP instead of loading a program\n");
+    fprintf(fh, "  -s SNAP  : Write a snapshot to SNAP at exit\n");
+    fprintf(fh, "  -S N     : With -s, also write SNAP.CYCLE every N cycles\n");
+    fprintf(fh, "  -t ROM   : Initial ROM data\n");
+    fprintf(fh, "  -d RAM   : Initial RAM data\n");
+    fprintf(fh, "  -D RAMS  : Run once per line of RAMS (initial RAM data), %d at a time\n", LANES);
+    fprintf(fh, "  -X RAMS  : Like -D, bit-sliced %d at a time, and count the gates\n", SLICES);
 }
 
 _Noreturn void print_usage_to_exit(void)
@@ -31,60 +57,129 @@ _Noreturn void print_usage_to_exit(void)
     exit(1);
 }
 
-void print_flags(struct cpu *c){
-    log_printf("FLAGS(SZCV) <= %d%d%d%d ", c->flag_sign, c->flag_zero, c->flag_carry, c->flag_overflow);
+void dump_memory(FILE *fh, uint8_t *mem, int size)
+{
+    for (int i = 0; i < size; i++) {
+        fprintf(fh, "%02x ", mem[i]);
+        if (i % 16 == 15)   fprintf(fh, "\n");
+    }
 }
 
-void init_cpu(struct cpu *c){
-    for(int i=0;i<16;i++){
-        c->reg[i] = 0;
-    }
-    for(int i=0;i<INST_ROM_SIZE;i++){
-        c->inst_rom[i] = 0;
-    }
-    for(int i=0;i<DATA_RAM_SIZE;i++){
-        c->data_ram[i] = 0;
+// Run the program in base once per line of file_name, each line being
+// applied to base's RAM as with -d, and print the registers of each run.
+void run_lanes(const struct cpu *base, const char *file_name, int ncycles)
+{
+    FILE *fp;
+    if ((fp = fopen(file_name, "r")) == NULL) {
+        fprintf(stderr, "Failed to open file :%s\n", file_name);
+        exit(1);
     }
-    c->pc = 0;
 
-    c->flag_sign = 0;
-    c->flag_overflow = 0;
-    c->flag_zero = 0;
-    c->flag_carry = 0;
+    struct cpu_lanes *L = aligned_alloc(_Alignof(struct cpu_lanes), sizeof(struct cpu_lanes));
+    char *lines[LANES] = {NULL};
+    size_t sizes[LANES] = {0};
+    int nlanes;
+    do {
+        for (nlanes = 0; nlanes < LANES; nlanes++) {
+            if (getline(&lines[nlanes], &sizes[nlanes], fp) == -1) break;
+            lines[nlanes][strcspn(lines[nlanes], "\n")] = '\0';
+        }
+        if (nlanes == 0) break;
+
+        lanes_init(L, base, nlanes);
+        for (int l = 0; l < nlanes; l++)
+            set_bytes_from_str(L->data_ram[l], lines[l], base->ram_size);
+        lanes_run(L, ncycles);
+
+        for (int l = 0; l < nlanes; l++) {
+            uint16_t reg[16];
+            for (int i = 0; i < 16; i++)
+                reg[i] = L->reg[i][l];
+            print_regs(stdout, reg);
+            print_cycles(stdout, L->cycles[l], L->halt[l]);
+        }
+        lanes_free(L);
+    } while (nlanes == LANES);
+
+    for (int l = 0; l < LANES; l++)
+        free(lines[l]);
+    free(L);
+    fclose(fp);
 }
 
-void set_bytes_from_str(uint8_t *dst, const char * const src, int N)
+// The same as run_lanes() on the bit-sliced engine, also printing the
+// gates evaluated for each run.
+void run_slices(const struct cpu *base, const char *file_name, int ncycles)
 {
-    char *buf = (char *)malloc(strlen(src) + 1);
-    strcpy(buf, src);
-
-    int idst = 0;
-    char *tp;
-    tp = strtok(buf, " ");
-    while (tp != NULL) {
-        assert(idst < N && "Too large data!");
-        uint8_t val = strtol(tp, NULL, 16);
-        dst[idst++] = val;
-        tp = strtok(NULL, " ");
+    FILE *fp;
+    if ((fp = fopen(file_name, "r")) == NULL) {
+        fprintf(stderr, "Failed to open file :%s\n", file_name);
+        exit(1);
     }
 
-    free(buf);
+    struct cpu_slices *S = aligned_alloc(_Alignof(struct cpu_slices), sizeof(struct cpu_slices));
+    uint8_t *ram = malloc(base->ram_size);
+    char *line = NULL;
+    size_t size = 0;
+    int nlanes;
+    do {
+        slices_init(S, base, SLICES);
+        for (nlanes = 0; nlanes < SLICES; nlanes++) {
+            if (getline(&line, &size, fp) == -1) break;
+            line[strcspn(line, "\n")] = '\0';
+            memcpy(ram, base->data_ram, base->ram_size);
+            set_bytes_from_str(ram, line, base->ram_size);
+            slices_write_ram(S, nlanes, ram);
+        }
+        if (nlanes > 0) {
+            S->nlanes = nlanes;
+            slices_run(S, ncycles);
+        }
+
+        for (int l = 0; l < nlanes; l++) {
+            uint16_t reg[16];
+            slices_read_regs(S, l, reg);
+            print_regs(stdout, reg);
+            print_cycles(stdout, S->cycles[l], S->halt[l]);
+            printf("gates=%llu mux=%llu\n", (unsigned long long)S->gates[l],
+                   (unsigned long long)S->muxes[l]);
+        }
+        slices_free(S);
+    } while (nlanes == SLICES);
+
+    free(line);
+    free(ram);
+    free(S);
+    fclose(fp);
 }
 
-void dump_memory(FILE *fh, uint8_t *mem, int size)
+int parse_mem_size_or_exit(const char *s)
 {
-    for (int i = 0; i < size; i++) {
-        fprintf(fh, "%02x ", mem[i]);
-        if (i % 16 == 15)   fprintf(fh, "\n");
+    int size = parse_mem_size(s);
+    if (size < 0) {
+        fprintf(stderr, "Invalid memory size :%s\n", s);
+        exit(1);
     }
+    return size;
 }
 
 int main(int argc, char *argv[]){
     struct cpu cpu;
-    init_cpu(&cpu);
 
-    int flag_load_elf = 1, flag_memory_dump = 0, opt;
-    while((opt = getopt(argc, argv, "qmt:d:")) != -1) {
+    // The memories are allocated once their sizes are known, so keep
+    // what goes into them until then.
+    int flag_quiet = 0, flag_load_elf = 1, flag_memory_dump = 0, flag_final_dump = 0, opt;
+    int rom_size = INST_ROM_SIZE, ram_size = DATA_RAM_SIZE, halt_pc = -1, jit_hot = 0;
+    char *lanes_file = NULL, *slices_file = NULL, *rom = NULL, *ram = NULL;
+    char *snap_in = NULL, *snap_out = NULL, *prof_format = NULL, *gdb_port = NULL;
+    char *delta_out = NULL;
+    long snap_every = 0, delta_every = 1;
+    struct trace_writer *trace_out = NULL;
+    struct trace_checker *trace_ref = NULL;
+    struct cost_table *costs = NULL;
+    // -B and -W addresses, with bit 16 set for -W.
+    int *points = NULL, npoints = 0;
+    while((opt = getopt(argc, argv, "qmFu:U:b:r:p:c:j:H:B:W:g:R:M:l:s:S:t:d:D:X:")) != -1) {
         switch(opt) {
             case 'q':
                 flag_quiet = 1;
@@ -94,14 +189,92 @@ int main(int argc, char *argv[]){
                 flag_memory_dump = 1;
                 break;
 
+            case 'F':
+                flag_final_dump = 1;
+                break;
+
+            case 'u':
+                delta_out = optarg;
+                break;
+
+            case 'U':
+                if ((delta_every = atol(optarg)) <= 0)
+                    print_usage_to_exit();
+                break;
+
+            case 'b':
+                trace_out = trace_open(optarg);
+                break;
+
+            case 'r':
+                trace_ref = trace_check_open(optarg);
+                break;
+
+            case 'p':
+                if (strcmp(optarg, "table") != 0 && strcmp(optarg, "json") != 0)
+                    print_usage_to_exit();
+                prof_format = optarg;
+                break;
+
+            case 'c':
+                costs = cost_load(optarg);
+                break;
+
+            case 'j':
+                jit_hot = atoi(optarg);
+                break;
+
+            case 'H':
+                halt_pc = strtol(optarg, NULL, 0);
+                break;
+
+            case 'B':
+            case 'W':
+                points = realloc(points, sizeof(int) * (npoints + 1));
+                points[npoints++] = (strtol(optarg, NULL, 0) & 0xFFFF) | (opt == 'W' ? 0x10000 : 0);
+                break;
+
+            case 'g':
+                gdb_port = optarg;
+                break;
+
+            case 'R':
+                rom_size = parse_mem_size_or_exit(optarg);
+                break;
+
+            case 'M':
+                ram_size = parse_mem_size_or_exit(optarg);
+                break;
+
+            case 'l':
+                flag_load_elf = 0;
+                snap_in = optarg;
+                break;
+
+            case 's':
+                snap_out = optarg;
+                break;
+
+            case 'S':
+                snap_every = atol(optarg);
+                break;
+
             case 't':
                 flag_load_elf = 0;
-                set_bytes_from_str(cpu.inst_rom, optarg, INST_ROM_SIZE);
+                rom = optarg;
                 break;
 
             case 'd':
                 flag_load_elf = 0;
-                set_bytes_from_str(cpu.data_ram, optarg, DATA_RAM_SIZE);
+                ram = optarg;
+                break;
+
+            case 'D':
+                lanes_file = optarg;
+                break;
+
+            case 'X':
+                slices_file = optarg;
                 break;
 
             default:
@@ -111,36 +284,151 @@ int main(int argc, char *argv[]){
 
     if (optind >= argc) print_usage_to_exit();
 
+    init_cpu(&cpu, rom_size, ram_size);
+    if (snap_in != NULL)
+        snapshot_load(&cpu, snap_in);
+    cpu.halt_pc = halt_pc;
+    if (jit_hot > 0 && (cpu.jit = jit_new(jit_hot)) == NULL) {
+        fprintf(stderr, "Failed to map JIT buffer\n");
+        exit(1);
+    }
+    if (prof_format != NULL || costs != NULL)
+        cpu.prof = profile_new(cpu.rom_size);
+    cpu.trace_out = trace_out;
+    cpu.trace_ref = trace_ref;
+    if (delta_out != NULL)
+        cpu.mem_delta = mem_delta_open(delta_out, cpu.ram_size, delta_every);
+    for (int i = 0; i < npoints; i++) {
+        if (points[i] & 0x10000)
+            debug_set_watch(&cpu, points[i] & 0xFFFF, 1);
+        else
+            debug_set_break(&cpu, points[i], 1);
+    }
+    free(points);
+    if (rom != NULL)
+        set_bytes_from_str(cpu.inst_rom, rom, cpu.rom_size);
+    if (ram != NULL)
+        set_bytes_from_str(cpu.data_ram, ram, cpu.ram_size);
+    if (!flag_quiet)
+        cpu.log = stderr;
+
     int iarg = optind;
-    if (flag_load_elf)
-        elf_parse(&cpu, argv[iarg++]);
+    // The function symbols name the rows of the cost report.
+    struct elf_image *img = NULL;
+    struct elf_symbol *funcs = NULL;
+    int nfuncs = 0;
+    if (flag_load_elf) {
+        img = elf_image_open(argv[iarg++]);
+        if (img == NULL || elf_image_load(img, &cpu) != 0)
+            exit(1);
+        if (costs != NULL)
+            funcs = elf_image_functions(img, &nfuncs);
+    }
 
     int ncycles = 0;
     if (iarg >= argc) print_usage_to_exit();
     ncycles = atoi(argv[iarg]);
 
-    for(int i=0;i<ncycles;i++){
-        uint16_t inst = rom_read_w(&cpu);
-        for(int idx=0;inst_list[idx].bit_pattern != NULL;idx++){
-            if(bitpat_match_s(inst, inst_list[idx].bit_pattern)){
-                inst_list[idx].func(&cpu, inst);
-                break;
-            }
+    decode_init();
+    uint16_t entry = cpu.pc;
+
+    if (lanes_file != NULL) {
+        run_lanes(&cpu, lanes_file, ncycles);
+        free_cpu(&cpu);
+        return 0;
+    }
+    if (slices_file != NULL) {
+        run_slices(&cpu, slices_file, ncycles);
+        free_cpu(&cpu);
+        return 0;
+    }
+
+    if (cpu.trace_out == NULL)
+        cpu.trace_log = cpu.log;
+
+    // Without any trace sink or watchpoint, run the variant with tracing
+    // compiled out.
+    int (*run)(struct cpu *, int) = cpu_traced(&cpu) ? cpu_run_trace : cpu_run;
+    // Run one cycle at a time to dump memory, or up to the next snapshot
+    // or RAM changes, and stop as soon as the CPU halts.
+    long cycles = 0;
+    if (gdb_port != NULL) {
+        if (strcmp(gdb_port, "-") == 0) {
+            cycles = gdb_serve(&cpu, 0, 1, ncycles);
+            // stdout was the connection.
+            dup2(2, 1);
+        }
+        else {
+            int fd = gdb_accept(atoi(gdb_port));
+            cycles = gdb_serve(&cpu, fd, fd, ncycles);
+            close(fd);
         }
-        print_flags(&cpu);
-        log_printf("\n");
+        ncycles = 0;    // all run by the debugger
+    }
+    while (cycles < ncycles) {
+        long n = ncycles - cycles;
+        if (flag_memory_dump)
+            n = 1;
+        if (snap_out != NULL && snap_every > 0 && snap_every - cpu.cycle % snap_every < n)
+            n = snap_every - cpu.cycle % snap_every;
+        if (cpu.mem_delta != NULL && delta_every - cpu.cycle % delta_every < n)
+            n = delta_every - cpu.cycle % delta_every;
 
-        if (flag_memory_dump){
-            dump_memory(stdout, cpu.data_ram, DATA_RAM_SIZE);
+        int done = run(&cpu, n);
+        cycles += done;
+        if (flag_memory_dump && done > 0) {
+            dump_memory(stdout, cpu.data_ram, cpu.ram_size);
             printf("\n");
         }
+        if (snap_out != NULL && snap_every > 0 && done > 0 && cpu.cycle % snap_every == 0) {
+            char name[strlen(snap_out) + 24];
+            sprintf(name, "%s.%llu", snap_out, (unsigned long long)cpu.cycle);
+            snapshot_save(&cpu, name);
+        }
+        if (cpu.mem_delta != NULL && done > 0 && cpu.cycle % delta_every == 0)
+            mem_delta_flush(cpu.mem_delta, &cpu);
+        if (done < n || cpu.halt != HALT_NONE)
+            break;
+        if (cpu.trace_ref != NULL && cpu.trace_ref->diverged)
+            break;
     }
+    if (snap_out != NULL)
+        snapshot_save(&cpu, snap_out);
 
-    for (int i = 0; i < 16; i++){
-        uint16_t val = reg_read(&cpu, i);
-        printf("x%d=%d\t", i, val);
+    int diverged = 0;
+    if (cpu.trace_out != NULL)
+        trace_close(cpu.trace_out);
+    if (cpu.mem_delta != NULL)
+        mem_delta_close(cpu.mem_delta, &cpu);
+    if (cpu.trace_ref != NULL) {
+        diverged = cpu.trace_ref->diverged;
+        trace_check_close(cpu.trace_ref);
+    }
+
+    print_regs(stdout, cpu.reg);
+    print_cycles(stdout, cycles, cpu.halt);
+    if (cpu.halt == HALT_WATCH)
+        printf("watch=0x%04x\n", cpu.dbg->hit_addr);
+    if (flag_final_dump) {
+        dump_memory(stdout, cpu.data_ram, cpu.ram_size);
+        printf("\n");
+    }
+    if (cpu.prof != NULL) {
+        if (prof_format != NULL && strcmp(prof_format, "json") == 0)
+            profile_print_json(stdout, cpu.prof);
+        else if (prof_format != NULL)
+            profile_print(stdout, cpu.prof);
+        if (costs != NULL) {
+            cost_print(stdout, costs, &cpu, cpu.prof, funcs, nfuncs, entry);
+            free(costs);
+        }
+        profile_free(cpu.prof);
     }
-    puts("");
+    free(funcs);
+    if (img != NULL)
+        elf_image_close(img);
+    debug_free(&cpu);
+    free_cpu(&cpu);
 
-    return 0;
+    return diverged;
 }
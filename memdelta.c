@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "memdelta.h"
+
+struct mem_delta *mem_delta_open(const char *file_name, int ram_size, long every){
+    struct mem_delta *d = calloc(1, sizeof(struct mem_delta));
+
+    if((d->fp = fopen(file_name, "w")) == NULL){
+        fprintf(stderr, "Failed to open file :%s\n", file_name);
+        exit(1);
+    }
+    d->every = every;
+    d->ram_size = ram_size;
+    return d;
+}
+
+static int is_dirty(const struct mem_delta *d, int addr){
+    return addr < d->ram_size && ((d->dirty[addr >> 6] >> (addr & 63)) & 1);
+}
+
+// Only the words of dirty[] flagged in dirty_words[] are visited.
+void mem_delta_flush(struct mem_delta *d, const struct cpu *c){
+    int any = 0;
+    for(int s=0;s<MEM_SIZE_MAX/64/64;s++){
+        while(d->dirty_words[s] != 0){
+            int w = s*64 + __builtin_ctzll(d->dirty_words[s]);
+            d->dirty_words[s] &= d->dirty_words[s] - 1;
+
+            while(d->dirty[w] != 0){
+                int addr = w*64 + __builtin_ctzll(d->dirty[w]);
+                if(!any)
+                    fprintf(d->fp, "@%llu", (unsigned long long)c->cycle);
+                any = 1;
+                // A run may go on into the next words, which are then
+                // cleared before being visited.
+                fprintf(d->fp, " %04x:", addr);
+                for(;is_dirty(d, addr);addr++){
+                    fprintf(d->fp, "%02x", c->data_ram[addr]);
+                    d->dirty[addr >> 6] &= ~((uint64_t)1 << (addr & 63));
+                }
+            }
+        }
+    }
+    if(any)
+        fprintf(d->fp, "\n");
+}
+
+void mem_delta_close(struct mem_delta *d, const struct cpu *c){
+    mem_delta_flush(d, c);
+    fclose(d->fp);
+    free(d);
+}
@@ -0,0 +1,43 @@
+#ifndef MEMDELTA_H
+#define MEMDELTA_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "trace.h"
+
+// RAM changes, written every `every` cycles in which any byte was written,
+// as one line per record:
+//   @CYCLE ADDR:BYTES ADDR:BYTES ...
+// with CYCLE the cycle count at the end of the interval, and a hex address
+// and hex bytes per run of written bytes, holding their values at that
+// point. Fed by cpu_run_trace() like the other trace sinks, which marks
+// the written bytes, one bit each; mem_delta_flush() writes the record.
+struct mem_delta {
+    FILE *fp;
+    long every;
+    int ram_size;
+    uint64_t dirty[MEM_SIZE_MAX / 64];
+    uint64_t dirty_words[MEM_SIZE_MAX / 64 / 64];   // words of dirty[] not 0
+};
+
+struct mem_delta *mem_delta_open(const char *file_name, int ram_size, long every);
+void mem_delta_flush(struct mem_delta *d, const struct cpu *c);
+// Flush and close.
+void mem_delta_close(struct mem_delta *d, const struct cpu *c);
+
+static inline void mem_delta_mark(struct mem_delta *d, uint16_t addr){
+    d->dirty[addr >> 6] |= (uint64_t)1 << (addr & 63);
+    d->dirty_words[addr >> 12] |= (uint64_t)1 << ((addr >> 6) & 63);
+}
+
+static inline void mem_delta_count(struct mem_delta *d, const struct trace_rec *r){
+    uint16_t mask = d->ram_size - 1;
+    if(r->bits & (TRACE_MEM_B | TRACE_MEM_W))
+        mem_delta_mark(d, r->mem_addr & mask);
+    if(r->bits & TRACE_MEM_W)
+        mem_delta_mark(d, (r->mem_addr + 1) & mask);
+}
+
+#endif
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "profile.h"
+
+struct profile *profile_new(int rom_size){
+    struct profile *p = calloc(1, sizeof(struct profile));
+    p->rom_size = rom_size;
+    p->last = INST_NUM;
+    p->pc_hits = calloc(rom_size, sizeof(uint64_t));
+    p->pc_taken = calloc(rom_size, sizeof(uint64_t));
+    p->pc_inst = calloc(rom_size, 1);
+    return p;
+}
+
+void profile_free(struct profile *p){
+    free(p->pc_hits);
+    free(p->pc_taken);
+    free(p->pc_inst);
+    free(p);
+}
+
+static const char *inst_name(int id){
+    return id == INST_UNDEF ? "UNDEF" : inst_list[id].name;
+}
+
+static int is_branch(int id){
+    return id >= INST_JL && id <= INST_JBE;
+}
+
+// The most frequent pairs, most frequent first, up to PROFILE_PAIRS.
+#define PROFILE_PAIRS 10
+static int top_pairs(const struct profile *p, int top[PROFILE_PAIRS]){
+    int n = 0;
+    for(int i=0;i<INST_NUM*INST_NUM;i++){
+        uint64_t count = p->pairs[i / INST_NUM][i % INST_NUM];
+        if(count == 0)
+            continue;
+        int k = n < PROFILE_PAIRS ? n++ : PROFILE_PAIRS;
+        for(;k > 0 && p->pairs[top[k-1] / INST_NUM][top[k-1] % INST_NUM] < count;k--)
+            if(k < PROFILE_PAIRS)
+                top[k] = top[k-1];
+        if(k < PROFILE_PAIRS)
+            top[k] = i;
+    }
+    return n;
+}
+
+void profile_print(FILE *fh, const struct profile *p){
+    fprintf(fh, "%-8s %12s %7s\n", "inst", "count", "share");
+    for(int id=0;id<INST_NUM;id++){
+        if(p->inst[id] == 0)
+            continue;
+        fprintf(fh, "%-8s %12llu %6.2f%%\n", inst_name(id), (unsigned long long)p->inst[id],
+                100.0 * p->inst[id] / p->cycles);
+    }
+    fprintf(fh, "%-8s %12llu\n", "total", (unsigned long long)p->cycles);
+    fprintf(fh, "%-8s %12llu\n", "loads", (unsigned long long)p->loads);
+    fprintf(fh, "%-8s %12llu\n", "stores", (unsigned long long)p->stores);
+
+    fprintf(fh, "\n%-8s %12s %12s\n", "branch", "taken", "not taken");
+    for(int id=INST_JL;id<=INST_JBE;id++){
+        if(p->inst[id] == 0)
+            continue;
+        fprintf(fh, "%-8s %12llu %12llu\n", inst_name(id), (unsigned long long)p->taken[id],
+                (unsigned long long)(p->inst[id] - p->taken[id]));
+    }
+
+    int top[PROFILE_PAIRS];
+    int npairs = top_pairs(p, top);
+    fprintf(fh, "\n%-17s %12s\n", "pair", "count");
+    for(int k=0;k<npairs;k++){
+        int a = top[k] / INST_NUM, b = top[k] % INST_NUM;
+        fprintf(fh, "%-8s %-8s %12llu\n", inst_name(a), inst_name(b), (unsigned long long)p->pairs[a][b]);
+    }
+
+    fprintf(fh, "\n%-6s %-8s %12s %12s\n", "pc", "inst", "hits", "taken");
+    for(int pc=0;pc<p->rom_size;pc++){
+        if(p->pc_hits[pc] == 0)
+            continue;
+        fprintf(fh, "0x%04X %-8s %12llu", pc, inst_name(p->pc_inst[pc]),
+                (unsigned long long)p->pc_hits[pc]);
+        if(is_branch(p->pc_inst[pc]))
+            fprintf(fh, " %12llu", (unsigned long long)p->pc_taken[pc]);
+        fprintf(fh, "\n");
+    }
+}
+
+void profile_print_json(FILE *fh, const struct profile *p){
+    const char *sep = "";
+    fprintf(fh, "{\"cycles\": %llu, \"loads\": %llu, \"stores\": %llu, \"inst\": {",
+            (unsigned long long)p->cycles, (unsigned long long)p->loads, (unsigned long long)p->stores);
+    for(int id=0;id<INST_NUM;id++){
+        if(p->inst[id] == 0)
+            continue;
+        fprintf(fh, "%s\"%s\": %llu", sep, inst_name(id), (unsigned long long)p->inst[id]);
+        sep = ", ";
+    }
+
+    fprintf(fh, "}, \"branches\": {");
+    sep = "";
+    for(int id=INST_JL;id<=INST_JBE;id++){
+        if(p->inst[id] == 0)
+            continue;
+        fprintf(fh, "%s\"%s\": {\"taken\": %llu, \"not_taken\": %llu}", sep, inst_name(id),
+                (unsigned long long)p->taken[id], (unsigned long long)(p->inst[id] - p->taken[id]));
+        sep = ", ";
+    }
+
+    fprintf(fh, "}, \"pairs\": [");
+    int top[PROFILE_PAIRS];
+    int npairs = top_pairs(p, top);
+    for(int k=0;k<npairs;k++){
+        int a = top[k] / INST_NUM, b = top[k] % INST_NUM;
+        fprintf(fh, "%s[\"%s\", \"%s\", %llu]", k ? ", " : "", inst_name(a), inst_name(b),
+                (unsigned long long)p->pairs[a][b]);
+    }
+
+    fprintf(fh, "], \"pc\": [");
+    sep = "";
+    for(int pc=0;pc<p->rom_size;pc++){
+        if(p->pc_hits[pc] == 0)
+            continue;
+        fprintf(fh, "%s{\"pc\": %d, \"inst\": \"%s\", \"hits\": %llu", sep, pc,
+                inst_name(p->pc_inst[pc]), (unsigned long long)p->pc_hits[pc]);
+        if(is_branch(p->pc_inst[pc]))
+            fprintf(fh, ", \"taken\": %llu", (unsigned long long)p->pc_taken[pc]);
+        fprintf(fh, "}");
+        sep = ", ";
+    }
+    fprintf(fh, "]}\n");
+}
@@ -0,0 +1,55 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "trace.h"
+
+// Execution counts, filled by cpu_run_trace() like the other trace sinks:
+// per instruction (inst_list[] index), per ROM address, taken conditional
+// branches, loads and stores, and per pair of instructions run in a row
+// (candidates for superinstructions, see block_exec()). A branch to the
+// next instruction counts as not taken.
+struct profile {
+    int rom_size;
+    uint64_t cycles;
+    uint64_t loads;
+    uint64_t stores;
+    uint64_t inst[INST_NUM];
+    uint64_t taken[INST_NUM];
+    uint64_t pairs[INST_NUM][INST_NUM];
+    uint8_t last;       // enum inst_id run last, INST_NUM before the first
+    uint64_t *pc_hits;
+    uint64_t *pc_taken;
+    uint8_t *pc_inst;   // enum inst_id last run at each address
+};
+
+struct profile *profile_new(int rom_size);
+void profile_free(struct profile *p);
+// Report as aligned tables, or as one JSON object.
+void profile_print(FILE *fh, const struct profile *p);
+void profile_print_json(FILE *fh, const struct profile *p);
+
+static inline void profile_count(struct profile *p, const struct inst_op *op, const struct trace_rec *r){
+    int pc = r->pc & (p->rom_size - 1);
+    p->cycles++;
+    p->inst[op->id]++;
+    if(p->last != INST_NUM)
+        p->pairs[p->last][op->id]++;
+    p->last = op->id;
+    p->pc_hits[pc]++;
+    p->pc_inst[pc] = op->id;
+    if(op->id >= INST_JL && op->id <= INST_JBE && r->pc_next != (uint16_t)(r->pc + 2)){
+        p->taken[op->id]++;
+        p->pc_taken[pc]++;
+    }
+    if(op->id == INST_LW || op->id == INST_LWSP || op->id == INST_LBU || op->id == INST_LB)
+        p->loads++;
+    else if(op->id == INST_SW || op->id == INST_SWSP || op->id == INST_SB)
+        p->stores++;
+}
+
+#endif
@@ -0,0 +1,170 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rv16k.h"
+#include "cpu.h"
+#include "inst.h"
+#include "decode.h"
+#include "elf_parser.h"
+#include "block.h"
+#include "jit.h"
+#include "debug.h"
+
+_Static_assert((int)RV16K_STOP_NONE == (int)HALT_NONE && (int)RV16K_STOP_LOOP == (int)HALT_LOOP
+               && (int)RV16K_STOP_PC == (int)HALT_PC && (int)RV16K_STOP_BREAK == (int)HALT_BREAK
+               && (int)RV16K_STOP_WATCH == (int)HALT_WATCH, "enum rv16k_stop does not match enum cpu_halt");
+
+struct rv16k {
+    struct cpu cpu;
+};
+
+// decode_table only ever holds the same values, but must be filled once
+// before any CPU runs.
+static pthread_once_t decode_once = PTHREAD_ONCE_INIT;
+
+struct rv16k *rv16k_new(int rom_size, int ram_size){
+    if(rom_size < 2 || rom_size > MEM_SIZE_MAX || (rom_size & (rom_size - 1)) != 0
+            || ram_size < 2 || ram_size > MEM_SIZE_MAX || (ram_size & (ram_size - 1)) != 0)
+        return NULL;
+
+    pthread_once(&decode_once, decode_init);
+    struct rv16k *s = malloc(sizeof(struct rv16k));
+    if(s == NULL)
+        return NULL;
+    init_cpu(&s->cpu, rom_size, ram_size);
+    return s;
+}
+
+void rv16k_free(struct rv16k *s){
+    debug_free(&s->cpu);
+    free_cpu(&s->cpu);
+    free(s);
+}
+
+struct rv16k *rv16k_fork(struct rv16k *s){
+    struct rv16k *f = malloc(sizeof(struct rv16k));
+    if(f == NULL)
+        return NULL;
+    if(cpu_fork(&f->cpu, &s->cpu) != 0){
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+void rv16k_reset(struct rv16k *s){
+    struct cpu *c = &s->cpu;
+    memset(c->reg, 0, sizeof(c->reg));
+    c->pc = 0;
+    c->cycle = 0;
+    c->flag_sign = 0;
+    c->flag_overflow = 0;
+    c->flag_zero = 0;
+    c->flag_carry = 0;
+    c->flags_kind = FLAGS_NONE;
+    c->halt = HALT_NONE;
+}
+
+int rv16k_set_jit(struct rv16k *s, int hot){
+    struct cpu *c = &s->cpu;
+    struct jit *j = NULL;
+    if(hot > 0 && (j = jit_new(hot)) == NULL)
+        return -1;
+    // Native code may still be reachable from the blocks.
+    block_flush(c);
+    jit_free(c->jit);
+    c->jit = j;
+    return 0;
+}
+
+int rv16k_load_elf(struct rv16k *s, const char *file_name){
+    struct elf_image *img = elf_image_open(file_name);
+    if(img == NULL)
+        return -1;
+    int ret = elf_image_load(img, &s->cpu);
+    elf_image_close(img);
+    return ret;
+}
+
+int rv16k_write_rom(struct rv16k *s, uint16_t addr, const void *data, size_t len){
+    struct cpu *c = &s->cpu;
+    if(addr + len > c->rom_size)
+        return -1;
+    memcpy(c->inst_rom + addr, data, len);
+    c->rom_dirty = 1;
+    icache_invalidate(c);
+    return 0;
+}
+
+int rv16k_write_ram(struct rv16k *s, uint16_t addr, const void *data, size_t len){
+    struct cpu *c = &s->cpu;
+    if(addr + len > c->ram_size)
+        return -1;
+    memcpy(c->data_ram + addr, data, len);
+    ram_touch(c, addr, len);
+    return 0;
+}
+
+int rv16k_read_ram(struct rv16k *s, uint16_t addr, void *data, size_t len){
+    struct cpu *c = &s->cpu;
+    if(addr + len > c->ram_size)
+        return -1;
+    memcpy(data, c->data_ram + addr, len);
+    return 0;
+}
+
+void rv16k_write_reg(struct rv16k *s, int i, uint16_t val){
+    s->cpu.reg[i & 15] = val;
+}
+
+void rv16k_set_break(struct rv16k *s, uint16_t pc, int on){
+    debug_set_break(&s->cpu, pc, on);
+}
+
+void rv16k_set_watch(struct rv16k *s, uint16_t addr, int on){
+    debug_set_watch(&s->cpu, addr, on);
+}
+
+// Only the trace variant checks watchpoints.
+static int run(struct cpu *c, int ncycles){
+    return cpu_traced(c) ? cpu_run_trace(c, ncycles) : cpu_run(c, ncycles);
+}
+
+// The halt PC is compiled into the icache, so only flush it on a change.
+static void set_halt_pc(struct cpu *c, int pc){
+    if(c->halt_pc != pc){
+        c->halt_pc = pc;
+        icache_invalidate(c);
+    }
+}
+
+int rv16k_step(struct rv16k *s){
+    return rv16k_run(s, 1);
+}
+
+int rv16k_run(struct rv16k *s, int ncycles){
+    set_halt_pc(&s->cpu, -1);
+    return run(&s->cpu, ncycles);
+}
+
+int rv16k_run_until(struct rv16k *s, uint16_t pc, int ncycles){
+    set_halt_pc(&s->cpu, pc);
+    return run(&s->cpu, ncycles);
+}
+
+void rv16k_read_state(struct rv16k *s, struct rv16k_state *st){
+    struct cpu *c = &s->cpu;
+    flags_eval(c);
+    memcpy(st->reg, c->reg, sizeof(st->reg));
+    st->pc = c->pc;
+    st->cycle = c->cycle;
+    st->flag_sign = c->flag_sign;
+    st->flag_overflow = c->flag_overflow;
+    st->flag_zero = c->flag_zero;
+    st->flag_carry = c->flag_carry;
+    st->stop = c->halt;
+    st->watch_addr = c->halt == HALT_WATCH ? c->dbg->hit_addr : 0;
+}
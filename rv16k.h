@@ -0,0 +1,84 @@
+#ifndef RV16K_H
+#define RV16K_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The simulator as a library (librv16k.a, librv16k.so), for running many
+// programs in one process. Each struct rv16k is a whole CPU with its own
+// memories and caches, and nothing else is shared between them but the
+// instruction decode table, built once on the first rv16k_new(): distinct
+// handles may be used from distinct threads.
+//
+// Functions that can fail return -1 (NULL for rv16k_new()) and leave the
+// CPU unchanged; nothing in the library exits the process, but for the
+// JIT failing to make its own code executable again mid-run.
+
+#define RV16K_API __attribute__((visibility("default")))
+
+struct rv16k;
+
+// Why the last run stopped before running all of its cycles.
+enum rv16k_stop {
+    RV16K_STOP_NONE,
+    RV16K_STOP_LOOP,    // the last instruction would change nothing if run again
+    RV16K_STOP_PC,      // reached the PC of rv16k_run_until(), not executed
+    RV16K_STOP_BREAK,   // reached a breakpoint, not executed
+    RV16K_STOP_WATCH,   // wrote to a watched RAM address (watch_addr)
+};
+
+struct rv16k_state {
+    uint16_t reg[16];
+    uint16_t pc;
+    uint64_t cycle;     // cycles executed since rv16k_new() or rv16k_reset()
+    uint8_t flag_sign;
+    uint8_t flag_overflow;
+    uint8_t flag_zero;
+    uint8_t flag_carry;
+    uint8_t stop;       // enum rv16k_stop
+    uint16_t watch_addr;
+};
+
+// Memory sizes are powers of two from 2 to 64K bytes; NULL otherwise.
+// Both memories start zeroed.
+RV16K_API struct rv16k *rv16k_new(int rom_size, int ram_size);
+RV16K_API void rv16k_free(struct rv16k *s);
+// A copy of s, memories included, without its breakpoints, watchpoints or
+// JIT. The two share the memory pages neither writes afterwards, so that
+// after a first fork, which takes time in the memory sizes, forking again
+// only costs the RAM pages s wrote in between.
+RV16K_API struct rv16k *rv16k_fork(struct rv16k *s);
+
+// Zero the registers, PC, flags and cycle count; the memories are kept.
+RV16K_API void rv16k_reset(struct rv16k *s);
+// Compile blocks to native code once they ran hot times, or stop doing
+// so if hot is 0. Fails if the code buffer cannot be mapped.
+RV16K_API int rv16k_set_jit(struct rv16k *s, int hot);
+
+// Load the PT_LOAD segments of an ELF file and jump to its entry point.
+// What is wrong with the file is printed to stderr.
+RV16K_API int rv16k_load_elf(struct rv16k *s, const char *file_name);
+// Copy len bytes to or from address addr, which must all be in memory.
+RV16K_API int rv16k_write_rom(struct rv16k *s, uint16_t addr, const void *data, size_t len);
+RV16K_API int rv16k_write_ram(struct rv16k *s, uint16_t addr, const void *data, size_t len);
+RV16K_API int rv16k_read_ram(struct rv16k *s, uint16_t addr, void *data, size_t len);
+RV16K_API void rv16k_write_reg(struct rv16k *s, int i, uint16_t val);
+
+// Set or clear a breakpoint on a ROM address, or a watchpoint on writes
+// to a RAM address. Breakpoints cost nothing until reached, but while any
+// watchpoint is set, runs go through the slower loop that checks them.
+// Resuming from a breakpoint runs the instruction it stopped before.
+RV16K_API void rv16k_set_break(struct rv16k *s, uint16_t pc, int on);
+RV16K_API void rv16k_set_watch(struct rv16k *s, uint16_t addr, int on);
+
+// Run at most ncycles, and return the number of cycles run, which is less
+// only if the CPU stopped (see rv16k_state.stop). rv16k_run_until() also
+// stops before executing the instruction at pc, including if it is the
+// current one.
+RV16K_API int rv16k_step(struct rv16k *s);
+RV16K_API int rv16k_run(struct rv16k *s, int ncycles);
+RV16K_API int rv16k_run_until(struct rv16k *s, uint16_t pc, int ncycles);
+
+RV16K_API void rv16k_read_state(struct rv16k *s, struct rv16k_state *st);
+
+#endif
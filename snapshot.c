@@ -0,0 +1,104 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "snapshot.h"
+
+static uint32_t align_up(uint32_t n){
+    return (n + SNAPSHOT_ALIGN - 1) & ~(uint32_t)(SNAPSHOT_ALIGN - 1);
+}
+
+static void write_padded(FILE *fp, const void *data, uint32_t size, const char *file_name){
+    static const uint8_t zero[SNAPSHOT_ALIGN];
+    uint32_t pad = align_up(size) - size;
+    if(fwrite(data, 1, size, fp) != size || fwrite(zero, 1, pad, fp) != pad){
+        fprintf(stderr, "Failed to write snapshot :%s\n", file_name);
+        exit(1);
+    }
+}
+
+void snapshot_save(struct cpu *c, const char *file_name){
+    struct snapshot_header h;
+    FILE *fp;
+
+    flags_eval(c);
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, 8);
+    h.cycle = c->cycle;
+    h.rom_size = c->rom_size;
+    h.ram_size = c->ram_size;
+    h.rom_offset = align_up(sizeof(h));
+    h.ram_offset = h.rom_offset + align_up(c->rom_size);
+    memcpy(h.reg, c->reg, sizeof(h.reg));
+    h.pc = c->pc;
+    h.flag_sign = c->flag_sign;
+    h.flag_overflow = c->flag_overflow;
+    h.flag_zero = c->flag_zero;
+    h.flag_carry = c->flag_carry;
+
+    if((fp = fopen(file_name, "wb")) == NULL){
+        fprintf(stderr, "Failed to open file :%s\n", file_name);
+        exit(1);
+    }
+    write_padded(fp, &h, sizeof(h), file_name);
+    write_padded(fp, c->inst_rom, c->rom_size, file_name);
+    write_padded(fp, c->data_ram, c->ram_size, file_name);
+    fclose(fp);
+}
+
+static int valid_size(uint32_t size){
+    return size >= 2 && size <= MEM_SIZE_MAX && (size & (size - 1)) == 0;
+}
+
+void snapshot_load(struct cpu *c, const char *file_name){
+    struct stat st;
+    int fd;
+
+    if((fd = open(file_name, O_RDONLY)) < 0 || fstat(fd, &st) != 0){
+        fprintf(stderr, "Failed to open file :%s\n", file_name);
+        exit(1);
+    }
+    uint8_t *map = NULL;
+    if(st.st_size >= sizeof(struct snapshot_header))
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    const struct snapshot_header *h = (const struct snapshot_header *)map;
+    if(map == NULL || map == MAP_FAILED || memcmp(h->magic, SNAPSHOT_MAGIC, 8) != 0
+            || !valid_size(h->rom_size) || !valid_size(h->ram_size)
+            || (uint64_t)h->rom_offset + h->rom_size > st.st_size
+            || (uint64_t)h->ram_offset + h->ram_size > st.st_size){
+        fprintf(stderr, "Not a snapshot :%s\n", file_name);
+        exit(1);
+    }
+
+    free_cpu(c);
+    c->map = map;
+    c->map_len = st.st_size;
+    c->inst_rom = map + h->rom_offset;
+    c->data_ram = map + h->ram_offset;
+    c->rom_size = h->rom_size;
+    c->ram_size = h->ram_size;
+    c->rom_mask = h->rom_size - 1;
+    c->ram_mask = h->ram_size - 1;
+    c->icache = malloc(sizeof(struct inst_op) * (c->rom_size/2));
+    icache_invalidate(c);
+    c->icache_list = NULL;
+
+    c->cycle = h->cycle;
+    memcpy(c->reg, h->reg, sizeof(c->reg));
+    c->pc = h->pc;
+    c->flag_sign = h->flag_sign;
+    c->flag_overflow = h->flag_overflow;
+    c->flag_zero = h->flag_zero;
+    c->flag_carry = h->flag_carry;
+    c->flags_kind = FLAGS_NONE;
+    c->halt = HALT_NONE;
+}
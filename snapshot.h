@@ -0,0 +1,35 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+// A snapshot file is this header followed by the ROM and the RAM, each
+// starting on a SNAPSHOT_ALIGN boundary so that the file can be mapped
+// and used in place. Fields are stored in host byte order.
+#define SNAPSHOT_MAGIC "RV16KSN1"
+#define SNAPSHOT_ALIGN 4096
+
+struct snapshot_header {
+    char magic[8];
+    uint64_t cycle;
+    uint32_t rom_size;
+    uint32_t ram_size;
+    uint32_t rom_offset;
+    uint32_t ram_offset;
+    uint16_t reg[16];
+    uint16_t pc;
+    uint8_t flag_sign;
+    uint8_t flag_overflow;
+    uint8_t flag_zero;
+    uint8_t flag_carry;
+};
+
+void snapshot_save(struct cpu *c, const char *file_name);
+// Replace the state and memories of c, which must have been set up by
+// init_cpu(), with those of the snapshot. The memories are a private
+// mapping of the file, so pages are only copied once written to.
+void snapshot_load(struct cpu *c, const char *file_name);
+
+#endif
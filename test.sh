@@ -12,10 +12,53 @@ failwith() {
     exit 1
 }
 
+manifest=$(mktemp)
+trap 'rm -f "$manifest"' EXIT
+
 testentry() {
+    # Collect every entry for the batch driver run at the end.
+    echo "$1; $2; $3; $4" >> "$manifest"
+
     res=$(./main -q -t "$2" -d "$3" "$1")
     echo "$res" | grep "$4" > /dev/null
     [ "$?" -eq 0 ] || failwith "$1" "$2" "$3" "$4" "$res"
+
+    # So must the JIT, compiling each block after its first run.
+    res_jit=$(./main -q -j 1 -t "$2" -d "$3" "$1")
+    [ "$res" == "$res_jit" ] || failwith "$1" "$2" "$3" "$4" "$res_jit"
+
+    # The logging variant of the core must end in the same state.
+    res_trace=$(./main -t "$2" -d "$3" "$1" 2> /dev/null)
+    [ "$res" == "$res_trace" ] || failwith "$1" "$2" "$3" "$4" "$res_trace"
+
+    # The plain core computes the flags lazily and the logging one eagerly:
+    # their final snapshots, flags included, must be identical.
+    snap_lazy=$(mktemp); snap_eager=$(mktemp)
+    ./main -q -s "$snap_lazy" -t "$2" -d "$3" "$1" > /dev/null
+    ./main -s "$snap_eager" -t "$2" -d "$3" "$1" > /dev/null 2>&1
+    cmp -s "$snap_lazy" "$snap_eager"
+    status=$?
+    rm -f "$snap_lazy" "$snap_eager"
+    [ "$status" -eq 0 ] || failwith "$1" "$2" "$3" "$4" "lazy and eager flags differ"
+
+    # The binary trace must decode to exactly the text log.
+    trace_bin=$(mktemp)
+    ./main -q -b "$trace_bin" -t "$2" -d "$3" "$1" > /dev/null
+    res_log=$(./main -t "$2" -d "$3" "$1" 2>&1 > /dev/null)
+    res_dump=$(./trace_dump "$trace_bin")
+    [ "$res_log" == "$res_dump" ] || { rm -f "$trace_bin"; failwith "$1" "$2" "$3" "$4" "$res_dump"; }
+
+    # And running against it must not diverge.
+    res_ref=$(./main -q -r "$trace_bin" -t "$2" -d "$3" "$1" 2>&1)
+    [ "$?" -eq 0 ] || { rm -f "$trace_bin"; failwith "$1" "$2" "$3" "$4" "$res_ref"; }
+    rm -f "$trace_bin"
+
+    # A single lane must end like the scalar core.
+    res_lanes=$(./main -q -t "$2" -D <(echo "$3") "$1")
+    [ "$res" == "$res_lanes" ] || failwith "$1" "$2" "$3" "$4" "$res_lanes"
+    # And so must a bit-sliced instance.
+    res_slices=$(./main -q -t "$2" -X <(echo "$3") "$1" | grep -v "^gates=")
+    [ "$res" == "$res_slices" ] || failwith "$1" "$2" "$3" "$4" "$res_slices"
 }
 
 # # To make a test case;
@@ -102,4 +145,328 @@ testentry 10 \
     "" \
     "x8=0"
 
+###
+###   A loop longer than a translated block, so that the "jne" reads the
+###   flags of an "addi" from the block before; stopping after 50 cycles
+###   leaves the second pass partly run.
+###
+###       0:	08 78 03 00 	li	a0, 3
+###
+###0000000000000004 loop:
+###       4:	19 f2 	addi	a1, 1
+###        ...	(31 times)
+###      42:	f8 f2 	addi	a0, -1
+###      44:	e0 45 	jne	-64
+###      46:	00 52 fe ff 	j	-2
+rom="08 78 03 00 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 19 f2 f8 f2 e0 45 00 52 fe ff"
+testentry 1000 "$rom" "" "x8=0	x9=93"
+testentry 50 "$rom" "" "x8=2	x9=47"
+
+# Its profile: 3 passes of 32 ADDIs, JNE taken twice.
+res=$(./main -q -p json -t "$rom" 1000 | tail -1)
+echo "$res" | grep '"ADDI": 96, "J": 1, "JNE": 3}, "branches": {"JNE": {"taken": 2, "not_taken": 1}}, "pairs": \[\["ADDI", "ADDI", 93\], \["ADDI", "JNE", 3\]' > /dev/null \
+    || failwith 1000 "$rom" "" "-p json" "$res"
+
+# Its cost: 101 cycles at 10 gates, 96 ADDIs at 100, 99 2-byte and 2
+# 4-byte fetches at 1 and 3.
+costs=$(mktemp)
+printf 'cycle 10  # fetch and decode\nADDI 100\nrom 2 1\nrom 4 3\ngate_time 0.01\n' > "$costs"
+res=$(./main -q -c "$costs" -t "$rom" 1000)
+echo "$res" | grep -E "^total +101 +10715 +107.15$" > /dev/null \
+    || { rm -f "$costs"; failwith 1000 "$rom" "" "-c: 10715 gates" "$res"; }
+# Without symbols, a function starts at each JAL target.
+###       0:	00 73 06 00 	jal	f
+###       4:	00 52 fe ff 	j	-2
+###       8:	18 f2 	f: addi	a0, 1
+###       a:	00 40 	jr	ra
+res=$(./main -q -c "$costs" -t "00 73 06 00 00 52 fe ff 18 f2 00 40" 100)
+rm -f "$costs"
+echo "$res" | grep -E "^0x0008 +2 +122 " > /dev/null \
+    || failwith 100 "jal f" "" "-c: 0x0008 with 122 gates" "$res"
+
+###
+###   Lockstep diff: "li a0, 43" against a trace of "li a0, 42".
+###
+trace_bin=$(mktemp)
+./main -q -b "$trace_bin" -t "08 78 2a 00" 1 > /dev/null
+res=$(./main -q -r "$trace_bin" -t "08 78 2b 00" 1 2>&1)
+status=$?
+rm -f "$trace_bin"
+[ "$status" -ne 0 ] && echo "$res" | grep "Trace diverged at cycle 0" > /dev/null \
+    || failwith 1 "08 78 2b 00" "" "Trace diverged at cycle 0" "$res"
+# Diverging on the instruction that halts is not a clean halt: "jr a0"
+# against a trace of "j -2", both at 4 with a0 = 4.
+trace_bin=$(mktemp)
+./main -q -b "$trace_bin" -t "08 78 04 00 00 52 fe ff" 10 > /dev/null
+res=$(./main -q -r "$trace_bin" -t "08 78 04 00 80 40" 10 2>&1)
+status=$?
+rm -f "$trace_bin"
+[ "$status" -ne 0 ] && echo "$res" | grep "Trace diverged at cycle 1" > /dev/null \
+    && ! echo "$res" | grep "halted" > /dev/null \
+    || failwith 10 "08 78 04 00 80 40" "" "Trace diverged at cycle 1, not halted" "$res"
+
+###
+###   Halting: the first program above stops on its "j -2" after 5 cycles,
+###   or before "j -2" with -H 8.
+###
+rom="01 78 fe 01 00 73 06 00 00 52 fe ff 08 78 2a 00 00 40"
+res=$(./main -q -t "$rom" 100000)
+echo "$res" | grep "cycles=5 (halted)" > /dev/null || failwith 100000 "$rom" "" "cycles=5 (halted)" "$res"
+res=$(./main -q -H 8 -t "$rom" 100000)
+echo "$res" | grep "cycles=4 (halt PC)" > /dev/null || failwith 100000 "$rom" "-H 8" "cycles=4 (halt PC)" "$res"
+res=$(./main -q -B 0x10 -t "$rom" 100000)
+echo "$res" | grep "cycles=3 (breakpoint)" > /dev/null || failwith 100000 "$rom" "-B 0x10" "cycles=3 (breakpoint)" "$res"
+
+###
+###   Memory sizes: a store to 0x8000 lands there with a 64K RAM and wraps
+###   to 0 with the default 512 bytes.
+###
+###       0:	08 78 00 80 	li	a0, 32768
+###       4:	09 78 2a 00 	li	a1, 42
+###       8:	98 92 00 00 	sw	a1, 0(a0)
+###       c:	8a b2 00 00 	lw	a2, 0(a0)
+###      10:	0b 78 00 00 	li	a3, 0
+###      14:	bb b2 00 00 	lw	a3, 0(a3)
+###      18:	00 52 fe ff 	j	-2
+rom="08 78 00 80 09 78 2a 00 98 92 00 00 8a b2 00 00 0b 78 00 00 bb b2 00 00 00 52 fe ff"
+res=$(./main -q -p table -t "$rom" 100)
+echo "$res" | grep -E "^loads +2$" > /dev/null && echo "$res" | grep -E "^stores +1$" > /dev/null \
+    || failwith 100 "$rom" "" "-p table: 2 loads, 1 store" "$res"
+res=$(./main -q -M 64K -t "$rom" 100)
+echo "$res" | grep "x10=42	x11=0" > /dev/null || failwith 100 "$rom" "-M 64K" "x10=42 x11=0" "$res"
+res=$(./main -q -t "$rom" 100)
+echo "$res" | grep "x10=42	x11=42" > /dev/null || failwith 100 "$rom" "" "x10=42 x11=42" "$res"
+./main -q -M 1000 -t "$rom" 100 > /dev/null 2>&1 && failwith 100 "$rom" "-M 1000" "Invalid memory size"
+
+# The store wraps to 0, so watching either byte of it stops right after it.
+for addr in 0x0000 0x0001; do
+    res=$(./main -q -W $addr -t "$rom" 100)
+    { echo "$res" | grep "cycles=3 (watchpoint)" && echo "$res" | grep "watch=$addr"; } > /dev/null \
+        || failwith 100 "$rom" "-W $addr" "cycles=3 (watchpoint)" "$res"
+done
+
+# RAM changes: the store at cycle 3, or at the end with one record per
+# 100 cycles, and the RAM at exit.
+delta=$(mktemp)
+./main -q -M 64K -u "$delta" -t "$rom" 100 > /dev/null
+res=$(cat "$delta")
+[ "$res" == "@3 8000:2a00" ] || { rm -f "$delta"; failwith 100 "$rom" "-M 64K -u" "@3 8000:2a00" "$res"; }
+./main -q -u "$delta" -U 100 -t "$rom" 100 > /dev/null
+res=$(cat "$delta")
+rm -f "$delta"
+[ "$res" == "@7 0000:2a00" ] || failwith 100 "$rom" "-u -U 100" "@7 0000:2a00" "$res"
+res=$(./main -q -F -t "$rom" 100)
+echo "$res" | grep "^2a 00 00 00 " > /dev/null || failwith 100 "$rom" "-F" "2a 00 00 00" "$res"
+
+###
+###   gdb stub on stdio: break at the "jr ra" of the halting program above
+###   (rom is reused below), read x8 and the ROM there, write x8, step
+###   to 8 and continue to the end.
+###
+gdbpkt() {
+    local sum=0 i
+    for ((i = 0; i < ${#1}; i++)); do sum=$(( (sum + $(printf '%d' "'${1:i:1}")) & 255 )); done
+    printf '$%s#%02x' "$1" $sum
+}
+rom="01 78 fe 01 00 73 06 00 00 52 fe ff 08 78 2a 00 00 40"
+res=$({ gdbpkt "Z0,10,2"; gdbpkt c; gdbpkt p8; gdbpkt "m10,2"; gdbpkt "P8=0700"; gdbpkt s; gdbpkt p10; gdbpkt c; gdbpkt D; } \
+    | ./main -q -g - -t "$rom" 100 2>&1)
+expect='+$OK#9a+$S05#b8+$2a00#f3+$0040#c4+$OK#9a+$S05#b8+$0800#c8+$S05#b8+$OK#9ax0=8	x1=510	x2=0	x3=0	x4=0	x5=0	x6=0	x7=0	x8=7	'
+[ "${res:0:${#expect}}" == "$expect" ] && echo "$res" | grep "cycles=5 (halted)" > /dev/null \
+    || failwith 100 "$rom" "-g -" "$expect" "$res"
+# Writes with bad hex digits and lengths that overflow are refused whole.
+res=$({ gdbpkt "M10000,2:11zz"; gdbpkt "m10000,2"; gdbpkt "G$(printf '0100%.0s' {1..17})xx00"; gdbpkt p8;
+        gdbpkt "M10000,80000000:"; gdbpkt "Z2,10000,ffffffff"; gdbpkt D; } \
+    | ./main -q -g - -t "$rom" 100 2>&1)
+expect='+$E01#a6+$0000#c0+$E01#a6+$0000#c0+$E01#a6+$E01#a6+$OK#9a'
+[ "${res:0:${#expect}}" == "$expect" ] || failwith 100 "$rom" "-g -" "$expect" "$res"
+
+###
+###   Snapshots: resuming from cycle 10 or from the end of a 12 cycle run
+###   of the loop below must end like one 30 cycle run.
+###
+snap_dir=$(mktemp -d)
+rom="08 b2 00 00 09 78 00 00 19 f2 f8 f2 08 d3 fd 45 00 52 fe ff"
+res=$(./main -q -t "$rom" -d "09 00" 30 | head -1)
+./main -q -S 5 -s "$snap_dir/snap" -t "$rom" -d "09 00" 12 > /dev/null
+res_every=$(./main -q -l "$snap_dir/snap.10" 20 | head -1)
+res_last=$(./main -q -l "$snap_dir/snap" 18 | head -1)
+rm -rf "$snap_dir"
+[ "$res" == "$res_every" ] || failwith 30 "$rom" "09 00" "-l snap.10" "$res_every"
+[ "$res" == "$res_last" ] || failwith 30 "$rom" "09 00" "-l snap" "$res_last"
+
+###
+###   ELF loading: a minimal ELF32 with ROM and RAM PT_LOAD segments, the
+###   latter with 2 bytes of .bss, built here as there is no toolchain.
+###
+###       0:	09 78 00 00 	li	a1, 0
+###       4:	98 b2 00 00 	lw	a0, 0(a1)
+###       8:	9a b2 02 00 	lw	a2, 2(a1)
+###       c:	00 52 fe ff 	j	-2
+le16() { printf '\\x%02x\\x%02x' $(($1 & 255)) $(($1 >> 8 & 255)); }
+le32() { le16 $(($1 & 0xffff)); le16 $(($1 >> 16)); }
+hex() { for b in $1; do printf '\\x%s' "$b"; done; }
+# make_elf FILE ROM RAM BSS_SIZE
+make_elf() {
+    local nrom=$(echo $2 | wc -w) nram=$(echo $3 | wc -w)
+    printf "$(hex "7f 45 4c 46 01 01 01 00 00 00 00 00 00 00 00 00")"
+    printf "$(le16 2)$(le16 0)$(le32 1)$(le32 0)$(le32 52)$(le32 0)$(le32 0)"
+    printf "$(le16 52)$(le16 32)$(le16 2)$(le16 40)$(le16 0)$(le16 0)"
+    printf "$(le32 1)$(le32 116)$(le32 0)$(le32 0)$(le32 $nrom)$(le32 $nrom)$(le32 5)$(le32 2)"
+    printf "$(le32 1)$(le32 $((116 + nrom)))$(le32 0x10000)$(le32 0x10000)"
+    printf "$(le32 $nram)$(le32 $((nram + $4)))$(le32 6)$(le32 2)"
+    printf "$(hex "$2")$(hex "$3")"
+} > "$1"
+elf=$(mktemp)
+rom="09 78 00 00 98 b2 00 00 9a b2 02 00 00 52 fe ff"
+make_elf "$elf" "$rom" "2a 00" 2
+res=$(./main -q "$elf" 100)
+echo "$res" | grep "x8=42	x9=0	x10=0" > /dev/null || { rm -f "$elf"; failwith 100 "$elf" "" "x8=42 x10=0" "$res"; }
+res=$(echo "100; @$elf; 00 00 07 00; x8=0 x10=7" | ./batch -j 1 /dev/stdin)
+status=$?
+[ "$status" -eq 0 ] || { rm -f "$elf"; failwith 100 "@$elf" "00 00 07 00" "x8=0 x10=7" "$res"; }
+# With 1000 bytes of bss, the data fits a 2K RAM only, and the case that
+# does not fit fails alone. Tabs separate bytes as spaces do.
+big=$(mktemp)
+make_elf "$big" "$rom" "2a 00" 1000
+manifest_big="100; @$big; ; x8=42
+100; 08 78"$'\t'"2a 00; ; x8=42"
+res=$(echo "$manifest_big" | ./batch -j 2 /dev/stdin 2> /dev/null)
+echo "$res" | grep "^1 passed, 1 failed" > /dev/null || { rm -f "$elf" "$big"; failwith 100 "@$big" "" "batch: 1 passed, 1 failed" "$res"; }
+res=$(echo "$manifest_big" | ./batch -j 2 -M 2K /dev/stdin)
+status=$?
+rm -f "$big"
+[ "$status" -eq 0 ] || { rm -f "$elf"; failwith 100 "@$big" "" "batch -M 2K: all passed" "$res"; }
+# The same translated to C by aot, with and without new RAM data.
+./aot "$elf" "$elf.c" && gcc -O2 -I. -o "$elf.aot" "$elf.c" aot_rt.o librv16k.a
+res=$("$elf.aot" 100; "$elf.aot" -d "00 00 07 00" 2)
+expect=$(./main -q "$elf" 100; ./main -q -d "00 00 07 00" -t "$rom" 2)
+rm -f "$elf" "$elf.c" "$elf.aot"
+[ "$res" == "$expect" ] || failwith 100 "$elf" "" "aot: $expect" "$res"
+
+###
+###   Lanes: one loop over 20 RAM images, diverging on the loop count.
+###
+###       0:	08 b2 00 00 	lw	a0, 0(zero)
+###       4:	09 78 00 00 	li	a1, 0
+###       8:	19 f2 	addi	a1, 1
+###       a:	f8 f2 	addi	a0, -1
+###       c:	08 d3 	cmpi	a0, 0
+###       e:	fd 45 	jne	-6
+###      10:	00 52 fe ff 	j	-2
+rom="08 b2 00 00 09 78 00 00 19 f2 f8 f2 08 d3 fd 45 00 52 fe ff"
+rams=$(for i in $(seq 1 20); do printf "%02x 00\n" $((i * 7 % 23 + 1)); done)
+res_lanes=$(./main -q -t "$rom" -D <(echo "$rams") 200)
+res_scalar=$(echo "$rams" | while read -r ram; do ./main -q -t "$rom" -d "$ram" 200; done)
+[ "$res_lanes" == "$res_scalar" ] || failwith 200 "$rom" "-D" "" "$res_lanes"
+res_slices=$(./main -q -t "$rom" -X <(echo "$rams") 200 | grep -v "^gates=")
+[ "$res_slices" == "$res_scalar" ] || failwith 200 "$rom" "-X" "" "$res_slices"
+# "li a0, 42" costs the 15 ORs of its zero flag, "j -2" nothing.
+res=$(./main -q -t "08 78 2a 00 00 52 fe ff" -X <(echo) 10 | tail -1)
+[ "$res" == "gates=15 mux=0" ] || failwith 10 "08 78 2a 00 00 52 fe ff" "-X" "gates=15 mux=0" "$res"
+
+###
+###   Forks through the library: the memories of a fork and of the handle
+###   it came from stay apart once either writes them, however written.
+###
+###       0:	09 78 f8 02 	li	a1, 760
+###       4:	08 78 55 00 	li	a0, 0x55
+###       8:	89 92 00 00 	sw	a0, 0(a1)
+###       c:	18 f2 	addi	a0, 1
+###       e:	29 f2 	addi	a1, 2
+###      10:	00 52 f6 ff 	j	-10
+fork_test=$(mktemp)
+gcc -O2 -I. -o "$fork_test" -x c - -x none librv16k.a <<'EOF'
+#include <stdio.h>
+#include "rv16k.h"
+
+static const unsigned char rom[] = {0x09, 0x78, 0xf8, 0x02, 0x08, 0x78, 0x55, 0x00,
+    0x89, 0x92, 0x00, 0x00, 0x18, 0xf2, 0x29, 0xf2, 0x00, 0x52, 0xf6, 0xff};
+static int failed;
+
+static int ram_at(struct rv16k *s, int addr)
+{
+    unsigned char b;
+    rv16k_read_ram(s, addr, &b, 1);
+    return b;
+}
+
+static void expect(const char *what, int val, int want)
+{
+    if (val != want) {
+        printf("%s: %d, expected %d\n", what, val, want);
+        failed = 1;
+    }
+}
+
+int main(void)
+{
+    struct rv16k *s = rv16k_new(512, 1024);
+    unsigned char one = 1, two = 2, li = 0x66;
+    rv16k_write_rom(s, 0, rom, sizeof(rom));
+    rv16k_write_ram(s, 0, &one, 1);
+    rv16k_write_ram(s, 760, &one, 1);
+
+    // The first fork shares the memories as they are.
+    struct rv16k *f1 = rv16k_fork(s);
+    rv16k_write_ram(s, 0, &two, 1);
+    rv16k_run(f1, 3);
+    expect("f1 ram[0]", ram_at(f1, 0), 1);
+    expect("f1 ram[760] after sw", ram_at(f1, 760), 0x55);
+    expect("s ram[0]", ram_at(s, 0), 2);
+    expect("s ram[760]", ram_at(s, 760), 1);
+
+    // What the parent writes since goes to later forks only, including
+    // the next RAM page, which only native code writes: the block at 0
+    // (6 instructions) runs once and the one at 8 (4) 24 times, natively
+    // from its second run on.
+    expect("set_jit", rv16k_set_jit(s, 1), 0);
+    rv16k_run(s, 102);
+    struct rv16k *f2 = rv16k_fork(s);
+    expect("f2 ram[0]", ram_at(f2, 0), 2);
+    expect("s ram[800]", ram_at(s, 800), 0x69);
+    expect("f2 ram[800]", ram_at(f2, 800), 0x69);
+    expect("f1 ram[760] after s ran", ram_at(f1, 760), 0x55);
+
+    // As do ROM writes, which a fork decodes anew.
+    rv16k_write_rom(s, 6, &li, 1);
+    struct rv16k *f3 = rv16k_fork(s);
+    rv16k_reset(f3);
+    rv16k_run(f3, 3);
+    expect("f3 ram[760] with the new rom", ram_at(f3, 760), 0x66);
+    rv16k_reset(f1);
+    rv16k_run(f1, 3);
+    expect("f1 ram[760] with the old rom", ram_at(f1, 760), 0x55);
+
+    // Forks of forks.
+    struct rv16k *f4 = rv16k_fork(f3);
+    rv16k_write_ram(f3, 0, &one, 1);
+    expect("f4 ram[0]", ram_at(f4, 0), 2);
+    expect("f4 ram[760]", ram_at(f4, 760), 0x66);
+
+    rv16k_free(f4);
+    rv16k_free(f3);
+    rv16k_free(f2);
+    rv16k_free(f1);
+    rv16k_free(s);
+    return failed;
+}
+EOF
+res=$("$fork_test")
+status=$?
+rm -f "$fork_test"
+[ "$status" -eq 0 ] || failwith 100 "rv16k_fork" "" "" "$res"
+
+###
+###   All of the above again in one process with the batch driver.
+###
+res=$(./batch -j 2 "$manifest")
+[ "$?" -eq 0 ] || { echo -e "\e[31m[ERROR]\e[m batch"; echo "$res"; exit 1; }
+
+###
+###   The benchmark programs, through the library API, must run every cycle.
+###
+res=$(./benchmark -n 100000 2>&1)
+[ "$?" -eq 0 ] || { echo -e "\e[31m[ERROR]\e[m benchmark"; echo "$res"; exit 1; }
+
 echo "ok"
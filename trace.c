@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "decode.h"
+#include "trace.h"
+
+void trace_print(FILE *fh, const struct trace_rec *r){
+    // Undefined instructions print nothing but the flags.
+    const char *name = inst_list[decode_table[r->inst]].name;
+    if(name != NULL){
+        fprintf(fh, "Inst:%s\t", name);
+        if(r->bits & TRACE_LONG)
+            fprintf(fh, "PC <= 0x%04X ", (uint16_t)(r->pc+2));
+        if(r->bits & TRACE_REG)
+            fprintf(fh, "Reg x%d <= 0x%04X ", r->reg_idx, r->reg_val);
+        if(r->bits & TRACE_MEM_B)
+            fprintf(fh, "DataRam[0x%04X] <= 0x%04X ", r->mem_addr, r->mem_val);
+        if(r->bits & TRACE_MEM_W){
+            fprintf(fh, "DataRam[0x%04X] <= 0x%04X ", r->mem_addr, r->mem_val&0xFF);
+            fprintf(fh, "DataRam[0x%04X] <= 0x%04X ", r->mem_addr+1, r->mem_val>>8);
+        }
+        fprintf(fh, "PC <= 0x%04X ", r->pc_next);
+    }
+    fprintf(fh, "FLAGS(SZCV) <= %d%d%d%d \n",
+            (r->bits>>3)&1, (r->bits>>2)&1, (r->bits>>1)&1, r->bits&1);
+}
+
+struct trace_writer *trace_open(const char *file_name){
+    struct trace_writer *w = malloc(sizeof(struct trace_writer));
+
+    if((w->fp = fopen(file_name, "wb")) == NULL){
+        fprintf(stderr, "Failed to open file :%s\n", file_name);
+        exit(1);
+    }
+    fwrite(TRACE_MAGIC, 1, 8, w->fp);
+    w->n = 0;
+    return w;
+}
+
+void trace_flush(struct trace_writer *w){
+    if(fwrite(w->buf, sizeof(struct trace_rec), w->n, w->fp) != w->n){
+        fprintf(stderr, "Failed to write trace\n");
+        exit(1);
+    }
+    w->n = 0;
+}
+
+void trace_close(struct trace_writer *w){
+    trace_flush(w);
+    fclose(w->fp);
+    free(w);
+}
+
+struct trace_reader *trace_open_read(const char *file_name){
+    struct trace_reader *r = malloc(sizeof(struct trace_reader));
+    char magic[8];
+
+    if((r->fp = fopen(file_name, "rb")) == NULL){
+        fprintf(stderr, "Failed to open file :%s\n", file_name);
+        exit(1);
+    }
+    if(fread(magic, 1, 8, r->fp) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0){
+        fprintf(stderr, "Not a trace file :%s\n", file_name);
+        exit(1);
+    }
+    r->n = 0;
+    r->pos = 0;
+    return r;
+}
+
+bool trace_read(struct trace_reader *r, struct trace_rec *rec){
+    if(r->pos == r->n){
+        r->n = fread(r->buf, sizeof(struct trace_rec), TRACE_BUF_RECS, r->fp);
+        r->pos = 0;
+        if(r->n == 0) return false;
+    }
+    *rec = r->buf[r->pos++];
+    return true;
+}
+
+void trace_close_read(struct trace_reader *r){
+    fclose(r->fp);
+    free(r);
+}
+
+struct trace_checker *trace_check_open(const char *file_name){
+    struct trace_checker *chk = malloc(sizeof(struct trace_checker));
+    chk->ref = trace_open_read(file_name);
+    chk->cycle = 0;
+    chk->diverged = false;
+    return chk;
+}
+
+// Fields that a record does not use may hold anything.
+static bool trace_rec_equal(const struct trace_rec *a, const struct trace_rec *b){
+    if(a->pc != b->pc || a->inst != b->inst || a->pc_next != b->pc_next || a->bits != b->bits)
+        return false;
+    if((a->bits & TRACE_REG) && (a->reg_idx != b->reg_idx || a->reg_val != b->reg_val))
+        return false;
+    if((a->bits & (TRACE_MEM_B|TRACE_MEM_W)) && (a->mem_addr != b->mem_addr || a->mem_val != b->mem_val))
+        return false;
+    return true;
+}
+
+bool trace_check(struct trace_checker *chk, const struct trace_rec *r){
+    struct trace_rec ref;
+    bool has_ref = trace_read(chk->ref, &ref);
+
+    if(has_ref && trace_rec_equal(&ref, r)){
+        chk->last[chk->cycle % TRACE_CONTEXT] = *r;
+        chk->cycle++;
+        return true;
+    }
+
+    chk->diverged = true;
+    fprintf(stderr, "Trace diverged at cycle %ld:\n", chk->cycle);
+    long first = chk->cycle > TRACE_CONTEXT ? chk->cycle - TRACE_CONTEXT : 0;
+    for(long i=first;i<chk->cycle;i++){
+        fprintf(stderr, "  %6ld: ", i);
+        trace_print(stderr, &chk->last[i % TRACE_CONTEXT]);
+    }
+    if(has_ref){
+        fprintf(stderr, "expected: ");
+        trace_print(stderr, &ref);
+    }
+    else {
+        fprintf(stderr, "expected: end of reference trace\n");
+    }
+    fprintf(stderr, "actual:   ");
+    trace_print(stderr, r);
+    return false;
+}
+
+void trace_check_close(struct trace_checker *chk){
+    trace_close_read(chk->ref);
+    free(chk);
+}
@@ -0,0 +1,98 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+
+// trace_rec.bits: SZCV flags in the low nibble, what happened in the high one.
+#define TRACE_FLAGS 0x0F
+#define TRACE_LONG  0x10    // 4-byte instruction
+#define TRACE_REG   0x20    // reg_idx <= reg_val
+#define TRACE_MEM_B 0x40    // DataRam[mem_addr] <= mem_val (one byte)
+#define TRACE_MEM_W 0x80    // DataRam[mem_addr..mem_addr+1] <= mem_val
+
+// One cycle of execution. Stored as is (host byte order) in binary traces.
+struct trace_rec {
+    uint16_t pc;
+    uint16_t inst;
+    uint16_t pc_next;
+    uint16_t reg_val;
+    uint16_t mem_addr;
+    uint16_t mem_val;
+    uint8_t reg_idx;
+    uint8_t bits;
+};
+
+#define TRACE_MAGIC "RV16KTR1"
+#define TRACE_BUF_RECS 4096
+
+struct trace_writer {
+    FILE *fp;
+    int n;
+    struct trace_rec buf[TRACE_BUF_RECS];
+};
+
+struct trace_reader {
+    FILE *fp;
+    int n;
+    int pos;
+    struct trace_rec buf[TRACE_BUF_RECS];
+};
+
+// Compares execution against a reference trace, remembering the last
+// TRACE_CONTEXT matching cycles to show when they diverge.
+#define TRACE_CONTEXT 8
+struct trace_checker {
+    struct trace_reader *ref;
+    long cycle;
+    bool diverged;
+    struct trace_rec last[TRACE_CONTEXT];
+};
+
+static inline void trace_begin(struct trace_rec *r, uint16_t pc, uint16_t inst, uint8_t len){
+    r->pc = pc;
+    r->inst = inst;
+    r->bits = len == 4 ? TRACE_LONG : 0;
+}
+
+static inline void trace_reg(struct trace_rec *r, uint8_t reg_idx, uint16_t val){
+    r->bits |= TRACE_REG;
+    r->reg_idx = reg_idx;
+    r->reg_val = val;
+}
+
+static inline void trace_mem(struct trace_rec *r, uint8_t kind, uint16_t addr, uint16_t val){
+    r->bits |= kind;
+    r->mem_addr = addr;
+    r->mem_val = val;
+}
+
+static inline void trace_end(struct trace_rec *r, uint16_t pc_next,
+                             uint8_t s, uint8_t z, uint8_t c, uint8_t v){
+    r->pc_next = pc_next;
+    r->bits |= (s<<3)|(z<<2)|(c<<1)|v;
+}
+
+// Print a record in the text format of the log.
+void trace_print(FILE *fh, const struct trace_rec *r);
+
+struct trace_writer *trace_open(const char *file_name);
+void trace_flush(struct trace_writer *w);
+void trace_close(struct trace_writer *w);
+
+static inline void trace_write(struct trace_writer *w, const struct trace_rec *r){
+    w->buf[w->n++] = *r;
+    if(w->n == TRACE_BUF_RECS)
+        trace_flush(w);
+}
+
+struct trace_reader *trace_open_read(const char *file_name);
+bool trace_read(struct trace_reader *r, struct trace_rec *rec);
+void trace_close_read(struct trace_reader *r);
+
+struct trace_checker *trace_check_open(const char *file_name);
+bool trace_check(struct trace_checker *chk, const struct trace_rec *r);
+void trace_check_close(struct trace_checker *chk);
+
+#endif
@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "inst.h"
+#include "decode.h"
+#include "trace.h"
+
+// Print a binary trace written by `rv16k-sim -b FILE` in the text
+// format of the log.
+int main(int argc, char *argv[]){
+    if(argc != 2){
+        fprintf(stderr, "Usage: trace_dump FILE\n");
+        return 1;
+    }
+
+    struct trace_reader *r = trace_open_read(argv[1]);
+    struct trace_rec rec;
+
+    decode_init();
+    while(trace_read(r, &rec))
+        trace_print(stdout, &rec);
+
+    trace_close_read(r);
+    return 0;
+}